@@ -0,0 +1,338 @@
+/*
+ * Sampling an AdsSource (see ads1115.h) as fast as it converts.
+ *
+ * A sampling thread waits on each conversion, stamps it, reads it and
+ * pushes it into an SpscRing that was sized up front. Nothing on that path
+ * allocates, formats text or touches the disk, so it keeps up with the
+ * chip; if the ring ever fills, the conversion is counted and dropped
+ * rather than holding up the next. A writer thread takes them off the
+ * ring and hands them to an AdsWriter, which collects a batch and writes
+ * it with one write(), either as binary AdsRecords or as "t x y z" lines:
+ * the values read_ads always wrote, after the seconds since it started
+ * when the last of them was taken. A batch that's been waiting flush_ms
+ * goes out half full, so something reading the other end of a pipe (like
+ * rf24_transfer -S) isn't kept waiting. The times on the lines are what
+ * keeps their spacing, however they're batched.
+ *
+ * A binary file is an AdsFileHeader and then the records, in the host's
+ * byte order.
+ */
+
+#ifndef ACQUISITION_H
+#define ACQUISITION_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "ads1115.h"
+#include "clock.h"
+#include "spsc_ring.h"
+
+struct AdsRecord
+{
+	uint64_t t_us;   // When the conversion finished, in us since the file started
+	uint32_t seq;    // Counts every conversion kept, a gap is ones the ring had no room for
+	int16_t value;
+	uint8_t channel;
+	uint8_t flags;   // Nothing yet
+};
+static_assert(sizeof(AdsRecord) == 16, "records are written as they are");
+
+struct AdsFileHeader
+{
+	char magic[4];           // "ADS1"
+	uint16_t record_bytes;   // sizeof(AdsRecord)
+	uint16_t rate;           // Conversions a second, 0 if they weren't paced
+	uint64_t start_unix_us;  // The wall clock when t_us was 0
+};
+static_assert(sizeof(AdsFileHeader) == 16, "the header is written as it is");
+
+/* Write all of buf to fd, or say why not */
+inline bool write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	while(len > 0)
+	{
+		ssize_t n = ::write(fd, p, len);
+		if(n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Collects records and writes them to fd a batch at a time */
+class AdsWriter
+{
+public:
+	/* With text, a line for every time round channels. batch_records is how many make a batch. */
+	AdsWriter(int out, bool text, const std::vector<uint8_t> &channels, size_t batch_records) :
+		fd(out), as_text(text), chans(channels), batch(batch_records), num_records(0), num_batches(0), failed(false)
+	{
+		records.reserve(batch);
+		// "18446744073709.551615", " -32768" a channel and the newline
+		line_bytes = 21 + 7 * chans.size() + 1;
+		text_buf.resize(batch * line_bytes);
+		text_len = 0;
+		memset(line, 0, sizeof(line));
+	}
+
+	/* Before the first record: a binary file starts with its header */
+	void begin(uint16_t rate, uint64_t start_unix_us)
+	{
+		if(as_text)
+			return;
+		AdsFileHeader h;
+		memcpy(h.magic, "ADS1", 4);
+		h.record_bytes = sizeof(AdsRecord);
+		h.rate = rate;
+		h.start_unix_us = start_unix_us;
+		if(write_all(fd, &h, sizeof(h)) == false)
+			failed = true;
+	}
+
+	void add(const AdsRecord &r)
+	{
+		num_records++;
+		if(as_text == false)
+		{
+			records.push_back(r);
+			if(records.size() >= batch)
+				flush();
+			return;
+		}
+		line[r.channel & 3] = r.value;
+		if(r.channel != chans.back())
+			return;
+		char *p = &text_buf[text_len];
+		p += format_time(p, r.t_us);
+		for(size_t c = 0; c < chans.size(); c++)
+			p += format_value(p, line[chans[c] & 3]);
+		*p++ = '\n';
+		text_len = p - &text_buf[0];
+		if(text_len + line_bytes > text_buf.size())
+			flush();
+	}
+
+	bool pending() const { return records.empty() == false || text_len > 0; }
+
+	void flush()
+	{
+		if(pending() == false)
+			return;
+		bool ok = as_text ? write_all(fd, &text_buf[0], text_len) : write_all(fd, records.data(), records.size() * sizeof(AdsRecord));
+		if(ok == false)
+			failed = true;
+		records.clear();
+		text_len = 0;
+		num_batches++;
+	}
+
+	uint64_t written() const { return num_records; }
+	uint64_t batches() const { return num_batches; }
+	/* A write went wrong, the disk's full or the pipe's gone */
+	bool failing() const { return failed; }
+
+private:
+	int fd;
+	bool as_text;
+	std::vector<uint8_t> chans;
+	size_t batch;
+	std::vector<AdsRecord> records;
+	std::vector<char> text_buf;
+	size_t text_len, line_bytes;
+	int16_t line[ads_num_channels]; // The latest value from each channel
+	uint64_t num_records, num_batches;
+	std::atomic<bool> failed;
+
+	/* " %d" without printf, which was most of what read_ads spent its time on */
+	static int format_value(char *out, int16_t value)
+	{
+		int len = 0;
+		out[len++] = ' ';
+		if(value < 0)
+			out[len++] = '-';
+		return len + format_digits(out + len, value < 0 ? -(int32_t)value : value, 1);
+	}
+
+	/* us as "%llu.%06llu" seconds, the way rf24_transfer -S reads them */
+	static int format_time(char *out, uint64_t us)
+	{
+		int len = format_digits(out, us / 1000000, 1);
+		out[len++] = '.';
+		return len + format_digits(out + len, us % 1000000, 6);
+	}
+
+	/* v in decimal, padded with zeros to at least width digits */
+	static int format_digits(char *out, uint64_t v, int width)
+	{
+		char digits[20];
+		int n = 0;
+		do
+		{
+			digits[n++] = '0' + v % 10;
+			v /= 10;
+		} while(v > 0 || n < width);
+		int len = 0;
+		while(n > 0)
+			out[len++] = digits[--n];
+		return len;
+	}
+};
+
+/* Samples adc round channels on one thread and writes them out on another, until stop() */
+class Acquisition : public CacheAligned
+{
+public:
+	Acquisition(AdsSource &source, const std::vector<uint8_t> &channels, size_t ring_records, AdsWriter &out, uint32_t flush_ms) :
+		adc(source), chans(channels), ring(ring_records), writer(out), flush_us(flush_ms * 1000), sampling(true), writing(true),
+		num_samples(0), num_overflowed(0), num_timeouts(0), num_errors(0), max_depth(0)
+	{
+		start_us = now_us();
+		start_unix = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		writer.begin(adc.rate(), start_unix);
+		sample_thread = std::thread(&Acquisition::sample, this);
+		write_thread = std::thread(&Acquisition::write, this);
+	}
+
+	~Acquisition() { stop(); }
+
+	/* Stop sampling, then write out whatever's left */
+	void stop()
+	{
+		if(sample_thread.joinable())
+		{
+			sampling = false;
+			sample_thread.join();
+		}
+		if(write_thread.joinable())
+		{
+			writing = false;
+			write_thread.join();
+		}
+	}
+
+	uint64_t start_unix_us() const { return start_unix; }
+	/* Conversions read, whether or not there was room for them */
+	uint64_t samples() const { return num_samples; }
+	uint64_t overflowed() const { return num_overflowed; }
+	/* Times a conversion didn't turn up */
+	uint64_t timeouts() const { return num_timeouts; }
+	/* Reads that failed */
+	uint64_t errors() const { return num_errors; }
+	size_t ring_peak() const { return max_depth; }
+	size_t ring_capacity() const { return ring.capacity(); }
+
+private:
+	// How long the sampling thread waits on a conversion before counting it missing
+	static const int ready_timeout_ms = 100;
+	// How long the writer sleeps on an empty ring
+	static const uint32_t writer_idle_us = 1000;
+
+	AdsSource &adc;
+	std::vector<uint8_t> chans;
+	SpscRing<AdsRecord> ring;
+	AdsWriter &writer;
+	uint64_t flush_us;
+	uint64_t start_us, start_unix;
+	std::atomic<bool> sampling, writing;
+	std::thread sample_thread, write_thread;
+	std::atomic<uint64_t> num_samples, num_overflowed, num_timeouts, num_errors;
+	std::atomic<size_t> max_depth;
+
+	void sample()
+	{
+		// At 860 a second there's a conversion every 1.2ms, so jump the
+		// queue when we're allowed to (we usually run as root for the I2C).
+		// Not for a source that never waits, it'd starve the writer.
+		if(adc.rate() > 0)
+		{
+			struct sched_param sp;
+			sp.sched_priority = sched_get_priority_min(SCHED_FIFO);
+			pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		}
+
+		size_t c = 0;
+		uint32_t seq = 0;
+		bool settling = false; // The conversion after a mux switch may be the old channel's
+		if(adc.start(chans[0]) == false)
+			num_errors++;
+		while(sampling)
+		{
+			if(adc.wait_ready(ready_timeout_ms) == false)
+			{
+				num_timeouts++;
+				continue;
+			}
+			uint64_t t = now_us() - start_us;
+			if(settling)
+			{
+				settling = false;
+				continue;
+			}
+			AdsRecord r;
+			if(adc.read(&r.value) == false)
+			{
+				num_errors++;
+				continue;
+			}
+			r.t_us = t;
+			r.seq = seq++;
+			r.channel = chans[c];
+			r.flags = 0;
+			num_samples++;
+			if(ring.push(r) == false)
+				num_overflowed++;
+			if(chans.size() > 1)
+			{
+				c = (c + 1) % chans.size();
+				if(adc.start(chans[c]) == false)
+					num_errors++;
+				settling = true;
+			}
+		}
+		adc.stop();
+	}
+
+	void write()
+	{
+		uint64_t batch_start = 0; // When the batch being collected got its first record
+		while(true)
+		{
+			// Only done once sampling is and the ring's been emptied after it
+			bool done = writing == false;
+			size_t depth = ring.size();
+			if(depth > max_depth)
+				max_depth = depth;
+			AdsRecord r;
+			bool got = false;
+			while(ring.pop(r))
+			{
+				if(writer.pending() == false)
+					batch_start = now_us();
+				writer.add(r);
+				got = true;
+			}
+			if(done)
+				break;
+			if(writer.pending() && now_us() - batch_start >= flush_us)
+				writer.flush();
+			if(got == false)
+				std::this_thread::sleep_for(std::chrono::microseconds(writer_idle_us));
+		}
+		writer.flush();
+	}
+};
+
+#endif
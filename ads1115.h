@@ -0,0 +1,222 @@
+/*
+ * ADS1115 in continuous conversion mode, over Linux's i2c-dev.
+ *
+ * wiringPi's driver starts a single shot conversion for every analogRead()
+ * and polls until it's done, so each reading costs a conversion plus
+ * several I2C round trips. In continuous mode the chip converts on its own
+ * at 860 samples a second, and with the comparator set up as a conversion
+ * ready signal (Hi_thresh MSB 1, Lo_thresh MSB 0) it pulses ALERT/RDY low
+ * when each one's done. Wired to a GPIO that's an edge to wait on (see
+ * gpio_irq.h); without it we go by the clock, which is only as good as
+ * the chip's oscillator (+-10%).
+ *
+ * The chip has one converter behind a mux, so there's only ever one
+ * channel converting. Sampling several means switching the mux between
+ * them, and since the conversion under way when it changes may have
+ * started on the old channel, the first one after a switch is thrown away.
+ *
+ * MockAds is the same thing without the chip, for running and timing all
+ * of this on any Linux box: a sine wave per channel at whatever rate,
+ * with 0 for as fast as it can be read.
+ */
+
+#ifndef ADS1115_H
+#define ADS1115_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/i2c-dev.h>
+
+#include <chrono>
+#include <thread>
+
+#include "gpio_irq.h"
+
+const int ads_num_channels = 4;
+const uint32_t ads_max_rate = 860; // Samples a second at the fastest data rate
+
+class AdsSource
+{
+public:
+	virtual ~AdsSource() {}
+
+	/* Start converting channel, from now on. Returns false if the chip can't be reached. */
+	virtual bool start(uint8_t channel) = 0;
+	/* Wait up to timeout_ms for the next conversion. Returns false if there wasn't one. */
+	virtual bool wait_ready(int timeout_ms) = 0;
+	/* The last conversion */
+	virtual bool read(int16_t *value) = 0;
+	/* Stop converting */
+	virtual void stop() = 0;
+	/* Conversions a second, 0 for as fast as they're read */
+	virtual uint32_t rate() const = 0;
+};
+
+class Ads1115 : public AdsSource
+{
+public:
+	Ads1115() : fd(-1), pointer(-1), period_us(1000000 / ads_max_rate) {}
+	~Ads1115() { stop(); close(); }
+
+	/* bus e.g. /dev/i2c-1, rdy_pin the BCM GPIO ALERT/RDY is wired to or -1 */
+	bool open(const char *bus, int address, int rdy_pin)
+	{
+		fd = ::open(bus, O_RDWR);
+		if(fd < 0)
+			return false;
+		if(ioctl(fd, I2C_SLAVE, address) < 0)
+		{
+			close();
+			return false;
+		}
+		// ALERT/RDY goes low for a moment at the end of every conversion
+		if(write_reg(reg_lo_thresh, 0x0000) == false || write_reg(reg_hi_thresh, 0x8000) == false)
+		{
+			close();
+			return false;
+		}
+		if(rdy_pin >= 0 && rdy.open(rdy_pin) == false)
+			fprintf(stderr, "Couldn't use GPIO %d for ALERT/RDY, going by the clock.\n", rdy_pin);
+		return true;
+	}
+
+	void close()
+	{
+		rdy.close();
+		if(fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+
+	/* Waits on ALERT/RDY rather than the clock */
+	bool has_rdy() const { return rdy.ready(); }
+
+	bool start(uint8_t channel)
+	{
+		// AINx against GND, +-4.096V, continuous, 860 SPS, comparator
+		// asserting after one conversion, which makes it the RDY signal
+		uint16_t config = (4 + (channel & 3)) << 12 | pga_4_096v | dr_860sps;
+		last_ready = std::chrono::steady_clock::now();
+		return write_reg(reg_config, config);
+	}
+
+	bool wait_ready(int timeout_ms)
+	{
+		if(rdy.ready())
+			return rdy.wait(timeout_ms);
+		last_ready += std::chrono::microseconds(period_us);
+		std::this_thread::sleep_until(last_ready);
+		return true;
+	}
+
+	bool read(int16_t *value)
+	{
+		uint8_t buf[2];
+		if(point_at(reg_conversion) == false || ::read(fd, buf, 2) != 2)
+			return false;
+		*value = (int16_t)(buf[0] << 8 | buf[1]);
+		return true;
+	}
+
+	void stop()
+	{
+		// Back to the power-on default, a single shot that's already done
+		if(fd >= 0)
+			write_reg(reg_config, 0x8583);
+	}
+
+	uint32_t rate() const { return ads_max_rate; }
+
+private:
+	static const uint8_t reg_conversion = 0x00;
+	static const uint8_t reg_config = 0x01;
+	static const uint8_t reg_lo_thresh = 0x02;
+	static const uint8_t reg_hi_thresh = 0x03;
+	static const uint16_t pga_4_096v = 0x0200;
+	static const uint16_t dr_860sps = 0x00e0;
+
+	int fd;
+	int pointer; // The register reads come from, a write to one moves it
+	uint32_t period_us;
+	GpioIrq rdy;
+	std::chrono::steady_clock::time_point last_ready;
+
+	bool write_reg(uint8_t reg, uint16_t value)
+	{
+		uint8_t buf[3] = { reg, (uint8_t)(value >> 8), (uint8_t)value };
+		pointer = reg;
+		return ::write(fd, buf, 3) == 3;
+	}
+
+	/* Reads of the same register one after another don't need the pointer written again */
+	bool point_at(uint8_t reg)
+	{
+		if(pointer == reg)
+			return true;
+		pointer = reg;
+		return ::write(fd, &reg, 1) == 1;
+	}
+};
+
+class MockAds : public AdsSource
+{
+public:
+	/* samples_per_sec 0 for as fast as they're read */
+	explicit MockAds(uint32_t samples_per_sec) : sps(samples_per_sec), channel(0), n(0), running(false) {}
+
+	bool start(uint8_t c)
+	{
+		channel = c & 3;
+		if(running == false)
+			next = std::chrono::steady_clock::now();
+		running = true;
+		return true;
+	}
+
+	bool wait_ready(int timeout_ms)
+	{
+		if(running == false)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+			return false;
+		}
+		n++;
+		if(sps == 0)
+			return true;
+		std::chrono::microseconds period(1000000 / sps);
+		next += period;
+		// Like the chip, conversions nobody was waiting for are gone
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if(now - next > period)
+		{
+			n += (now - next) / period;
+			next += (now - next) / period * period;
+		}
+		std::this_thread::sleep_until(next);
+		return true;
+	}
+
+	bool read(int16_t *value)
+	{
+		// Each channel a different frequency, so they're easy to tell apart on a plot
+		*value = (int16_t)(10000 * sin(n * 0.01 * (channel + 1)));
+		return true;
+	}
+
+	void stop() { running = false; }
+
+	uint32_t rate() const { return sps; }
+
+private:
+	uint32_t sps;
+	uint8_t channel;
+	uint64_t n; // Conversions so far
+	bool running;
+	std::chrono::steady_clock::time_point next;
+};
+
+#endif
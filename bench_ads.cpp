@@ -0,0 +1,139 @@
+/*
+ * Samples a second through the acquisition engine (acquisition.h), and
+ * what writing them out costs next to the cout loop read_ads used to
+ * have. Runs anywhere on the mock ADC; with -a the paced run is on the
+ * real ads1115 instead, so run that one on the Pi.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "ads1115.h"
+#include "acquisition.h"
+
+using namespace std;
+
+const int num_records = 1 << 20;
+const size_t ring_records = 1 << 16;
+const char *paced_file = "/tmp/bench_ads.bin";
+
+double now_s()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Records a second through an AdsWriter to /dev/null */
+void time_writer(const char *name, bool text, const vector<uint8_t> &channels, size_t batch)
+{
+	int fd = open("/dev/null", O_WRONLY);
+	AdsWriter writer(fd, text, channels, batch);
+	double start = now_s();
+	for(int i = 0; i < num_records; i++)
+	{
+		AdsRecord r = { (uint64_t)i * 1163, (uint32_t)i, (int16_t)(i * 37), channels[i % channels.size()], 0 };
+		writer.add(r);
+	}
+	writer.flush();
+	double s = now_s() - start;
+	close(fd);
+	printf("%-28s %10.0f samples/sec\n", name, num_records / s);
+}
+
+/* What read_ads did for every 3 samples: cout them as text */
+void time_cout()
+{
+	ofstream null("/dev/null");
+	streambuf *was = cout.rdbuf(null.rdbuf());
+	double start = now_s();
+	for(int i = 0; i < num_records; i += 3)
+		cout << " " << (int16_t)(i * 37) << " " << (int16_t)(i * 41) << " " << (int16_t)(i * 43) << "\n";
+	cout.flush();
+	double s = now_s() - start;
+	cout.rdbuf(was);
+	printf("%-28s %10.0f samples/sec\n", "cout, 3 channels", num_records / s);
+}
+
+/* Run the whole engine for seconds, writing to filename */
+void time_engine(const char *name, AdsSource &adc, const vector<uint8_t> &channels, bool text, const char *filename, int seconds)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	AdsWriter writer(fd, text, channels, text ? 64 : 4096);
+	double start = now_s();
+	unique_ptr<Acquisition> acq(new Acquisition(adc, channels, ring_records, writer, 10));
+	sleep(seconds);
+	acq->stop();
+	double s = now_s() - start;
+	close(fd);
+	printf("%-28s %10.0f samples/sec, %.0f written, %llu the ring had no room for\n", name, acq->samples() / s,
+		writer.written() / s, (unsigned long long)acq->overflowed());
+}
+
+/* How evenly spaced the samples in a file from time_engine() are */
+void check_spacing(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	AdsFileHeader h;
+	if(f == NULL || fread(&h, sizeof(h), 1, f) != 1)
+		return;
+	AdsRecord r, last;
+	uint64_t n = 0, gaps = 0, biggest = 0, first_us = 0;
+	while(fread(&r, sizeof(r), 1, f) == 1)
+	{
+		if(n == 0)
+			first_us = r.t_us;
+		else
+		{
+			gaps += r.seq - last.seq - 1;
+			if(r.t_us - last.t_us > biggest)
+				biggest = r.t_us - last.t_us;
+		}
+		last = r;
+		n++;
+	}
+	fclose(f);
+	if(n < 2)
+		return;
+	printf("%-28s %10.1f us apart on average, %llu us at most, %llu lost to a full ring\n", "", (double)(last.t_us - first_us) / (n - 1),
+		(unsigned long long)biggest, (unsigned long long)gaps);
+}
+
+int main(int argc, char **argv)
+{
+	bool hardware = argc > 1 && string(argv[1]) == "-a";
+	vector<uint8_t> one = { 0 }, three = { 0, 1, 2 };
+
+	time_cout();
+	time_writer("AdsWriter text, 3 channels", true, three, 64);
+	time_writer("AdsWriter binary", false, one, 4096);
+
+	MockAds unpaced(0);
+	time_engine("unpaced mock, binary", unpaced, one, false, "/dev/null", 2);
+	time_engine("unpaced mock, 3 ch text", unpaced, three, true, "/dev/null", 2);
+
+	unique_ptr<AdsSource> adc;
+	if(hardware)
+	{
+		Ads1115 *ads = new Ads1115();
+		adc.reset(ads);
+		if(ads->open("/dev/i2c-1", 0x48, 25) == false)
+		{
+			perror("Couldn't talk to the ads1115");
+			return 1;
+		}
+	}
+	else
+		adc.reset(new MockAds(ads_max_rate));
+	time_engine(hardware ? "ads1115, binary" : "mock at 860, binary", *adc, one, false, paced_file, 3);
+	check_spacing(paced_file);
+	unlink(paced_file);
+	return 0;
+}
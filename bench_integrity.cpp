@@ -0,0 +1,66 @@
+/*
+ * How long each frame check takes per 32 byte frame, and how fast the
+ * whole file digest goes. Run it on the Pi itself, that's where it counts.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+#include "integrity.h"
+
+using namespace std;
+
+const int num_frames = 4096;
+const int num_rounds = 200;
+
+// Keeps the compiler from throwing the work away
+volatile uint32_t sink;
+
+double now_ns()
+{
+	return chrono::duration<double, nano>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename F>
+void time_frames(const char *name, vector<uint8_t> &frames, F check)
+{
+	uint32_t acc = 0;
+	double start = now_ns();
+	for(int r = 0; r < num_rounds; r++)
+	{
+		for(int i = 0; i < num_frames; i++)
+			acc += check(&frames[i * 32]);
+	}
+	double ns = (now_ns() - start) / ((double)num_rounds * num_frames);
+	sink = acc;
+	printf("%-22s %7.1f ns/frame\n", name, ns);
+}
+
+int main(void)
+{
+	vector<uint8_t> frames(num_frames * 32);
+	srand(1);
+	for(size_t i = 0; i < frames.size(); i++)
+		frames[i] = rand();
+
+	time_frames("fletcher_8", frames, [](const uint8_t *f) { return (uint32_t)fletcher_8(f + 2, 29); });
+	time_frames("crc16 bytewise", frames, [](const uint8_t *f) { return crc16_tables().update_bytewise(0xffff, f, 30); });
+	time_frames("crc16 slicing-by-8", frames, [](const uint8_t *f) { return (uint32_t)crc16(f, 30); });
+	time_frames("crc32c slicing-by-8", frames, [](const uint8_t *f) { return crc32c_tables().update(0xffffffff, f, 28); });
+	time_frames(crc32c_in_hardware() ? "crc32c hardware" : "crc32c (no hardware)", frames, [](const uint8_t *f) { return crc32c(f, 28); });
+
+	vector<uint8_t> block(16 * 1024 * 1024);
+	for(size_t i = 0; i < block.size(); i++)
+		block[i] = i * 131;
+	double start = now_ns();
+	Xxh64 h;
+	for(int r = 0; r < 4; r++)
+		h.update(block.data(), block.size());
+	sink = h.digest();
+	double secs = (now_ns() - start) / 1e9;
+	printf("%-22s %7.0f MB/s\n", "xxh64", 4 * block.size() / secs / 1e6);
+	return 0;
+}
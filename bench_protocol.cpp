@@ -0,0 +1,582 @@
+/*
+ * Benchmarks for the transfer itself, to catch a slowdown before it gets
+ * flashed onto the nodes:
+ *
+ *  - per frame kernels: the fletcher_8 check, building a data frame from
+ *    the file, through the run time check or straight from its DataFrame
+ *    layout, the payload copy, and packing a frame for the air and back
+ *  - recovery bookkeeping: listing what's missing, building the retransmit
+ *    requests, and the transmitter collecting the ids out of them the way
+ *    send_missing_pkts() does, for files from 1KB up to the packet id limit
+ *  - whole simulated transfers with rf24_transfer -L, with fixed loss seeds,
+ *    read back out of its -T telemetry
+ *  - files right at the old 65535 packet limit, one byte past it and a few
+ *    segments long, checked byte for byte, and what the two ends take to
+ *    keep track of a segment of them
+ *
+ * Every number is checked against bench_baseline.csv and the run fails if
+ * any got worse by more than the tolerance. Kernel and bookkeeping times
+ * depend on the CPU, so they're only compared on the machine the baseline
+ * came from, and they're the best of a few passes over all of them: a
+ * busy machine comes and goes for seconds at a time, and only ever makes a
+ * number slower. The simulator paces itself to the air time, so its
+ * numbers hold anywhere, though a busy machine slows it too. If anything
+ * still looks worse, its group is run again, a few more times, keeping the
+ * best, before it counts. -u writes this run out as the new baseline.
+ *
+ * Run it on the Pi itself, that's where the kernel numbers count.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "packets.h"
+
+using namespace std;
+
+const int num_frames = 4096;
+const int num_rounds = 200;
+const int num_tries = 5;
+// Passes over the kernels and bookkeeping, and more of them for a number that looks worse
+const int num_passes = 3;
+const int num_rechecks = 3;
+
+// Loss the bookkeeping is timed at, and the file sizes, in packets
+const double bookkeeping_loss = 0.05;
+const uint32_t bookkeeping_sizes[] = { 1024 / num_payload_bytes + 1, 64 * 1024 / num_payload_bytes + 1, 1024 * 1024 / num_payload_bytes + 1, max_data_ids };
+const char *bookkeeping_names[] = { "1KB", "64KB", "1MB", "id_limit" };
+
+// Simulated transfers, all of the same file at a quarter of real time
+const size_t transfer_bytes = 128 * 1024;
+struct transfer_config
+{
+	const char *name;
+	const char *options;
+};
+const transfer_config transfers[] = {
+	{ "clean", "-L loss=0,seed=1,speed=4" },
+	{ "loss5", "-L loss=0.05,seed=2,speed=4" },
+	{ "bursty", "-L ge=0.01/0.3,seed=3,speed=4" },
+	{ "corrupt_crc32c", "-L loss=0.05,corrupt=0.002,seed=4,speed=4 -c crc32c" },
+	{ "fec", "-L loss=0.05,seed=5,speed=4 -f 32/4" },
+	{ "ack_reports", "-L loss=0.05,seed=6,speed=4 -a" },
+	{ "burst", "-L loss=0.05,seed=7,speed=4 -b" },
+};
+
+// Files past what 16 bit packet ids could count, unpaced since they're big.
+// Their times depend on the CPU, so only their bookkeeping is compared.
+// They're sent with the default check, CRC-16.
+const uint64_t large_payload_bytes = crc16_frame::payload_bytes;
+struct large_config
+{
+	const char *name;
+	uint64_t bytes;
+	const char *options;
+};
+const large_config large_transfers[] = {
+	{ "id_limit", 65535 * large_payload_bytes, "-L loss=0.05,seed=8,speed=0" },
+	{ "id_limit_plus1", 65535 * large_payload_bytes + 1, "-L loss=0.05,seed=9,speed=0" },
+	{ "4_segments", 3 * max_data_ids * large_payload_bytes + 1000, "-L loss=0.05,seed=10,speed=0" },
+};
+
+// How much worse than the baseline a number can get before it counts. The
+// smallest ones are mostly timer and scheduler noise, so they also have to
+// be out by at least a little, see slack().
+const double tolerance = 0.25;
+
+// Keeps the compiler from throwing the work away
+volatile uint32_t sink;
+
+struct result
+{
+	string group; // kernel, bookkeeping, sim or large
+	string name;
+	double value;
+	const char *unit;
+};
+vector<result> results;
+
+double now_ns()
+{
+	return chrono::duration<double, nano>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// pkts/s is the only one where more is better
+bool higher_better(const char *unit)
+{
+	return strcmp(unit, "pkts/s") == 0;
+}
+
+/* A number for the results, or a better one for a number that's already there */
+void record(const string &group, const string &name, double value, const char *unit)
+{
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		if(results[i].group == group && results[i].name == name)
+		{
+			if(higher_better(unit) ? value > results[i].value : value < results[i].value)
+				results[i].value = value;
+			return;
+		}
+	}
+	result r = { group, name, value, unit };
+	results.push_back(r);
+}
+
+void print_results(const char *group)
+{
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		if(results[i].group == group)
+			printf("%-32s %10.2f %s\n", results[i].name.c_str(), results[i].value, results[i].unit);
+	}
+}
+
+// The fastest of a few tries counts, whatever else the machine was up to
+// only ever makes one slower
+
+template <typename F>
+void time_frames(const char *name, F work)
+{
+	uint32_t acc = 0;
+	double best = 0;
+	for(int r = 0; r < num_rounds; r++)
+	{
+		double start = now_ns();
+		for(int i = 0; i < num_frames; i++)
+			acc += work(i);
+		double ns = (now_ns() - start) / num_frames;
+		if(r == 0 || ns < best)
+			best = ns;
+	}
+	sink = acc;
+	record("kernel", name, best, "ns/frame");
+}
+
+/* Times work() over a few tries of 50ms each, returns us per call */
+template <typename F>
+double time_calls(F work)
+{
+	uint32_t acc = 0;
+	double best = 0;
+	for(int t = 0; t < num_tries; t++)
+	{
+		long calls = 0;
+		double start = now_ns(), elapsed;
+		do
+		{
+			acc += work();
+			calls++;
+			elapsed = now_ns() - start;
+		} while(elapsed < 50e6);
+		double us = elapsed / calls / 1000;
+		if(t == 0 || us < best)
+			best = us;
+	}
+	sink = acc;
+	return best;
+}
+
+/* A file of made up text, so there's something for FileSource and the simulator to send */
+bool make_file(const char *path, size_t len)
+{
+	FILE *f = fopen(path, "wb");
+	if(f == NULL)
+		return false;
+	srand(1);
+	for(size_t i = 0; i < len; i++)
+		fputc(rand() % 8 == 0 ? '\n' : 'a' + rand() % 26, f);
+	return fclose(f) == 0;
+}
+
+void bench_kernels(const char *path)
+{
+	vector<uint8_t> frames(num_frames * 32);
+	srand(2);
+	for(size_t i = 0; i < frames.size(); i++)
+		frames[i] = rand();
+	// Like a data frame near the end of a file, half of the payload is padding
+	vector<uint8_t> short_frames(frames);
+	for(int i = 0; i < num_frames; i++)
+	{
+		memset(&short_frames[i * 32 + 16], '\0', 16);
+		seal_frame(&short_frames[i * 32], check_crc16);
+	}
+	uint8_t out[32];
+
+	time_frames("fletcher_8", [&](int i) { return (uint32_t)fletcher_8(&frames[i * 32 + 2], num_payload_bytes); });
+	time_frames("payload copy", [&](int i) { memcpy(out + num_header_bytes, &frames[i * 32], num_payload_bytes); return (uint32_t)out[i % 32]; });
+
+	// A fresh source every round, or every get() after the first round would be a pread of its own
+	FileSource source;
+	time_frames("build_data_pkt fletcher", [&](int i) {
+		if(i == 0)
+			source.open(path, frame_payload_bytes(check_fletcher_8));
+		build_data_pkt(out, i + 1, source, check_fletcher_8);
+		return (uint32_t)out[31];
+	});
+	time_frames("build_data_pkt crc32c", [&](int i) {
+		if(i == 0)
+			source.open(path, frame_payload_bytes(check_crc32c));
+		build_data_pkt(out, i + 1, source, check_crc32c);
+		return (uint32_t)out[31];
+	});
+	// The same with the layout fixed at compile time, and a variant with 24 bit ids
+	time_frames("crc32c_frame build", [&](int i) {
+		if(i == 0)
+			source.open(path, crc32c_frame::payload_bytes);
+		crc32c_frame::build(out, i + 1, source);
+		return (uint32_t)out[31];
+	});
+	typedef DataFrame<3, check_crc16> wide_frame;
+	time_frames("24 bit id crc16 build", [&](int i) {
+		if(i == 0)
+			source.open(path, wide_frame::payload_bytes);
+		wide_frame::build(out, i + 1, source);
+		return (uint32_t)out[31];
+	});
+	time_frames("pack_frame full", [&](int i) { return (uint32_t)pack_frame(out, &frames[i * 32], 2); });
+	time_frames("pack_frame short", [&](int i) { return (uint32_t)pack_frame(out, &short_frames[i * 32], 2); });
+	time_frames("pack+unpack short", [&](int i) {
+		uint8_t len = pack_frame(out, &short_frames[i * 32], 2);
+		memset(out + len, '\0', 32 - len);
+		unpack_data_frame(out, len, check_crc16);
+		return (uint32_t)out[31];
+	});
+}
+
+/* What the transmitter does with the requests in send_missing_pkts(): pull the ids out of each and skip any it has seen */
+int collect_missing(uint8_t (*pkts)[32], int num_pkts, uint32_t num_chunks, ChunkBitmap &missing_pkts)
+{
+	missing_pkts.resize(num_chunks);
+	uint16_t ids[max_ids_per_re_tx_pkt];
+	for(int n = 0; n < num_pkts; n++)
+	{
+		int num_entries = re_tx_pkt_ids(pkts[n], ids);
+		if(num_entries == 0 || missing_pkts.test(ids[0]))
+			continue;
+		for(int i = 0; i < num_entries; i++)
+			missing_pkts.set(ids[i]);
+	}
+	return missing_pkts.count();
+}
+
+void bench_bookkeeping(bool quiet)
+{
+	for(size_t s = 0; s < sizeof(bookkeeping_sizes) / sizeof(bookkeeping_sizes[0]); s++)
+	{
+		uint32_t n = bookkeeping_sizes[s];
+		ChunkBitmap recvd;
+		recvd.resize(n);
+		srand(3);
+		for(uint32_t id = 1; id <= n; id++)
+		{
+			if(rand() >= bookkeeping_loss * RAND_MAX)
+				recvd.set(id);
+		}
+		vector<uint16_t> missing(n + 1);
+		int num_missing = list_missing(recvd, n, missing.data());
+		// Every request could be a single id
+		vector<uint8_t> pkts(32 * (num_missing + 1));
+		uint8_t (*re_tx_pkts)[32] = (uint8_t(*)[32])pkts.data();
+		ChunkBitmap collected;
+
+		string name = bookkeeping_names[s];
+		if(quiet == false)
+			printf("%s: %u packets, %d missing\n", name.c_str(), n, num_missing);
+		record("bookkeeping", name + " list_missing", time_calls([&]() { return list_missing(recvd, n, missing.data()); }), "us");
+		int num_old = build_re_tx_pkts(missing.data(), num_missing, false, re_tx_pkts);
+		record("bookkeeping", name + " build old re_tx", time_calls([&]() { return build_re_tx_pkts(missing.data(), num_missing, false, re_tx_pkts); }), "us");
+		if(collect_missing(re_tx_pkts, num_old, n, collected) != num_missing)
+			printf("ERROR: old style requests don't add up to what's missing\n");
+		record("bookkeeping", name + " collect old re_tx", time_calls([&]() { return collect_missing(re_tx_pkts, num_old, n, collected); }), "us");
+		int num_compact = build_re_tx_pkts(missing.data(), num_missing, true, re_tx_pkts);
+		record("bookkeeping", name + " build compact re_tx", time_calls([&]() { return build_re_tx_pkts(missing.data(), num_missing, true, re_tx_pkts); }), "us");
+		if(collect_missing(re_tx_pkts, num_compact, n, collected) != num_missing)
+			printf("ERROR: compact requests don't add up to what's missing\n");
+		record("bookkeeping", name + " collect compact re_tx", time_calls([&]() { return collect_missing(re_tx_pkts, num_compact, n, collected); }), "us");
+	}
+}
+
+/* role,metric,value rows of a -T csv file, keyed by role + "." + metric. Notes are quoted. */
+bool read_telemetry(const char *path, map<string, double> &values)
+{
+	FILE *f = fopen(path, "r");
+	if(f == NULL)
+		return false;
+	char line[512];
+	while(fgets(line, sizeof(line), f))
+	{
+		char *a = strchr(line, ',');
+		char *b = a ? strchr(a + 1, ',') : NULL;
+		if(b == NULL)
+			continue;
+		values[string(line, a - line) + "." + string(a + 1, b - a - 1)] = atof(b[1] == '"' ? b + 2 : b + 1);
+	}
+	fclose(f);
+	return true;
+}
+
+bool files_match(const char *a, const char *b)
+{
+	string cmd = string("cmp -s ") + a + " " + b;
+	return system(cmd.c_str()) == 0;
+}
+
+/* Send path with options, fills in v from its telemetry. Returns false if the file didn't get across intact. */
+bool run_transfer(const char *program, const char *path, const char *name, const char *options, map<string, double> &v)
+{
+	string out = string(path) + ".out";
+	string csv = string(path) + ".csv";
+	string cmd = string(program) + " -n " + options + " -s " + path + " -d " + out + " -T " + csv + " > /dev/null 2>&1";
+	bool ok = system(cmd.c_str()) == 0 && read_telemetry(csv.c_str(), v) && files_match(path, out.c_str());
+	if(ok == false)
+		printf("ERROR: %s: %s didn't get the file across\n", name, cmd.c_str());
+	unlink(out.c_str());
+	unlink(csv.c_str());
+	return ok;
+}
+
+/* Returns false if a transfer didn't go through */
+bool bench_transfers(const char *program, const char *path)
+{
+	bool ok = true;
+	for(size_t t = 0; t < sizeof(transfers) / sizeof(transfers[0]); t++)
+	{
+		map<string, double> v;
+		if(run_transfer(program, path, transfers[t].name, transfers[t].options, v) == false)
+		{
+			ok = false;
+			continue;
+		}
+		string name = transfers[t].name;
+		double secs = v["transmitter.elapsed_ms"] / 1000;
+		record("sim", name + " elapsed", v["transmitter.elapsed_ms"], "ms");
+		record("sim", name + " pkts_per_sec", secs > 0 ? v["receiver.data_pkts"] / secs : 0, "pkts/s");
+		record("sim", name + " recovery", v["transmitter.phase_retransmit_ms"], "ms");
+		record("sim", name + " writes", v["transmitter.writes"] + v["transmitter.fast_writes"], "writes");
+	}
+	print_results("sim");
+	return ok;
+}
+
+/* The large_transfers, each of its own file. Returns false if one didn't go through. */
+bool bench_large_transfers(const char *program, const char *path)
+{
+	bool ok = true;
+	string big = string(path) + ".big";
+	for(size_t t = 0; t < sizeof(large_transfers) / sizeof(large_transfers[0]); t++)
+	{
+		const large_config &l = large_transfers[t];
+		map<string, double> v;
+		if(make_file(big.c_str(), l.bytes) == false || run_transfer(program, big.c_str(), l.name, l.options, v) == false)
+		{
+			ok = false;
+			continue;
+		}
+		string name = l.name;
+		printf("%s: %llu bytes, %llu packets\n", l.name, (unsigned long long)l.bytes,
+			(unsigned long long)((l.bytes + large_payload_bytes - 1) / large_payload_bytes));
+		record("large", name + " segments", v["transmitter.segments"], "segments");
+		record("large", name + " tx segment bitmap", v["transmitter.segment_bitmap_bytes"], "bytes");
+		record("large", name + " rx segment bitmap", v["receiver.segment_bitmap_bytes"], "bytes");
+	}
+	unlink(big.c_str());
+	print_results("large");
+	return ok;
+}
+
+string machine_name()
+{
+	struct utsname u;
+	if(uname(&u) != 0)
+		return "unknown";
+	return string(u.nodename) + " " + u.machine;
+}
+
+/* Baseline file: group,name,value rows, with the machine as the first */
+bool load_baseline(const char *path, string &machine, map<string, double> &baseline)
+{
+	FILE *f = fopen(path, "r");
+	if(f == NULL)
+		return false;
+	char line[256];
+	while(fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		char *a = strchr(line, ',');
+		if(a == NULL)
+			continue;
+		string group(line, a - line);
+		char *b = strrchr(line, ',');
+		if(group == "machine")
+			machine = string(a + 1);
+		else if(group != "group" && b != a)
+			baseline[group + "," + string(a + 1, b - a - 1)] = atof(b + 1);
+	}
+	fclose(f);
+	return true;
+}
+
+bool save_baseline(const char *path, const string &machine)
+{
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return false;
+	fprintf(f, "group,name,value\n");
+	fprintf(f, "machine,%s\n", machine.c_str());
+	for(size_t i = 0; i < results.size(); i++)
+		fprintf(f, "%s,%s,%.3f\n", results[i].group.c_str(), results[i].name.c_str(), results[i].value);
+	return fclose(f) == 0;
+}
+
+/* The least a number has to get worse by to count, whatever the tolerance */
+double slack(const char *unit)
+{
+	if(strcmp(unit, "ns/frame") == 0)
+		return 2;
+	if(strcmp(unit, "us") == 0)
+		return 1;
+	if(strcmp(unit, "ms") == 0)
+		return 30;
+	return 0;
+}
+
+/* The kernel and bookkeeping timings, the best of so many passes over them */
+void time_cpu(const char *path, int passes, bool quiet)
+{
+	for(int p = 0; p < passes; p++)
+	{
+		if(p > 0)
+			sleep(1);
+		bench_kernels(path);
+		bench_bookkeeping(quiet || p > 0);
+	}
+	print_results("kernel");
+	print_results("bookkeeping");
+}
+
+/* Prints every number in group, or in all of them if it's NULL, that got worse than the baseline allows if report, returns how many */
+int compare(const map<string, double> &baseline, bool same_machine, const char *group, bool report)
+{
+	int worse = 0;
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		const result &r = results[i];
+		if(group != NULL && r.group != group)
+			continue;
+		// The simulator's numbers hold anywhere
+		bool sim = r.group == "sim" || r.group == "large";
+		if(sim == false && same_machine == false)
+			continue;
+		map<string, double>::const_iterator it = baseline.find(r.group + "," + r.name);
+		if(it == baseline.end())
+			continue;
+		double base = it->second;
+		double change = higher_better(r.unit) ? base - r.value : r.value - base;
+		if(change > base * tolerance && change > slack(r.unit))
+		{
+			if(report)
+				printf("REGRESSION: %s is %.2f %s, the baseline is %.2f\n", r.name.c_str(), r.value, r.unit, base);
+			worse++;
+		}
+	}
+	return worse;
+}
+
+void usage()
+{
+	printf("Usage: bench_protocol [-x ./rf24_transfer] [-b bench_baseline.csv] [-u]\n");
+	printf("  -x: rf24_transfer to run the simulated transfers with, they're skipped if it isn't there\n");
+	printf("  -b: the baseline to compare with\n");
+	printf("  -u: write this run out as the new baseline instead\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *program = "./rf24_transfer";
+	const char *baseline_path = "bench_baseline.csv";
+	bool update = false;
+	int c;
+	while((c = getopt(argc, argv, "x:b:uh")) != -1)
+	{
+		switch(c)
+		{
+			case 'x': program = optarg; break;
+			case 'b': baseline_path = optarg; break;
+			case 'u': update = true; break;
+			default: usage(); return c == 'h' ? 0 : 6;
+		}
+	}
+
+	char path[] = "/tmp/bench_protocol_XXXXXX";
+	int fd = mkstemp(path);
+	if(fd < 0 || make_file(path, transfer_bytes) == false)
+	{
+		printf("ERROR: Couldn't make a file to send.\n");
+		return 6;
+	}
+	close(fd);
+
+	time_cpu(path, num_passes, false);
+	bool transfers_ok = true;
+	if(access(program, X_OK) == 0)
+	{
+		transfers_ok = bench_transfers(program, path);
+		transfers_ok = bench_large_transfers(program, path) && transfers_ok;
+	}
+	else
+		printf("No %s, skipping the simulated transfers.\n", program);
+
+	string machine = machine_name();
+	if(update)
+	{
+		unlink(path);
+		if(transfers_ok == false || save_baseline(baseline_path, machine) == false)
+		{
+			printf("ERROR: Didn't write %s.\n", baseline_path);
+			return 6;
+		}
+		printf("Wrote %s for %s.\n", baseline_path, machine.c_str());
+		return 0;
+	}
+
+	string base_machine;
+	map<string, double> baseline;
+	if(load_baseline(baseline_path, base_machine, baseline) == false)
+	{
+		printf("No baseline in %s, make one with -u.\n", baseline_path);
+		unlink(path);
+		return transfers_ok ? 0 : 1;
+	}
+	bool same_machine = base_machine == machine;
+	if(same_machine == false)
+		printf("The baseline is from %s, only comparing the simulated transfers.\n", base_machine.c_str());
+	// Anything worse that goes away on another go was the machine being busy
+	for(int r = 0; r < num_rechecks; r++)
+	{
+		bool cpu_worse = compare(baseline, same_machine, "kernel", false) + compare(baseline, same_machine, "bookkeeping", false) > 0;
+		bool sim_worse = transfers_ok && compare(baseline, same_machine, "sim", false) > 0;
+		if(cpu_worse == false && sim_worse == false)
+			break;
+		printf("Something looks worse, trying again.\n");
+		sleep(1);
+		if(cpu_worse)
+			time_cpu(path, 1, true);
+		if(sim_worse)
+			transfers_ok = bench_transfers(program, path);
+	}
+	unlink(path);
+	int worse = compare(baseline, same_machine, NULL, true);
+	if(worse == 0 && transfers_ok)
+		printf("Nothing worse than %s.\n", baseline_path);
+	return worse == 0 && transfers_ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+/*
+ * One bit per chunk of the file, packed into 64 bit words.
+ * Chunk ids start at 1, like packet ids.
+ *
+ * Both ends keep track of loss with these: the receiver of what it has,
+ * the transmitter of what it's been asked to send again. The count of set
+ * bits is kept as they're set, and next_clear()/next_set() skip a whole
+ * word of nothing at a time, so going over what's missing costs about the
+ * missing ids rather than the whole file.
+ */
+
+#ifndef CHUNK_BITMAP_H
+#define CHUNK_BITMAP_H
+
+#include <stdint.h>
+#include <vector>
+
+class ChunkBitmap
+{
+public:
+	ChunkBitmap() : n(0), ones(0) {}
+
+	/* Make room for chunks 1..num_chunks, all clear */
+	void resize(uint32_t num_chunks)
+	{
+		n = num_chunks;
+		ones = 0;
+		words.assign((n + 63) / 64, 0);
+	}
+
+	uint32_t size() const { return n; }
+	uint32_t count() const { return ones; }
+	size_t bytes() const { return words.size() * sizeof(uint64_t); }
+	/* The raw words, bit 0 of word 0 is chunk 1 */
+	const uint64_t *data() const { return words.data(); }
+
+	/* Take the bits from words saved with data(), for the same number of chunks */
+	bool load(const std::vector<uint64_t> &saved)
+	{
+		if(saved.size() != words.size())
+			return false;
+		words = saved;
+		if(n % 64)
+			words.back() &= ((uint64_t)1 << (n % 64)) - 1;
+		ones = 0;
+		for(size_t i = 0; i < words.size(); i++)
+			ones += __builtin_popcountll(words[i]);
+		return true;
+	}
+
+	bool test(uint32_t id) const
+	{
+		if(id == 0 || id > n)
+			return false;
+		return (words[(id - 1) / 64] >> ((id - 1) % 64)) & 1;
+	}
+
+	/* Returns true if the bit wasn't already set */
+	bool set(uint32_t id)
+	{
+		if(id == 0 || id > n || test(id))
+			return false;
+		words[(id - 1) / 64] |= (uint64_t)1 << ((id - 1) % 64);
+		ones++;
+		return true;
+	}
+
+	/* First clear id at or after from, or size() + 1 if there isn't one */
+	uint32_t next_clear(uint32_t from) const
+	{
+		if(from == 0)
+			from = 1;
+		if(from > n)
+			return n + 1;
+		size_t w = (from - 1) / 64;
+		uint64_t word = ~words[w] & (~(uint64_t)0 << ((from - 1) % 64));
+		while(word == 0)
+		{
+			if(++w >= words.size())
+				return n + 1;
+			word = ~words[w];
+		}
+		uint32_t id = w * 64 + __builtin_ctzll(word) + 1;
+		return id > n ? n + 1 : id;
+	}
+
+	/* First set id at or after from, or size() + 1 if there isn't one */
+	uint32_t next_set(uint32_t from) const
+	{
+		if(from == 0)
+			from = 1;
+		if(from > n)
+			return n + 1;
+		size_t w = (from - 1) / 64;
+		uint64_t word = words[w] & (~(uint64_t)0 << ((from - 1) % 64));
+		while(word == 0)
+		{
+			if(++w >= words.size())
+				return n + 1;
+			word = words[w];
+		}
+		return w * 64 + __builtin_ctzll(word) + 1;
+	}
+
+	/*
+	 * The first run of clear ids at or after from, as first..last. Returns
+	 * false if there isn't one. Walking them with from = last + 1 goes
+	 * through everything missing a word at a time.
+	 */
+	bool next_clear_range(uint32_t from, uint32_t *first, uint32_t *last) const
+	{
+		*first = next_clear(from);
+		if(*first > n)
+			return false;
+		*last = next_set(*first) - 1;
+		return true;
+	}
+
+	/* Clear ids, kept up to date as bits are set */
+	uint32_t missing() const { return n - ones; }
+
+private:
+	std::vector<uint64_t> words;
+	uint32_t n;
+	uint32_t ones;
+};
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * The clock samples are stamped with, by read_ads as they're taken and by
+ * rf24_transfer -S as they come in. It's steady_clock, so it only goes
+ * forward, and every process on the machine reads the same one.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+#include <chrono>
+
+/* Microseconds on a clock that only goes forward */
+inline uint64_t now_us()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
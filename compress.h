@@ -0,0 +1,325 @@
+/*
+ * Built-in LZ77 compression for the transmitter's optional compression
+ * stage (-z).
+ *
+ * The file is compressed up front into a temporary file, which is then
+ * sent like any other, so any chunk of it can still be sent again on its
+ * own. The compressed stream is a run of independent blocks, each holding
+ * up to lz_block_size bytes of the original:
+ *
+ *   uint32_t original length | uint32_t packed length | packed bytes
+ *
+ * A block whose packed length equals its original length is stored as is.
+ * Packed blocks use the LZ4 block format: a token byte with the literal
+ * count in the top nibble and the match length - 4 in the bottom one
+ * (15 means more length bytes follow), the literals, then a 2 byte match
+ * offset. The last 5 bytes of a block are always literals.
+ *
+ * Level 1 only looks at the last position with the same 4 byte hash, which
+ * is about as fast as LZ4. Higher levels follow a hash chain further back,
+ * 2^(level - 1) positions deep, and from level 4 check whether waiting a
+ * byte gives a longer match. Level 9 is for slow links, where every packet
+ * saved is worth more than the CPU time.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+const size_t lz_block_size = 64 * 1024;
+const int lz_max_level = 9;
+
+/* Worst case packed size of len bytes */
+inline size_t lz_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+class LzCompressor
+{
+public:
+	explicit LzCompressor(int level) : level(level), head(1 << hash_bits), prev(lz_block_size) {}
+
+	/* Pack len (at most lz_block_size) bytes into dst, which has room for lz_bound(len). Returns the packed size. */
+	size_t compress(const uint8_t *src, size_t len, uint8_t *dst)
+	{
+		uint8_t *op = dst;
+		size_t anchor = 0;
+		if(len > min_input)
+		{
+			std::fill(head.begin(), head.end(), -1);
+			size_t mflimit = len - 12; // A match may not start after this
+			size_t matchlimit = len - 5; // or run past this
+			size_t ip = 0;
+			while(ip < mflimit)
+			{
+				int32_t ref;
+				size_t mlen = find(src, ip, matchlimit, &ref);
+				insert(src, ip);
+				if(mlen < min_match)
+				{
+					// Skip faster through data that doesn't compress
+					ip += level == 1 ? 1 + ((ip - anchor) >> 6) : 1;
+					continue;
+				}
+				if(level >= 4)
+				{
+					while(ip + 1 < mflimit)
+					{
+						int32_t ref2;
+						size_t mlen2 = find(src, ip + 1, matchlimit, &ref2);
+						if(mlen2 <= mlen)
+							break;
+						ip++;
+						insert(src, ip);
+						mlen = mlen2;
+						ref = ref2;
+					}
+				}
+				op = put_sequence(op, src + anchor, ip - anchor, ip - ref, mlen);
+				if(level > 1)
+				{
+					for(size_t i = ip + 1; i < ip + mlen && i < mflimit; i++)
+						insert(src, i);
+				}
+				ip += mlen;
+				anchor = ip;
+			}
+		}
+		// Whatever's left goes out as literals
+		size_t lit = len - anchor;
+		op = put_length(op, lit, 4);
+		memcpy(op, src + anchor, lit);
+		op += lit;
+		return op - dst;
+	}
+
+private:
+	static const int hash_bits = 16;
+	static const size_t min_match = 4;
+	static const size_t min_input = 13;
+	static const size_t max_offset = 65535;
+
+	int level;
+	std::vector<int32_t> head; // Latest position for each hash
+	std::vector<int32_t> prev; // Previous position with the same hash, by position
+
+	static uint32_t read32(const uint8_t *p)
+	{
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+
+	static uint32_t hash(const uint8_t *p)
+	{
+		return (read32(p) * 2654435761u) >> (32 - hash_bits);
+	}
+
+	void insert(const uint8_t *src, size_t pos)
+	{
+		uint32_t h = hash(src + pos);
+		prev[pos] = head[h];
+		head[h] = pos;
+	}
+
+	/* Longest match for pos, with its start in *ref */
+	size_t find(const uint8_t *src, size_t pos, size_t matchlimit, int32_t *ref) const
+	{
+		size_t best = 0;
+		int tries = 1 << (level - 1);
+		uint32_t want = read32(src + pos);
+		for(int32_t cand = head[hash(src + pos)]; cand >= 0 && pos - cand <= max_offset && tries-- > 0; cand = prev[cand])
+		{
+			if(read32(src + cand) != want)
+				continue;
+			size_t n = min_match;
+			while(pos + n < matchlimit && src[cand + n] == src[pos + n])
+				n++;
+			if(n > best)
+			{
+				best = n;
+				*ref = cand;
+			}
+		}
+		return best;
+	}
+
+	/* A token's nibble holds up to 15, anything over spills into 255s */
+	static uint8_t *put_length(uint8_t *op, size_t n, int shift)
+	{
+		uint8_t *token = op++;
+		if(n < 15)
+		{
+			*token = n << shift;
+			return op;
+		}
+		*token = 15 << shift;
+		for(n -= 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = n;
+		return op;
+	}
+
+	static uint8_t *put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t mlen)
+	{
+		uint8_t *token = op;
+		op = put_length(op, lit_len, 4);
+		memcpy(op, lit, lit_len);
+		op += lit_len;
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		size_t m = mlen - min_match;
+		if(m < 15)
+		{
+			*token |= m;
+			return op;
+		}
+		*token |= 15;
+		for(m -= 15; m >= 255; m -= 255)
+			*op++ = 255;
+		*op++ = m;
+		return op;
+	}
+};
+
+/* Unpack a block into dst. Returns its original size, or -1 if it doesn't make sense. */
+inline long lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len)
+{
+	const uint8_t *ip = src, *end = src + len;
+	uint8_t *op = dst, *op_end = dst + dst_len;
+	while(ip < end)
+	{
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if(lit == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if(ip == end)
+					return -1;
+				b = *ip++;
+				lit += b;
+			} while(b == 255);
+		}
+		if((size_t)(end - ip) < lit || (size_t)(op_end - op) < lit)
+			return -1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if(ip == end)
+			break;
+
+		if(end - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > (size_t)(op - dst))
+			return -1;
+		size_t mlen = (token & 15) + 4;
+		if((token & 15) == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if(ip == end)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while(b == 255);
+		}
+		if((size_t)(op_end - op) < mlen)
+			return -1;
+		// Byte at a time, the match can overlap what it's writing
+		const uint8_t *from = op - offset;
+		while(mlen--)
+			*op++ = *from++;
+	}
+	return op - dst;
+}
+
+/* Compress a whole file into another. The compressed size goes in *out_size. */
+inline bool lz_compress_file(const char *src_name, const char *dst_name, int level, uint64_t *out_size)
+{
+	FILE *src = fopen(src_name, "rb");
+	if(src == NULL)
+		return false;
+	FILE *dst = fopen(dst_name, "wb");
+	if(dst == NULL)
+	{
+		fclose(src);
+		return false;
+	}
+	LzCompressor lz(level);
+	std::vector<uint8_t> raw(lz_block_size), packed(lz_bound(lz_block_size));
+	uint64_t total = 0;
+	bool ok = true;
+	size_t n;
+	while(ok && (n = fread(raw.data(), 1, raw.size(), src)) > 0)
+	{
+		uint32_t hdr[2];
+		hdr[0] = n;
+		hdr[1] = lz.compress(raw.data(), n, packed.data());
+		const uint8_t *body = packed.data();
+		if(hdr[1] >= n)
+		{
+			hdr[1] = n;
+			body = raw.data();
+		}
+		ok = fwrite(hdr, sizeof(hdr), 1, dst) == 1 && fwrite(body, 1, hdr[1], dst) == hdr[1];
+		total += sizeof(hdr) + hdr[1];
+	}
+	ok = ok && ferror(src) == 0;
+	fclose(src);
+	ok = fclose(dst) == 0 && ok;
+	*out_size = total;
+	return ok;
+}
+
+/* Undo lz_compress_file. Returns false on a read or write error or a damaged stream. */
+inline bool lz_decompress_file(const char *src_name, const char *dst_name)
+{
+	FILE *src = fopen(src_name, "rb");
+	if(src == NULL)
+		return false;
+	FILE *dst = fopen(dst_name, "wb");
+	if(dst == NULL)
+	{
+		fclose(src);
+		return false;
+	}
+	std::vector<uint8_t> raw(lz_block_size), packed(lz_block_size);
+	bool ok = true;
+	uint32_t hdr[2];
+	while(ok && fread(hdr, sizeof(hdr), 1, src) == 1)
+	{
+		if(hdr[0] > lz_block_size || hdr[1] > lz_bound(lz_block_size))
+		{
+			ok = false;
+			break;
+		}
+		packed.resize(hdr[1]);
+		if(fread(packed.data(), 1, hdr[1], src) != hdr[1])
+		{
+			ok = false;
+			break;
+		}
+		if(hdr[1] == hdr[0])
+			memcpy(raw.data(), packed.data(), hdr[0]);
+		else if(lz_decompress(packed.data(), hdr[1], raw.data(), hdr[0]) != (long)hdr[0])
+			ok = false;
+		ok = ok && fwrite(raw.data(), 1, hdr[0], dst) == hdr[0];
+	}
+	ok = ok && ferror(src) == 0;
+	fclose(src);
+	ok = fclose(dst) == 0 && ok;
+	return ok;
+}
+
+#endif
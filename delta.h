@@ -0,0 +1,348 @@
+/*
+ * rsync style delta encoding, for sending a new version of a file the
+ * receiver already has an old copy of.
+ *
+ * The receiver cuts its copy (the basis) into blocks and sends a signature
+ * for each: a weak rolling sum, which is cheap to slide along the new file a
+ * byte at a time, and the low 32 bits of the block's XXH64 to confirm a
+ * match. The transmitter looks for those blocks anywhere in the new file and
+ * writes a delta stream of what's left plus references to the receiver's
+ * blocks:
+ *
+ *   "RF24DLT1" | uint32_t block size | uint64_t basis size | ops...
+ *
+ *   op 0: uint32_t length | length bytes of literal data
+ *   op 1: uint32_t first block | uint32_t blocks, copied from the basis
+ *
+ * The delta stream is sent like any other file, and the receiver rebuilds
+ * the new file from it and the basis. Only whole blocks have signatures, so
+ * the tail of the basis past the last whole block is never matched.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "integrity.h"
+
+const uint32_t delta_min_block = 256;
+// What fits in the 16 bit sequence numbers of the signature packets
+const uint32_t delta_max_blocks = 0xfffe * 3;
+
+struct BlockSig
+{
+	uint32_t weak;
+	uint32_t strong;
+};
+
+/* What the delta saved */
+struct DeltaStats
+{
+	uint64_t matched = 0; // Bytes of the new file found in the basis
+	uint64_t literal = 0; // Bytes that have to be sent as is
+	uint64_t size = 0; // Size of the delta stream
+};
+
+/* About sqrt(size), which balances signatures against the literal data a change costs */
+inline uint32_t delta_block_size(uint64_t basis_size)
+{
+	uint64_t b = (uint64_t)sqrt((double)basis_size);
+	b = std::max<uint64_t>(b, (basis_size + delta_max_blocks - 1) / delta_max_blocks);
+	b = (b + 63) & ~(uint64_t)63;
+	return std::max<uint64_t>(b, delta_min_block);
+}
+
+/* rsync's rolling sum: a is the sum of the bytes, b the sum of the running a's */
+class RollingSum
+{
+public:
+	RollingSum(const uint8_t *p, uint32_t len) : a(0), b(0), n(len)
+	{
+		for(uint32_t i = 0; i < len; i++)
+		{
+			a += p[i];
+			b += a;
+		}
+	}
+
+	uint32_t value() const { return (a & 0xffff) | (b << 16); }
+
+	/* Slide the window one byte on, dropping out and taking in */
+	void roll(uint8_t out, uint8_t in)
+	{
+		a += in - out;
+		b += a - n * out;
+	}
+
+private:
+	uint32_t a, b, n;
+};
+
+inline uint32_t strong_sum(const uint8_t *p, size_t len)
+{
+	Xxh64 h;
+	h.update(p, len);
+	return (uint32_t)h.digest();
+}
+
+/* Signatures for every whole block of the basis. False if it can't be read. */
+inline bool delta_signatures(const char *basis, uint32_t block_size, std::vector<BlockSig> &sigs)
+{
+	sigs.clear();
+	FILE *f = fopen(basis, "rb");
+	if(f == NULL)
+		return false;
+	std::vector<uint8_t> block(block_size);
+	while(fread(block.data(), 1, block_size, f) == block_size)
+	{
+		BlockSig s;
+		s.weak = RollingSum(block.data(), block_size).value();
+		s.strong = strong_sum(block.data(), block_size);
+		sigs.push_back(s);
+	}
+	bool ok = ferror(f) == 0;
+	fclose(f);
+	return ok;
+}
+
+class DeltaWriter
+{
+public:
+	explicit DeltaWriter(FILE *out) : out(out), ok(true), run_first(0), run_len(0) {}
+
+	void header(uint32_t block_size, uint64_t basis_size)
+	{
+		put("RF24DLT1", 8);
+		put(&block_size, 4);
+		put(&basis_size, 8);
+	}
+
+	void literal(const uint8_t *p, uint32_t len)
+	{
+		if(len == 0)
+			return;
+		flush_run();
+		uint8_t op = 0;
+		put(&op, 1);
+		put(&len, 4);
+		put(p, len);
+	}
+
+	/* Consecutive blocks go out as one op */
+	void block(uint32_t index)
+	{
+		if(run_len > 0 && index == run_first + run_len)
+		{
+			run_len++;
+			return;
+		}
+		flush_run();
+		run_first = index;
+		run_len = 1;
+	}
+
+	bool finish()
+	{
+		flush_run();
+		return ok;
+	}
+
+	/* The block that would extend the current run */
+	uint32_t next_block() const { return run_first + run_len; }
+
+private:
+	FILE *out;
+	bool ok;
+	uint32_t run_first, run_len;
+
+	void put(const void *p, size_t len)
+	{
+		ok = ok && fwrite(p, 1, len, out) == len;
+	}
+
+	void flush_run()
+	{
+		if(run_len == 0)
+			return;
+		uint8_t op = 1;
+		put(&op, 1);
+		put(&run_first, 4);
+		put(&run_len, 4);
+		run_len = 0;
+	}
+};
+
+/*
+ * Write the delta of new_file against a basis described by sigs (known[i]
+ * is false for any signature that never arrived) to out_name.
+ */
+inline bool delta_encode(const char *new_file, const std::vector<BlockSig> &sigs, const std::vector<bool> &known,
+	uint32_t block_size, uint64_t basis_size, const char *out_name, DeltaStats *stats)
+{
+	int fd = open(new_file, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	size_t n = st.st_size;
+	void *map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return false;
+	const uint8_t *d = (const uint8_t *)map;
+	FILE *out = fopen(out_name, "wb");
+	if(out == NULL)
+	{
+		munmap(map, n);
+		return false;
+	}
+
+	// Signatures sorted by weak sum, with a 16 bit tag table to turn most
+	// positions away without a search
+	std::vector<std::pair<uint32_t, uint32_t> > table;
+	std::vector<bool> tags(1 << 16);
+	for(uint32_t i = 0; i < sigs.size(); i++)
+	{
+		if(known[i] == false)
+			continue;
+		table.push_back(std::make_pair(sigs[i].weak, i));
+		tags[(sigs[i].weak ^ (sigs[i].weak >> 16)) & 0xffff] = true;
+	}
+	std::sort(table.begin(), table.end());
+
+	DeltaWriter w(out);
+	w.header(block_size, basis_size);
+	*stats = DeltaStats();
+	size_t pos = 0, lit_start = 0;
+	if(table.empty() == false && n >= block_size)
+	{
+		RollingSum sum(d, block_size);
+		while(true)
+		{
+			uint32_t weak = sum.value();
+			int64_t match = -1;
+			if(tags[(weak ^ (weak >> 16)) & 0xffff])
+			{
+				auto range = std::equal_range(table.begin(), table.end(), std::make_pair(weak, (uint32_t)0),
+					[](const std::pair<uint32_t, uint32_t> &x, const std::pair<uint32_t, uint32_t> &y) { return x.first < y.first; });
+				if(range.first != range.second)
+				{
+					uint32_t strong = strong_sum(d + pos, block_size);
+					for(auto it = range.first; it != range.second; ++it)
+					{
+						if(sigs[it->second].strong != strong)
+							continue;
+						match = it->second;
+						// Carrying on a run makes for fewer ops
+						if(it->second == w.next_block())
+							break;
+					}
+				}
+			}
+			if(match >= 0)
+			{
+				w.literal(d + lit_start, pos - lit_start);
+				stats->literal += pos - lit_start;
+				w.block(match);
+				stats->matched += block_size;
+				pos += block_size;
+				lit_start = pos;
+				if(pos + block_size > n)
+					break;
+				sum = RollingSum(d + pos, block_size);
+				continue;
+			}
+			if(pos + block_size >= n)
+				break;
+			sum.roll(d[pos], d[pos + block_size]);
+			pos++;
+		}
+	}
+	w.literal(d + lit_start, n - lit_start);
+	stats->literal += n - lit_start;
+	bool ok = w.finish();
+	stats->size = ftell(out);
+	ok = fclose(out) == 0 && ok;
+	munmap(map, n);
+	return ok;
+}
+
+/*
+ * Rebuild the new file into out_name from the delta stream and the basis.
+ * The bytes taken from the basis go in *reused. False if the delta doesn't
+ * fit this basis or something couldn't be read or written.
+ */
+inline bool delta_apply(const char *delta_name, const char *basis, const char *out_name, uint64_t *reused)
+{
+	*reused = 0;
+	FILE *delta = fopen(delta_name, "rb");
+	if(delta == NULL)
+		return false;
+	int basis_fd = open(basis, O_RDONLY);
+	FILE *out = fopen(out_name, "wb");
+	bool ok = out != NULL;
+
+	char magic[8];
+	uint32_t block_size = 0;
+	uint64_t basis_size = 0;
+	ok = ok && fread(magic, 8, 1, delta) == 1 && memcmp(magic, "RF24DLT1", 8) == 0 &&
+		fread(&block_size, 4, 1, delta) == 1 && fread(&basis_size, 8, 1, delta) == 1 && block_size > 0;
+	struct stat st;
+	uint64_t have = basis_fd >= 0 && fstat(basis_fd, &st) == 0 ? st.st_size : 0;
+	std::vector<uint8_t> buf(std::max<size_t>(block_size, 64 * 1024));
+	uint8_t op;
+	while(ok && fread(&op, 1, 1, delta) == 1)
+	{
+		uint32_t a, b;
+		if(op == 0 && fread(&a, 4, 1, delta) == 1)
+		{
+			while(ok && a > 0)
+			{
+				size_t len = std::min<size_t>(a, buf.size());
+				ok = fread(buf.data(), 1, len, delta) == len && fwrite(buf.data(), 1, len, out) == len;
+				a -= len;
+			}
+		}
+		else if(op == 1 && fread(&a, 4, 1, delta) == 1 && fread(&b, 4, 1, delta) == 1)
+		{
+			// The basis has to be the one the signatures came from
+			uint64_t end = ((uint64_t)a + b) * block_size;
+			if(have != basis_size || end > basis_size)
+			{
+				ok = false;
+				break;
+			}
+			for(uint64_t off = (uint64_t)a * block_size; ok && off < end; off += block_size)
+			{
+				ok = pread(basis_fd, buf.data(), block_size, off) == (ssize_t)block_size &&
+					fwrite(buf.data(), 1, block_size, out) == block_size;
+			}
+			*reused += (uint64_t)b * block_size;
+		}
+		else
+			ok = false;
+	}
+	ok = ok && ferror(delta) == 0;
+	fclose(delta);
+	if(basis_fd >= 0)
+		close(basis_fd);
+	if(out != NULL)
+		ok = fclose(out) == 0 && ok;
+	return ok;
+}
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ * Forward error correction across blocks of data packets.
+ *
+ * Systematic Reed-Solomon erasure code over GF(256): the data packets of a
+ * block go out untouched, followed by r repair packets. Repair packet j is
+ *
+ *   R_j = sum over i of C[j][i] * D_i
+ *
+ * where D_i is the payload of the i-th data packet in the block and C is a
+ * Cauchy matrix, C[j][i] = 1 / ((k + j) xor i). Any square piece of a
+ * Cauchy matrix can be inverted, so any m repair packets rebuild any m lost
+ * data packets in their block, as long as k + r <= 256.
+ *
+ * All the math is bytewise, so it works on whatever payload length the
+ * caller likes.
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+#include "file_sink.h"
+
+/* GF(2^8) with the 0x11d polynomial, by log tables */
+class Gf256
+{
+public:
+	static const Gf256 &get()
+	{
+		static Gf256 gf;
+		return gf;
+	}
+
+	uint8_t mul(uint8_t a, uint8_t b) const
+	{
+		if(a == 0 || b == 0)
+			return 0;
+		return exp[log[a] + log[b]];
+	}
+
+	uint8_t inv(uint8_t a) const
+	{
+		return exp[255 - log[a]];
+	}
+
+	/* dst += c * src */
+	void mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) const
+	{
+		if(c == 0)
+			return;
+		int lc = log[c];
+		for(size_t i = 0; i < len; i++)
+		{
+			if(src[i] != 0)
+				dst[i] ^= exp[log[src[i]] + lc];
+		}
+	}
+
+	/* buf *= c */
+	void scale(uint8_t *buf, uint8_t c, size_t len) const
+	{
+		for(size_t i = 0; i < len; i++)
+			buf[i] = mul(buf[i], c);
+	}
+
+private:
+	uint8_t exp[512];
+	int log[256];
+
+	Gf256()
+	{
+		int x = 1;
+		for(int i = 0; i < 255; i++)
+		{
+			exp[i] = x;
+			log[x] = i;
+			x <<= 1;
+			if(x & 0x100)
+				x ^= 0x11d;
+		}
+		for(int i = 255; i < 512; i++)
+			exp[i] = exp[i - 255];
+		log[0] = 0;
+	}
+};
+
+/* Weight of data packet i in repair packet j, for blocks of k */
+inline uint8_t fec_coef(int k, int j, int i)
+{
+	return Gf256::get().inv((uint8_t)((k + j) ^ i));
+}
+
+/*
+ * Solve for m lost data packets. payloads[] holds repair packets rows[] with
+ * every data packet we do have already taken back out of them (see
+ * FecDecoder); on return payloads[c] is data packet missing[c].
+ */
+inline bool fec_solve(int k, const int *rows, const int *missing, int m, uint8_t **payloads, size_t len)
+{
+	const Gf256 &gf = Gf256::get();
+	std::vector<uint8_t> a(m * m);
+	for(int r = 0; r < m; r++)
+		for(int c = 0; c < m; c++)
+			a[r * m + c] = fec_coef(k, rows[r], missing[c]);
+
+	// Gauss-Jordan, carrying the payloads along
+	for(int c = 0; c < m; c++)
+	{
+		int p = c;
+		while(p < m && a[p * m + c] == 0)
+			p++;
+		if(p == m)
+			return false;
+		if(p != c)
+		{
+			for(int i = 0; i < m; i++)
+			{
+				uint8_t t = a[p * m + i];
+				a[p * m + i] = a[c * m + i];
+				a[c * m + i] = t;
+			}
+			uint8_t *t = payloads[p];
+			payloads[p] = payloads[c];
+			payloads[c] = t;
+		}
+
+		uint8_t pivot_inv = gf.inv(a[c * m + c]);
+		gf.scale(&a[c * m], pivot_inv, m);
+		gf.scale(payloads[c], pivot_inv, len);
+
+		for(int r = 0; r < m; r++)
+		{
+			uint8_t f = a[r * m + c];
+			if(r == c || f == 0)
+				continue;
+			gf.mul_add(&a[r * m], &a[c * m], f, m);
+			gf.mul_add(payloads[r], payloads[c], f, len);
+		}
+	}
+	return true;
+}
+
+/* Builds the repair packets for a block as its data packets go by */
+class FecEncoder
+{
+public:
+	FecEncoder(int data_per_block, int repair_per_block, size_t payload_len) :
+		k(data_per_block), r(repair_per_block), len(payload_len), n(0), rows(repair_per_block * payload_len, 0) {}
+
+	void add(const uint8_t *payload)
+	{
+		const Gf256 &gf = Gf256::get();
+		for(int j = 0; j < r; j++)
+			gf.mul_add(&rows[j * len], payload, fec_coef(k, j, n), len);
+		n++;
+	}
+
+	bool full() const { return n == k; }
+	bool empty() const { return n == 0; }
+	const uint8_t *repair(int j) const { return &rows[j * len]; }
+
+	void reset()
+	{
+		n = 0;
+		memset(rows.data(), 0, rows.size());
+	}
+
+private:
+	int k, r;
+	size_t len;
+	int n; // Data packets in the current block so far
+	std::vector<uint8_t> rows;
+};
+
+/*
+ * Receiver side. Data ids 1..num_data are grouped in blocks of k; repair
+ * packet j of block b comes in as id num_data + b * r + j + 1. Repair
+ * payloads are only held on to for blocks that are missing something, and
+ * the data a block does have is read back out of the sink when it's time
+ * to rebuild the rest.
+ */
+class FecDecoder
+{
+public:
+	FecDecoder() : k(0), r(0), num_data(0), num_recovered(0), num_blocks_recovered(0), num_repair(0) {}
+
+	void start(int data_per_block, int repair_per_block, uint32_t data_pkts)
+	{
+		k = data_per_block;
+		r = repair_per_block;
+		num_data = data_pkts;
+		pending.clear();
+	}
+
+	bool enabled() const { return k > 0 && r > 0; }
+	uint32_t num_blocks() const { return enabled() ? (num_data + k - 1) / k : 0; }
+	uint32_t num_repair_ids() const { return num_blocks() * r; }
+	uint32_t last_id() const { return num_data + num_repair_ids(); }
+
+	unsigned long recovered() const { return num_recovered; }
+	unsigned long blocks_recovered() const { return num_blocks_recovered; }
+	unsigned long repair_received() const { return num_repair; }
+
+	/* Blocks that are still short of data, with too few repair packets to fix them */
+	unsigned long blocks_unrecoverable(const FileSink &sink) const
+	{
+		unsigned long n = 0;
+		for(uint32_t b = 0; b < num_blocks(); b++)
+			n += count_missing(b, sink) > 0;
+		return n;
+	}
+
+	/* Repair packet id would help: its block is still short of data and we haven't got it */
+	bool wants_repair(uint32_t id, const FileSink &sink) const
+	{
+		if(enabled() == false || id <= num_data || id > last_id())
+			return false;
+		uint32_t b = (id - num_data - 1) / r;
+		int j = (id - num_data - 1) % r;
+		if(count_missing(b, sink) == 0)
+			return false;
+		std::map<uint32_t, std::vector<Repair> >::const_iterator it = pending.find(b);
+		if(it == pending.end())
+			return true;
+		for(size_t i = 0; i < it->second.size(); i++)
+		{
+			if(it->second[i].row == j)
+				return false;
+		}
+		return true;
+	}
+
+	/* Take a repair packet. Returns how many data packets it let us rebuild, or -1 on a write error. */
+	int add_repair(uint32_t id, const uint8_t *payload, size_t len, FileSink &sink)
+	{
+		if(enabled() == false || id <= num_data || id > last_id())
+			return 0;
+		uint32_t b = (id - num_data - 1) / r;
+		int j = (id - num_data - 1) % r;
+		if(count_missing(b, sink) == 0)
+			return 0;
+
+		std::vector<Repair> &have = pending[b];
+		for(size_t i = 0; i < have.size(); i++)
+		{
+			if(have[i].row == j)
+				return 0;
+		}
+		num_repair++;
+		Repair rep;
+		rep.row = j;
+		rep.payload.assign(payload, payload + len);
+		have.push_back(rep);
+		return recover(b, sink);
+	}
+
+	/* A data packet came in the normal way, see if that finishes off its block */
+	int data_arrived(uint32_t id, FileSink &sink)
+	{
+		if(enabled() == false || id == 0 || id > num_data)
+			return 0;
+		uint32_t b = (id - 1) / k;
+		if(pending.count(b) == 0)
+			return 0;
+		return recover(b, sink);
+	}
+
+private:
+	struct Repair
+	{
+		int row;
+		std::vector<uint8_t> payload;
+	};
+
+	int k, r;
+	uint32_t num_data;
+	std::map<uint32_t, std::vector<Repair> > pending;
+	unsigned long num_recovered, num_blocks_recovered, num_repair;
+
+	uint32_t block_first(uint32_t b) const { return b * k + 1; }
+	int block_len(uint32_t b) const
+	{
+		uint32_t left = num_data - b * k;
+		return left < (uint32_t)k ? left : k;
+	}
+
+	int count_missing(uint32_t b, const FileSink &sink) const
+	{
+		int m = 0;
+		for(int i = 0; i < block_len(b); i++)
+			m += sink.has(block_first(b) + i) == false;
+		return m;
+	}
+
+	int recover(uint32_t b, FileSink &sink)
+	{
+		std::vector<Repair> &have = pending[b];
+		std::vector<int> missing;
+		for(int i = 0; i < block_len(b); i++)
+		{
+			if(sink.has(block_first(b) + i) == false)
+				missing.push_back(i);
+		}
+		int m = missing.size();
+		if(m == 0)
+		{
+			pending.erase(b);
+			return 0;
+		}
+		if((int)have.size() < m)
+			return 0;
+
+		// Take the data we've got back out of the repair packets
+		size_t len = have[0].payload.size();
+		std::vector<int> rows(m);
+		std::vector<uint8_t*> payloads(m);
+		for(int c = 0; c < m; c++)
+		{
+			rows[c] = have[c].row;
+			payloads[c] = have[c].payload.data();
+		}
+		std::vector<uint8_t> chunk(len);
+		const Gf256 &gf = Gf256::get();
+		for(int i = 0, mi = 0; i < block_len(b); i++)
+		{
+			if(mi < m && missing[mi] == i)
+			{
+				mi++;
+				continue;
+			}
+			if(sink.get(block_first(b) + i, chunk.data()) == false)
+				return -1;
+			for(int c = 0; c < m; c++)
+				gf.mul_add(payloads[c], chunk.data(), fec_coef(k, rows[c], i), len);
+		}
+
+		if(fec_solve(k, rows.data(), missing.data(), m, payloads.data(), len) == false)
+			return 0;
+		for(int c = 0; c < m; c++)
+		{
+			if(sink.put(block_first(b) + missing[c], payloads[c]) < 0)
+				return -1;
+		}
+		pending.erase(b);
+		num_recovered += m;
+		num_blocks_recovered++;
+		return m;
+	}
+};
+
+#endif
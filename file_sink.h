@@ -0,0 +1,208 @@
+/*
+ * Streaming sink for the receiver.
+ *
+ * Each verified chunk is written straight to its place in the output file
+ * with pwrite(), so nothing is buffered in memory but a bitmap of which
+ * chunks have arrived. The file is sized up front (sparse where the
+ * filesystem allows), and the in-order prefix is pushed out to disk as it
+ * grows. Chunk lengths come from the filesize, so any byte content,
+ * zeros included, comes through intact.
+ *
+ * Big files come a segment at a time (see file_source.h). Ids and the
+ * bitmap only ever cover the current segment, so the memory it takes is
+ * the same for any size of file.
+ */
+
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk_bitmap.h"
+
+class FileSink
+{
+public:
+	FileSink() : fd(-1), filesize(0), chunk_size(0), seg(0), seg_first(0), seg_len(0), prefix(1), flushed(0) {}
+	~FileSink() { finish(); }
+
+	/* Create or truncate the output file, or keep what's in it to resume a transfer */
+	bool open(const char *filename, bool keep = false)
+	{
+		fd = ::open(filename, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+		return fd >= 0;
+	}
+
+	/* Called once we know how big the file is, and how many chunks go in a segment */
+	bool start(uint64_t size, size_t payload_size, uint32_t segment_len)
+	{
+		filesize = size;
+		chunk_size = payload_size;
+		seg_len = segment_len;
+		select(0);
+		flushed = 0;
+		return ftruncate(fd, filesize) == 0;
+	}
+
+	/*
+	 * Pick up an interrupted transfer: everything before segment is already
+	 * in the file, and of that segment, the chunks set in words.
+	 */
+	bool restore(uint32_t segment, const std::vector<uint64_t> &words)
+	{
+		if((uint64_t)segment * seg_len >= total_chunks())
+			return false;
+		select(segment);
+		if(received.load(words) == false)
+		{
+			select(0);
+			return false;
+		}
+		prefix = received.next_clear(1);
+		flushed = offset_of(1);
+		return true;
+	}
+
+	/* Make sure everything written so far is on disk */
+	bool sync() { return fd >= 0 && fdatasync(fd) == 0; }
+
+	/* Move on to the next segment, once this one is complete */
+	bool next_segment()
+	{
+		if(complete() == false || last_segment())
+			return false;
+		select(seg + 1);
+		return true;
+	}
+
+	uint64_t total_chunks() const { return (filesize + chunk_size - 1) / chunk_size; }
+	uint32_t segment() const { return seg; }
+	bool last_segment() const { return seg_first + received.size() >= total_chunks(); }
+	/* Memory the bookkeeping takes */
+	size_t bytes() const { return received.bytes(); }
+
+	/* The rest is all about the current segment */
+	uint32_t num_chunks() const { return received.size(); }
+	uint32_t num_received() const { return received.count(); }
+	uint32_t num_missing() const { return received.size() - received.count(); }
+	bool complete() const { return received.count() == received.size(); }
+	bool has(uint32_t id) const { return received.test(id); }
+	const ChunkBitmap &chunks() const { return received; }
+
+	/* Every chunk before this one has arrived */
+	uint32_t next_missing() const { return prefix; }
+
+	/* How many bytes of chunk id are real file data */
+	size_t chunk_len(uint32_t id) const
+	{
+		uint64_t offset = offset_of(id);
+		return filesize - offset < chunk_size ? filesize - offset : chunk_size;
+	}
+
+	/*
+	 * Write chunk id to the file. Returns 1 if it was new, 0 if we already
+	 * had it or it isn't part of the file, -1 if the write failed.
+	 */
+	int put(uint32_t id, const uint8_t *payload)
+	{
+		if(id == 0 || id > received.size() || received.test(id))
+			return 0;
+
+		uint64_t offset = offset_of(id);
+		size_t len = chunk_len(id);
+		size_t done = 0;
+		while(done < len)
+		{
+			ssize_t n = pwrite(fd, payload + done, len - done, offset + done);
+			if(n < 0)
+				return -1;
+			done += n;
+		}
+		received.set(id);
+
+		if(id == prefix)
+		{
+			prefix = received.next_clear(prefix);
+			flush_prefix();
+		}
+		return 1;
+	}
+
+	/* Read back a chunk we already have, zero padded like it was sent */
+	bool get(uint32_t id, uint8_t *buf) const
+	{
+		memset(buf, 0, chunk_size);
+		if(received.test(id) == false)
+			return false;
+		uint64_t offset = offset_of(id);
+		size_t len = chunk_len(id);
+		size_t done = 0;
+		while(done < len)
+		{
+			ssize_t n = pread(fd, buf + done, len - done, offset + done);
+			if(n <= 0)
+				return false;
+			done += n;
+		}
+		return true;
+	}
+
+	/* Flush everything and close the file */
+	bool finish()
+	{
+		if(fd < 0)
+			return true;
+		bool ok = fdatasync(fd) == 0;
+		ok = ::close(fd) == 0 && ok;
+		fd = -1;
+		return ok;
+	}
+
+private:
+	// Start writeback of the in-order prefix every this many bytes
+	static const uint64_t flush_bytes = 256 * 1024;
+
+	int fd;
+	uint64_t filesize;
+	size_t chunk_size;
+	uint32_t seg;
+	uint64_t seg_first; // Chunks before the current segment
+	uint32_t seg_len;
+	ChunkBitmap received;
+	uint32_t prefix;
+	uint64_t flushed;
+
+	uint64_t offset_of(uint32_t id) const
+	{
+		return (seg_first + id - 1) * chunk_size;
+	}
+
+	void select(uint32_t segment)
+	{
+		seg = segment;
+		seg_first = (uint64_t)segment * seg_len;
+		uint64_t left = total_chunks() - seg_first;
+		received.resize(left < seg_len ? left : seg_len);
+		prefix = 1;
+	}
+
+	void flush_prefix()
+	{
+		uint64_t end = offset_of(prefix);
+		if(end > filesize)
+			end = filesize;
+		if(end <= flushed || end - flushed < flush_bytes)
+			return;
+#ifdef SYNC_FILE_RANGE_WRITE
+		// Kick off writeback without waiting for it
+		sync_file_range(fd, flushed, end - flushed, SYNC_FILE_RANGE_WRITE);
+#endif
+		flushed = end;
+	}
+};
+
+#endif
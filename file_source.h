@@ -0,0 +1,151 @@
+/*
+ * Streaming source for the transmitter.
+ *
+ * Hands out the file one payload sized chunk at a time, by packet id,
+ * without ever holding the whole file. New data is read ahead a block at
+ * a time with pread(); a retransmit of something older is read straight
+ * from the file so it doesn't throw away the read-ahead.
+ *
+ * Files with more chunks than fit in a 16 bit packet id go out a segment
+ * at a time. Once a segment is selected, get() takes ids relative to it,
+ * so the rest of the transmitter never sees anything but short ids.
+ */
+
+#ifndef FILE_SOURCE_H
+#define FILE_SOURCE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class FileSource
+{
+public:
+	FileSource() : fd(-1), filesize(0), chunk_size(0), seg(0), seg_first(0), seg_len(0), cache(NULL), cache_first(0), cache_count(0) {}
+	~FileSource() { close(); }
+
+	bool open(const char *filename, size_t payload_size)
+	{
+		close();
+		fd = ::open(filename, O_RDONLY);
+		if(fd < 0)
+			return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0)
+		{
+			close();
+			return false;
+		}
+		filesize = st.st_size;
+		chunk_size = payload_size;
+		select(0, num_chunks());
+		cache = (uint8_t*)malloc(cache_chunks * chunk_size);
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		return true;
+	}
+
+	void close()
+	{
+		if(fd >= 0)
+			::close(fd);
+		fd = -1;
+		free(cache);
+		cache = NULL;
+		cache_first = cache_count = 0;
+	}
+
+	uint64_t size() const { return filesize; }
+
+	uint64_t num_chunks() const
+	{
+		return (filesize + chunk_size - 1) / chunk_size;
+	}
+
+	/* Work on segment number segment, with segment_len chunks to a segment */
+	void select(uint32_t segment, uint32_t segment_len)
+	{
+		seg = segment;
+		seg_first = (uint64_t)segment * segment_len;
+		seg_len = segment_len;
+	}
+
+	uint32_t segment() const { return seg; }
+
+	/* Chunks in the selected segment, the last one can be short */
+	uint32_t segment_chunks() const
+	{
+		uint64_t left = num_chunks() > seg_first ? num_chunks() - seg_first : 0;
+		return left < seg_len ? left : seg_len;
+	}
+
+	/*
+	 * Copy chunk id (the first one of the segment is 1) into buf, zero
+	 * padded past the end of the file. Returns how many bytes of it are
+	 * real, or -1 on a read error.
+	 */
+	int get(uint32_t short_id, uint8_t *buf)
+	{
+		memset(buf, 0, chunk_size);
+		if(short_id == 0 || short_id > segment_chunks())
+			return 0;
+		uint64_t id = seg_first + short_id;
+
+		if(id < cache_first || id >= cache_first + cache_count)
+		{
+			if(cache_count != 0 && id < cache_first)
+				return read_chunks(id, 1, buf);
+
+			// Moving forward, read ahead from here
+			int got = read_chunks(id, cache_chunks, cache);
+			if(got < 0)
+				return -1;
+			cache_first = id;
+			cache_count = (got + chunk_size - 1) / chunk_size;
+			if(id >= cache_first + cache_count)
+				return 0;
+		}
+
+		uint64_t offset = (uint64_t)(id - 1) * chunk_size;
+		size_t len = filesize - offset < chunk_size ? filesize - offset : chunk_size;
+		memcpy(buf, cache + (id - cache_first) * chunk_size, len);
+		return len;
+	}
+
+private:
+	static const uint32_t cache_chunks = 256;
+
+	int fd;
+	uint64_t filesize;
+	size_t chunk_size;
+	uint32_t seg;
+	uint64_t seg_first; // Chunks before the selected segment
+	uint32_t seg_len;
+	uint8_t *cache;
+	uint64_t cache_first;
+	uint32_t cache_count;
+
+	/* pread count chunks starting at id, returns bytes read */
+	int read_chunks(uint64_t id, uint32_t count, uint8_t *dst)
+	{
+		uint64_t offset = (uint64_t)(id - 1) * chunk_size;
+		size_t want = count * chunk_size;
+		size_t got = 0;
+		while(got < want)
+		{
+			ssize_t n = pread(fd, dst + got, want - got, offset + got);
+			if(n < 0)
+				return -1;
+			if(n == 0)
+				break;
+			got += n;
+		}
+		return got;
+	}
+};
+
+#endif
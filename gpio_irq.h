@@ -0,0 +1,103 @@
+/*
+ * Wait on a GPIO edge through the Linux sysfs GPIO interface.
+ *
+ * Used for the nRF24's IRQ pin, which is active low: the radio pulls it
+ * down when a frame arrives and lets it go once the status register is
+ * cleared. No extra libraries needed, just a kernel with
+ * /sys/class/gpio (pin numbers are BCM GPIO numbers).
+ */
+
+#ifndef GPIO_IRQ_H
+#define GPIO_IRQ_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+class GpioIrq
+{
+public:
+	GpioIrq() : fd(-1) {}
+	~GpioIrq() { close(); }
+
+	/* Export pin as an input that reports falling edges */
+	bool open(int pin)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", pin);
+		if(access(path, F_OK) != 0)
+		{
+			char num[12];
+			snprintf(num, sizeof(num), "%d", pin);
+			write_file("/sys/class/gpio/export", num);
+			// udev can take a moment to make the new files accessible
+			for(int i = 0; i < 50 && access(path, W_OK) != 0; i++)
+				usleep(2000);
+		}
+
+		char attr[64];
+		snprintf(attr, sizeof(attr), "/sys/class/gpio/gpio%d/direction", pin);
+		if(write_file(attr, "in") == false)
+			return false;
+		snprintf(attr, sizeof(attr), "/sys/class/gpio/gpio%d/edge", pin);
+		if(write_file(attr, "falling") == false)
+			return false;
+
+		fd = ::open(path, O_RDONLY);
+		if(fd < 0)
+			return false;
+		clear();
+		return true;
+	}
+
+	bool ready() const { return fd >= 0; }
+
+	void close()
+	{
+		if(fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+
+	/* Block until the next falling edge or timeout_ms. Returns true on an edge. */
+	bool wait(int timeout_ms)
+	{
+		if(fd < 0)
+			return false;
+		struct pollfd p;
+		p.fd = fd;
+		p.events = POLLPRI | POLLERR;
+		p.revents = 0;
+		if(poll(&p, 1, timeout_ms) <= 0)
+			return false;
+		clear();
+		return true;
+	}
+
+private:
+	int fd;
+
+	/* Reading the value re-arms the edge notification */
+	void clear()
+	{
+		char buf[4];
+		lseek(fd, 0, SEEK_SET);
+		if(read(fd, buf, sizeof(buf)) < 0)
+			return;
+	}
+
+	static bool write_file(const char *path, const char *value)
+	{
+		int f = ::open(path, O_WRONLY);
+		if(f < 0)
+			return false;
+		bool ok = write(f, value, strlen(value)) == (ssize_t)strlen(value);
+		::close(f);
+		return ok;
+	}
+};
+
+#endif
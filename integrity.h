@@ -0,0 +1,418 @@
+/*
+ * Integrity checks.
+ *
+ * Per frame, one of:
+ *
+ *  - fletcher_8, the original 1 byte check over the payload only. It
+ *    folds its sums down to 4 bits each, so for one thing a flipped bit in
+ *    the top half of any byte goes unnoticed. Kept so older transmitters
+ *    still work.
+ *  - CRC-16/X-25 over the id and payload, 2 bytes.
+ *  - CRC-32C (Castagnoli) over the id and payload, 4 bytes. This uses the
+ *    ARMv8 CRC32 instructions (build with -march=armv8-a+crc) or SSE 4.2
+ *    when the compiler says they're there.
+ *
+ * The table driven CRCs use slicing-by-8: eight 256 entry tables let the
+ * loop eat 8 bytes per step with no dependency between the lookups.
+ *
+ * Per file, XXH64 of the whole thing, which the transmitter sends in the
+ * first packet and the receiver checks once it has everything.
+ */
+
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+// Frame check types, sent in byte 9 of the first packet
+const uint8_t check_fletcher_8 = 0;
+const uint8_t check_crc16 = 1;
+const uint8_t check_crc32c = 2;
+
+// Every frame on the air starts with a 16 bit id, see packets.h
+const int frame_id_bytes = 2;
+
+/* Bytes at the end of a frame each check takes up */
+template <uint8_t Check> struct CheckSize { static const int bytes = 1; };
+template <> struct CheckSize<check_crc16> { static const int bytes = 2; };
+template <> struct CheckSize<check_crc32c> { static const int bytes = 4; };
+
+inline int check_bytes(uint8_t check)
+{
+	switch(check)
+	{
+		case check_crc16: return CheckSize<check_crc16>::bytes;
+		case check_crc32c: return CheckSize<check_crc32c>::bytes;
+		default: return CheckSize<check_fletcher_8>::bytes;
+	}
+}
+
+inline const char *check_name(uint8_t check)
+{
+	switch(check)
+	{
+		case check_crc16: return "CRC-16";
+		case check_crc32c: return "CRC-32C";
+		default: return "fletcher_8";
+	}
+}
+
+inline uint8_t fletcher_8(const uint8_t *data, size_t size)
+{
+	uint8_t sum1 = 0;
+	uint8_t sum2 = 0;
+	//printf("fletcher computation: \n");
+	while(size--)
+	{
+	//	printf("i: %d, c: %c\n", size, *data);
+		sum1+=*data++;
+		sum2+= sum1;
+	}
+	return (sum1&0xF) | (sum2<<4);
+}
+
+/* Slicing-by-8 tables for a reflected CRC of up to 32 bits */
+class CrcTables
+{
+public:
+	explicit CrcTables(uint32_t poly)
+	{
+		for(int n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+			for(int k = 0; k < 8; k++)
+				c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+			t[0][n] = c;
+		}
+		for(int n = 0; n < 256; n++)
+			for(int k = 1; k < 8; k++)
+				t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+	}
+
+	uint32_t update(uint32_t crc, const uint8_t *p, size_t len) const
+	{
+		while(len >= 8)
+		{
+			uint32_t lo = crc ^ load32(p);
+			uint32_t hi = load32(p + 4);
+			crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+				t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+			p += 8;
+			len -= 8;
+		}
+		while(len--)
+			crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+		return crc;
+	}
+
+	/* One byte at a time, for comparison */
+	uint32_t update_bytewise(uint32_t crc, const uint8_t *p, size_t len) const
+	{
+		while(len--)
+			crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+		return crc;
+	}
+
+private:
+	uint32_t t[8][256];
+
+	static uint32_t load32(const uint8_t *p)
+	{
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+};
+
+inline const CrcTables &crc16_tables()
+{
+	static CrcTables tables(0x8408);
+	return tables;
+}
+
+inline const CrcTables &crc32c_tables()
+{
+	static CrcTables tables(0x82f63b78);
+	return tables;
+}
+
+/* CRC-16/X-25 */
+inline uint16_t crc16(const uint8_t *data, size_t len)
+{
+	return crc16_tables().update(0xffff, data, len) ^ 0xffff;
+}
+
+/* Carry a CRC-32C on over more data, in hardware if we can */
+inline uint32_t crc32c_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+#if defined(__ARM_FEATURE_CRC32) || defined(__SSE4_2__)
+	while(len >= 4)
+	{
+		uint32_t w;
+		memcpy(&w, data, 4);
+#if defined(__ARM_FEATURE_CRC32)
+		crc = __crc32cw(crc, w);
+#else
+		crc = _mm_crc32_u32(crc, w);
+#endif
+		data += 4;
+		len -= 4;
+	}
+	while(len--)
+	{
+#if defined(__ARM_FEATURE_CRC32)
+		crc = __crc32cb(crc, *data++);
+#else
+		crc = _mm_crc32_u8(crc, *data++);
+#endif
+	}
+#else
+	crc = crc32c_tables().update(crc, data, len);
+#endif
+	return crc;
+}
+
+inline uint32_t crc32c(const uint8_t *data, size_t len)
+{
+	return crc32c_update(0xffffffff, data, len) ^ 0xffffffff;
+}
+
+inline bool crc32c_in_hardware()
+{
+#if defined(__ARM_FEATURE_CRC32) || defined(__SSE4_2__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * The check for a frame with an IdBytes id in front, at the very end of
+ * it. The CRCs cover everything before them, id included, and past the
+ * first segment of a file the segment number too, as if it came before the
+ * frame, so a frame can't be taken for the one with the same short id in
+ * another segment. fletcher_8 only ever covered the payload. Every length
+ * and offset here is a constant, so there's nothing left to decide per
+ * frame but the segment.
+ */
+template <int IdBytes, uint8_t Check>
+struct FrameCheck
+{
+	static const int bytes = CheckSize<Check>::bytes;
+	static const int offset = 32 - bytes;
+
+	static uint32_t value(const uint8_t *frame, uint32_t segment)
+	{
+		uint8_t seg[4] = { (uint8_t)segment, (uint8_t)(segment >> 8), (uint8_t)(segment >> 16), (uint8_t)(segment >> 24) };
+		if(Check == check_crc16)
+		{
+			uint32_t crc = 0xffff;
+			if(segment != 0)
+				crc = crc16_tables().update(crc, seg, 4);
+			return crc16_tables().update(crc, frame, offset) ^ 0xffff;
+		}
+		if(Check == check_crc32c)
+		{
+			uint32_t crc = 0xffffffff;
+			if(segment != 0)
+				crc = crc32c_update(crc, seg, 4);
+			return crc32c_update(crc, frame, offset) ^ 0xffffffff;
+		}
+		return fletcher_8(frame + IdBytes, offset - IdBytes);
+	}
+
+	static void seal(uint8_t *frame, uint32_t segment)
+	{
+		uint32_t c = value(frame, segment);
+		memcpy(frame + offset, &c, bytes);
+	}
+
+	static bool ok(const uint8_t *frame, uint32_t segment)
+	{
+		uint32_t c = value(frame, segment);
+		return memcmp(frame + offset, &c, bytes) == 0;
+	}
+};
+
+inline uint32_t frame_check_value(const uint8_t *frame, uint8_t check, uint32_t segment)
+{
+	switch(check)
+	{
+		case check_crc16: return FrameCheck<frame_id_bytes, check_crc16>::value(frame, segment);
+		case check_crc32c: return FrameCheck<frame_id_bytes, check_crc32c>::value(frame, segment);
+		default: return FrameCheck<frame_id_bytes, check_fletcher_8>::value(frame, segment);
+	}
+}
+
+/* Fill in the check at the end of a 32 byte frame */
+inline void seal_frame(uint8_t *frame, uint8_t check, uint32_t segment = 0)
+{
+	switch(check)
+	{
+		case check_crc16: FrameCheck<frame_id_bytes, check_crc16>::seal(frame, segment); break;
+		case check_crc32c: FrameCheck<frame_id_bytes, check_crc32c>::seal(frame, segment); break;
+		default: FrameCheck<frame_id_bytes, check_fletcher_8>::seal(frame, segment); break;
+	}
+}
+
+inline bool frame_ok(const uint8_t *frame, uint8_t check, uint32_t segment = 0)
+{
+	switch(check)
+	{
+		case check_crc16: return FrameCheck<frame_id_bytes, check_crc16>::ok(frame, segment);
+		case check_crc32c: return FrameCheck<frame_id_bytes, check_crc32c>::ok(frame, segment);
+		default: return FrameCheck<frame_id_bytes, check_fletcher_8>::ok(frame, segment);
+	}
+}
+
+/* Streaming XXH64 */
+class Xxh64
+{
+public:
+	explicit Xxh64(uint64_t seed = 0) : total(0), buf_len(0)
+	{
+		v[0] = seed + p1 + p2;
+		v[1] = seed + p2;
+		v[2] = seed;
+		v[3] = seed - p1;
+		start_seed = seed;
+	}
+
+	void update(const void *data, size_t len)
+	{
+		const uint8_t *p = (const uint8_t*)data;
+		total += len;
+		if(buf_len + len < 32)
+		{
+			memcpy(buf + buf_len, p, len);
+			buf_len += len;
+			return;
+		}
+		if(buf_len > 0)
+		{
+			size_t fill = 32 - buf_len;
+			memcpy(buf + buf_len, p, fill);
+			stripe(buf);
+			p += fill;
+			len -= fill;
+			buf_len = 0;
+		}
+		while(len >= 32)
+		{
+			stripe(p);
+			p += 32;
+			len -= 32;
+		}
+		memcpy(buf, p, len);
+		buf_len = len;
+	}
+
+	uint64_t digest() const
+	{
+		uint64_t h;
+		if(total >= 32)
+		{
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+			for(int i = 0; i < 4; i++)
+			{
+				h ^= round(0, v[i]);
+				h = h * p1 + p4;
+			}
+		}
+		else
+		{
+			h = start_seed + p5;
+		}
+		h += total;
+
+		const uint8_t *p = buf;
+		size_t len = buf_len;
+		while(len >= 8)
+		{
+			h ^= round(0, load64(p));
+			h = rotl(h, 27) * p1 + p4;
+			p += 8;
+			len -= 8;
+		}
+		if(len >= 4)
+		{
+			h ^= (uint64_t)load32(p) * p1;
+			h = rotl(h, 23) * p2 + p3;
+			p += 4;
+			len -= 4;
+		}
+		while(len--)
+		{
+			h ^= *p++ * p5;
+			h = rotl(h, 11) * p1;
+		}
+
+		h ^= h >> 33;
+		h *= p2;
+		h ^= h >> 29;
+		h *= p3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static const uint64_t p1 = 0x9e3779b185ebca87ULL;
+	static const uint64_t p2 = 0xc2b2ae3d27d4eb4fULL;
+	static const uint64_t p3 = 0x165667b19e3779f9ULL;
+	static const uint64_t p4 = 0x85ebca77c2b2ae63ULL;
+	static const uint64_t p5 = 0x27d4eb2f165667c5ULL;
+
+	uint64_t v[4];
+	uint64_t start_seed;
+	uint64_t total;
+	uint8_t buf[32];
+	size_t buf_len;
+
+	static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static uint64_t round(uint64_t acc, uint64_t in) { return rotl(acc + in * p2, 31) * p1; }
+
+	static uint64_t load64(const uint8_t *p)
+	{
+		return (uint64_t)load32(p) | ((uint64_t)load32(p + 4) << 32);
+	}
+	static uint32_t load32(const uint8_t *p)
+	{
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+
+	void stripe(const uint8_t *p)
+	{
+		for(int i = 0; i < 4; i++)
+			v[i] = round(v[i], load64(p + 8 * i));
+	}
+};
+
+/* XXH64 of a whole file. Returns false if it can't be read. */
+inline bool file_digest(const char *filename, uint64_t *digest)
+{
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return false;
+	Xxh64 h;
+	static const size_t block = 64 * 1024;
+	uint8_t *buf = new uint8_t[block];
+	ssize_t n;
+	while((n = read(fd, buf, block)) > 0)
+		h.update(buf, n);
+	delete[] buf;
+	close(fd);
+	if(n < 0)
+		return false;
+	*digest = h.digest();
+	return true;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Receive journal, so an interrupted transfer can pick up where it left
+ * off instead of starting again from packet 1.
+ *
+ * It lives next to the output file and holds which file it's for (the
+ * transmitter's digest and the layout of the packets) and which chunks of
+ * the current segment have made it to disk:
+ *
+ *   "RF24JNL1" | identity | uint32_t segment | uint32_t words | bitmap
+ *
+ * Segments before the current one are all there, that's how segments
+ * work, so the whole thing is never more than about 8KB. The receiver
+ * syncs the output file before each save, so anything the journal says we
+ * have really is in the file; at worst it's a little behind.
+ *
+ * A save never touches the journal that's there: it's written out whole
+ * to path.tmp, synced, and renamed over it. Losing power part way through
+ * leaves the old journal or the new one, never half of each.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "chunk_bitmap.h"
+
+class Journal
+{
+public:
+	/* What has to match for the chunks we have to be any use */
+	struct Identity
+	{
+		uint64_t digest; // XXH64 of the original file
+		uint64_t size; // As sent, after any compression
+		uint64_t original_size;
+		uint32_t segment_len;
+		uint32_t payload_size;
+
+		bool operator==(const Identity &o) const
+		{
+			return digest == o.digest && size == o.size && original_size == o.original_size &&
+				segment_len == o.segment_len && payload_size == o.payload_size;
+		}
+	};
+
+	Journal() : loaded(false), seg(0) {}
+
+	/* Read the journal at path, if there is one. It isn't created until the first save(). */
+	bool open(const char *path)
+	{
+		name = path;
+		loaded = false;
+		int fd = ::open(path, O_RDONLY);
+		if(fd < 0)
+			return false;
+		Header h;
+		bool ok = pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && memcmp(h.magic, magic, sizeof(h.magic)) == 0 &&
+			h.num_words <= max_words;
+		if(ok)
+		{
+			bits.resize(h.num_words);
+			size_t len = h.num_words * sizeof(uint64_t);
+			ok = pread(fd, bits.data(), len, sizeof(h)) == (ssize_t)len;
+		}
+		::close(fd);
+		if(ok == false)
+			return false;
+		ident = h.ident;
+		seg = h.segment;
+		loaded = true;
+		return true;
+	}
+
+	/* There's a journal from an earlier transfer */
+	bool exists() const { return loaded; }
+
+	/* There's a journal, and it's for this file */
+	bool matches(const Identity &id) const { return loaded && ident == id; }
+
+	uint32_t segment() const { return seg; }
+	const std::vector<uint64_t> &words() const { return bits; }
+
+	/* Record where we're at. The chunks in it have to be on disk already. */
+	bool save(const Identity &id, uint32_t segment, const ChunkBitmap &have)
+	{
+		std::string tmp = name + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			return false;
+		std::vector<uint8_t> buf(sizeof(Header) + have.bytes());
+		Header h;
+		memcpy(h.magic, magic, sizeof(h.magic));
+		h.ident = id;
+		h.segment = segment;
+		h.num_words = have.bytes() / sizeof(uint64_t);
+		memcpy(buf.data(), &h, sizeof(h));
+		memcpy(buf.data() + sizeof(h), have.data(), have.bytes());
+		bool ok = pwrite(fd, buf.data(), buf.size(), 0) == (ssize_t)buf.size() && fsync(fd) == 0;
+		ok = ::close(fd) == 0 && ok;
+		if(ok == false || rename(tmp.c_str(), name.c_str()) != 0)
+		{
+			unlink(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	/* The transfer's done (or hopeless), forget about it */
+	void remove()
+	{
+		if(name.empty() == false)
+		{
+			unlink(name.c_str());
+			unlink((name + ".tmp").c_str());
+		}
+		loaded = false;
+	}
+
+private:
+	struct Header
+	{
+		char magic[8];
+		Identity ident;
+		uint32_t segment;
+		uint32_t num_words;
+	};
+	static constexpr const char *magic = "RF24JNL1";
+	// A whole segment's bitmap, with room to spare
+	static const uint32_t max_words = 1024;
+
+	std::string name;
+	bool loaded;
+	Identity ident;
+	uint32_t seg;
+	std::vector<uint64_t> bits;
+};
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * Adaptive link control (-A).
+ *
+ * Every data rate and auto-retry count is a trade: 2Mbps gets a frame out
+ * in half the time of 1Mbps but needs a better signal for it, and more
+ * retries save a round of asking for the frame again later but waste time
+ * on a link that's down for a while. So rather than guess, the transmitter
+ * measures goodput, the payload bytes per second that make it through:
+ * frames ACKed, less any a loss report (-a) says arrived broken anyway.
+ *
+ * Time is cut into epochs of a quarter second. LinkController keeps a
+ * running goodput for each rate and retry count it has been on, stays
+ * with the best one (home) most of the time, and every few epochs spends
+ * one on a neighbour: one retry step either way, and every so often the
+ * next rate up or down. The neighbour becomes home if it beats it by a
+ * margin. An epoch that loses most frames goes straight to trying more
+ * retries or a slower rate, and a channel that loses most frames whatever
+ * we do is given up on for the quietest one a scan finds.
+ *
+ * The retry count and delay are the transmitter's own business, but both
+ * ends have to move to a new rate or channel at once, see change_link() in
+ * rf24_transfer.cpp. This only decides; it never touches the radio.
+ */
+
+#ifndef LINK_CONTROL_H
+#define LINK_CONTROL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "transport.h"
+
+struct LinkSettings
+{
+	uint8_t channel;
+	rf24_datarate_e rate;
+	uint8_t ard; // Auto-retry delay, in 250us steps after the first
+	uint8_t arc; // Auto-retries
+};
+
+inline const char *rate_name(rf24_datarate_e rate)
+{
+	switch(rate)
+	{
+		case RF24_2MBPS: return "2Mbps";
+		case RF24_250KBPS: return "250Kbps";
+		default: return "1Mbps";
+	}
+}
+
+class LinkController
+{
+public:
+	LinkController() : on(false) {}
+
+	void start(const LinkSettings &s, int payload_bytes, bool ack_payloads)
+	{
+		on = true;
+		payload = payload_bytes;
+		ack_pay = ack_payloads;
+		cur = s;
+		home_r = cur_r = pending_r = rate_index(s.rate);
+		home_a = cur_a = pending_a = 0;
+		for(int a = 0; a < num_arcs; a++)
+		{
+			if(arcs[a] <= s.arc)
+				home_a = cur_a = pending_a = a;
+		}
+		forget();
+		epochs = samples = bad_epochs = 0;
+		num_moves = num_failed_moves = num_rescans = 0;
+		dir = 1;
+		sampling = false;
+		begin_epoch();
+	}
+
+	bool enabled() const { return on; }
+	const LinkSettings &settings() const { return cur; }
+	uint8_t next_seq()
+	{
+		// 0 is the receiver's for none yet
+		if(++seq == 0)
+			seq++;
+		return seq;
+	}
+
+	/* Shortest auto-retry delay that leaves time for the ACK, and its payload with -a */
+	static uint8_t retry_delay(rf24_datarate_e rate, bool ack_payloads)
+	{
+		if(rate == RF24_250KBPS)
+			return ack_payloads ? 5 : 1;
+		return ack_payloads ? 1 : 0;
+	}
+
+	/* A data frame went out, and whether it was ACKed and how many retries that took */
+	void sent(bool acked, uint8_t retries)
+	{
+		if(acked)
+			num_acked++;
+		else
+			num_failed++;
+		num_retries += retries;
+	}
+
+	/* A loss report says n frames that were ACKed arrived broken */
+	void broken(unsigned n) { num_broken += n; }
+
+	/*
+	 * Call after every frame. When an epoch is over and it's time to be
+	 * somewhere else, returns true with where in to. If rescan comes back
+	 * true, the channel is no good either and the caller should look for
+	 * another to put in to.channel. Either way, say how it went with
+	 * moved().
+	 */
+	bool next(LinkSettings &to, bool &rescan)
+	{
+		uint32_t elapsed = millis() - epoch_start;
+		rescan = false;
+		if(elapsed < epoch_ms || num_acked + num_failed < min_epoch_frames)
+			return false;
+
+		unsigned long good = num_acked > num_broken ? num_acked - num_broken : 0;
+		double goodput = good * (double)payload * 1000.0 / elapsed;
+		double &s = score[cur_r][cur_a];
+		s = known[cur_r][cur_a] ? (s + goodput) / 2 : goodput;
+		known[cur_r][cur_a] = true;
+		bool bad = num_failed * 2 > num_acked + num_failed;
+		bad_epochs = bad ? bad_epochs + 1 : 0;
+		epochs++;
+		if(verbose)
+			printf("Link epoch %lu: %s, %d retries, %.0f bytes/sec, %lu ACKed, %lu failed, %lu retries, %lu broken.\n",
+				epochs, rate_name(cur.rate), cur.arc, goodput, num_acked, num_failed, num_retries, num_broken);
+		begin_epoch();
+
+		int to_r = home_r, to_a = home_a;
+		if(bad_epochs >= max_bad_epochs)
+		{
+			rescan = true;
+			bad_epochs = 0;
+		}
+		else if(sampling)
+		{
+			// Back home, unless the neighbour did better
+			if(score[cur_r][cur_a] > score[home_r][home_a] * move_margin)
+			{
+				home_r = cur_r;
+				home_a = cur_a;
+			}
+			to_r = home_r;
+			to_a = home_a;
+			sampling = false;
+		}
+		else
+		{
+			// Something we tried before may look better than home does now, check again
+			int best_r = home_r, best_a = home_a;
+			for(int r = 0; r < num_rates; r++)
+			{
+				for(int a = 0; a < num_arcs; a++)
+				{
+					if(known[r][a] && score[r][a] > score[best_r][best_a] * move_margin)
+					{
+						best_r = r;
+						best_a = a;
+					}
+				}
+			}
+			if(best_r != home_r || best_a != home_a)
+			{
+				to_r = best_r;
+				to_a = best_a;
+				sampling = true;
+			}
+			else if(bad)
+			{
+				// Losing most frames, try more retries or a slower rate right away
+				samples++;
+				if(home_a + 1 < num_arcs && (samples % 2 || home_r + 1 == num_rates))
+					to_a = home_a + 1;
+				else if(home_r + 1 < num_rates)
+					to_r = home_r + 1;
+				sampling = to_r != home_r || to_a != home_a;
+			}
+			else if(epochs % sample_every == 0)
+			{
+				samples++;
+				dir = -dir;
+				if(samples % rate_sample_every == 0)
+					to_r = step(home_r, num_rates);
+				else
+					to_a = step(home_a, num_arcs);
+				sampling = true;
+			}
+		}
+
+		pending_r = to_r;
+		pending_a = to_a;
+		to = cur;
+		to.rate = rates[to_r];
+		to.arc = arcs[to_a];
+		to.ard = retry_delay(to.rate, ack_pay);
+		return rescan || to_r != cur_r || to_a != cur_a;
+	}
+
+	/* The move next() asked for went through, or didn't */
+	void moved(const LinkSettings &to, bool ok)
+	{
+		if(ok)
+		{
+			if(to.channel != cur.channel)
+			{
+				// What we knew was about the old channel
+				num_rescans++;
+				forget();
+				home_r = pending_r;
+				home_a = pending_a;
+				sampling = false;
+			}
+			cur = to;
+			cur_r = pending_r;
+			cur_a = pending_a;
+			num_moves++;
+		}
+		else
+		{
+			num_failed_moves++;
+			sampling = false;
+		}
+		// Don't count the time it took against wherever we are now
+		begin_epoch();
+	}
+
+	void print_stats() const
+	{
+		if(on == false)
+			return;
+		printf("Link control: %lu epochs, %lu moves (%lu failed, %lu to another channel), ended up on channel %d at %s with %d retries.\n",
+			epochs, num_moves, num_failed_moves, num_rescans, cur.channel, rate_name(cur.rate), cur.arc);
+		for(int r = 0; r < num_rates; r++)
+		{
+			int best = -1;
+			for(int a = 0; a < num_arcs; a++)
+			{
+				if(known[r][a] && (best < 0 || score[r][a] > score[r][best]))
+					best = a;
+			}
+			if(best >= 0)
+				printf("  %s: %.0f bytes/sec at best, with %d retries\n", rate_name(rates[r]), score[r][best], arcs[best]);
+		}
+	}
+
+	bool verbose = false; // Print how every epoch went
+
+private:
+	static const int num_rates = 3;
+	static const int num_arcs = 4;
+	const rf24_datarate_e rates[num_rates] = { RF24_2MBPS, RF24_1MBPS, RF24_250KBPS };
+	const uint8_t arcs[num_arcs] = { 1, 3, 7, 15 };
+
+	static const uint32_t epoch_ms = 250;
+	static const unsigned long min_epoch_frames = 16;
+	static const int sample_every = 4; // Epochs at home between tries of a neighbour
+	static const int rate_sample_every = 3; // Of those tries, how often it's another rate
+	static const int max_bad_epochs = 4; // Epochs in a row losing most frames, safer ones included, before looking for another channel
+	static constexpr double move_margin = 1.1;
+
+	bool on;
+	int payload;
+	bool ack_pay;
+	LinkSettings cur;
+	int cur_r, cur_a, home_r, home_a, pending_r, pending_a;
+	double score[num_rates][num_arcs]; // Running goodput, in bytes/sec
+	bool known[num_rates][num_arcs];
+	bool sampling; // On a neighbour for an epoch
+	int dir;
+	unsigned long epochs, samples;
+	int bad_epochs;
+	uint8_t seq = 0;
+	unsigned long num_moves, num_failed_moves, num_rescans;
+
+	// This epoch
+	uint32_t epoch_start;
+	unsigned long num_acked, num_failed, num_retries, num_broken;
+
+	void begin_epoch()
+	{
+		epoch_start = millis();
+		num_acked = num_failed = num_retries = num_broken = 0;
+	}
+
+	void forget()
+	{
+		for(int r = 0; r < num_rates; r++)
+		{
+			for(int a = 0; a < num_arcs; a++)
+			{
+				score[r][a] = 0;
+				known[r][a] = false;
+			}
+		}
+	}
+
+	int rate_index(rf24_datarate_e rate) const
+	{
+		for(int r = 0; r < num_rates; r++)
+		{
+			if(rates[r] == rate)
+				return r;
+		}
+		return 0;
+	}
+
+	/* The neighbour of i in the direction we're trying this time, or the other way at the ends */
+	int step(int i, int n) const
+	{
+		int j = i + dir;
+		if(j < 0 || j >= n)
+			j = i - dir;
+		return j;
+	}
+};
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * The packets themselves: building data frames, packing them down to what
+ * goes on the air, and the retransmit requests a receiver sends for what
+ * it's missing. Nothing in here touches a radio, so bench_protocol.cpp can
+ * time it on its own.
+ */
+
+#ifndef PACKETS_H
+#define PACKETS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chunk_bitmap.h"
+#include "file_source.h"
+#include "integrity.h"
+
+/*
+ * Shorten a frame to what has to go on the air. The other end zero fills
+ * whatever is missing off the end (see read_frame), so trailing zeros can
+ * be left off. A data frame's check has to stay, so its last check_len
+ * bytes move up to just past the last byte before them that isn't zero
+ * (see unpack_data_frame). out may be frame. Returns the length.
+ */
+inline uint8_t pack_frame(uint8_t *out, const uint8_t *frame, int check_len, int id_bytes = frame_id_bytes)
+{
+	int end = 32 - check_len;
+	int used = end;
+	// A data frame keeps its id, anything else at least a byte
+	int min_used = check_len > 0 ? id_bytes : 1;
+	while(used > min_used && frame[used - 1] == '\0')
+		used--;
+	memmove(out, frame, used);
+	memmove(out + used, frame + end, check_len);
+	return used + check_len;
+}
+
+/*
+ * Where everything goes in a data frame:
+ *
+ *   id, IdBytes | payload | check, see FrameCheck in integrity.h
+ *
+ * All of it is worked out at compile time, so building a frame or taking
+ * one apart is fixed loads and stores, with no lengths or offsets to look
+ * up per frame. Ids are little endian like everything else on the air.
+ * The protocol itself has 16 bit ids (frame_id_bytes), other widths are
+ * there for trying out variants without touching any of this.
+ */
+template <int IdBytes, uint8_t Check>
+struct DataFrame
+{
+	typedef FrameCheck<IdBytes, Check> check_type;
+	static const int id_bytes = IdBytes;
+	static const int check_bytes = check_type::bytes;
+	static const int payload_offset = IdBytes;
+	static const int payload_bytes = 32 - IdBytes - check_bytes;
+	static_assert(IdBytes >= 1 && IdBytes <= 4, "ids are 1 to 4 bytes");
+	static_assert(payload_bytes > 0, "no room left in the frame for a payload");
+
+	static uint32_t id(const uint8_t *frame)
+	{
+		uint32_t v = 0;
+		memcpy(&v, frame, IdBytes);
+		return v;
+	}
+	static void set_id(uint8_t *frame, uint32_t id) { memcpy(frame, &id, IdBytes); }
+	static uint8_t *payload(uint8_t *frame) { return frame + payload_offset; }
+	static const uint8_t *payload(const uint8_t *frame) { return frame + payload_offset; }
+
+	/* Fill in data packet id with its chunk of the file */
+	static void build(uint8_t *frame, uint32_t id, FileSource &source)
+	{
+		memset(frame, '\0', 32);
+		set_id(frame, id);
+		source.get(id, frame + payload_offset);
+		check_type::seal(frame, source.segment());
+	}
+
+	/* Repair packets look just like data packets, with ids past the end of the segment */
+	static void build(uint8_t *frame, uint32_t id, const uint8_t *data, uint32_t segment)
+	{
+		memset(frame, '\0', 32);
+		set_id(frame, id);
+		memcpy(frame + payload_offset, data, payload_bytes);
+		check_type::seal(frame, segment);
+	}
+
+	static bool ok(const uint8_t *frame, uint32_t segment) { return check_type::ok(frame, segment); }
+
+	static uint8_t pack(uint8_t *out, const uint8_t *frame) { return pack_frame(out, frame, check_bytes, IdBytes); }
+
+	/* Put a short frame's check back at the end, where ok() looks for it */
+	static void unpack(uint8_t *frame, uint8_t len)
+	{
+		if(len >= 32 || len < IdBytes + check_bytes)
+			return;
+		uint8_t c[check_bytes];
+		memcpy(c, frame + len - check_bytes, check_bytes);
+		memset(frame + len - check_bytes, '\0', 32 - (len - check_bytes));
+		memcpy(frame + check_type::offset, c, check_bytes);
+	}
+};
+
+// These are details about how the packets are built.
+// I guess if the radio's packet size changes you could change them, or if you wanted to increase the pkt_id from
+// uint16_t to uint32_t at the expense of 2 data bytes you could do that oo. 
+const int num_header_bytes = frame_id_bytes;
+const int num_payload_bytes = DataFrame<num_header_bytes, check_fletcher_8>::payload_bytes; // 32 - 2 (header) - 1 (checksum) = 29
+const int num_special_header_bytes = 2; // '\0' + some char 
+
+// The data frames the protocol sends, one for each kind of check
+typedef DataFrame<num_header_bytes, check_fletcher_8> fletcher_frame;
+typedef DataFrame<num_header_bytes, check_crc16> crc16_frame;
+typedef DataFrame<num_header_bytes, check_crc32c> crc32c_frame;
+
+// Files with more pkts than fit in the 16 bit ids go a segment at a time,
+// each with its own ids from 1. With FEC or a window that leaves a little
+// room at the top, see segment_length().
+const uint32_t max_data_ids = 0xffff;
+const uint32_t max_segment_ids = 0xff00;
+
+/*
+ * Byte 9 of the first packet says how data frames are checked, see
+ * integrity.h, so it's only known at run time. These pick the layout for
+ * it, for anything that isn't per frame or isn't worth a template of its
+ * own. send_data() picks once for the whole segment instead.
+ */
+inline int frame_payload_bytes(uint8_t check)
+{
+	switch(check)
+	{
+		case check_crc16: return crc16_frame::payload_bytes;
+		case check_crc32c: return crc32c_frame::payload_bytes;
+		default: return fletcher_frame::payload_bytes;
+	}
+}
+
+inline void build_data_pkt(uint8_t *data, uint16_t id, FileSource &source, uint8_t check)
+{
+	switch(check)
+	{
+		case check_crc16: crc16_frame::build(data, id, source); break;
+		case check_crc32c: crc32c_frame::build(data, id, source); break;
+		default: fletcher_frame::build(data, id, source); break;
+	}
+}
+
+inline void build_fec_pkt(uint8_t *data, uint16_t id, const uint8_t *payload, uint8_t check, uint32_t segment)
+{
+	switch(check)
+	{
+		case check_crc16: crc16_frame::build(data, id, payload, segment); break;
+		case check_crc32c: crc32c_frame::build(data, id, payload, segment); break;
+		default: fletcher_frame::build(data, id, payload, segment); break;
+	}
+}
+
+inline void unpack_data_frame(uint8_t *frame, uint8_t len, uint8_t check)
+{
+	switch(check)
+	{
+		case check_crc16: crc16_frame::unpack(frame, len); break;
+		case check_crc32c: crc32c_frame::unpack(frame, len); break;
+		default: fletcher_frame::unpack(frame, len); break;
+	}
+}
+
+/*
+ * Retransmit requests, '\0' type uint16_t num_re_tx_pkts and then the
+ * body: up to 13 ids for an old style one, see build_compact_re_tx_pkt for
+ * compact ones.
+ */
+const uint8_t re_tx_old = '2';
+const uint8_t re_tx_compact = '3';
+const int num_re_tx_header_bytes = 4; 
+const int num_re_tx_payload_bytes = 26; // Round down to the nearest even number to keep math simple when dealing with 2 byte pkt ids. 
+
+// Compact retransmit requests, see build_compact_re_tx_pkt
+const int compact_encoding_byte = 4;
+const int compact_count_byte = 5;
+const uint8_t re_tx_ranges = 0;
+const uint8_t re_tx_bitmap = 1;
+const uint8_t re_tx_list = 2;
+const int num_compact_re_tx_header_bytes = 6;
+const int max_re_tx_ranges = 8;
+const int max_re_tx_list_ids = 13;
+const int num_re_tx_bitmap_bits = 24 * 8;
+const int max_ids_per_re_tx_pkt = max_re_tx_ranges * 256;
+
+/* How many ids an old style retransmit request ('\0' '2') has, they end at the first 0 */
+inline uint16_t length_re_tx_packet(uint8_t *data)
+{
+	uint8_t ctr = 0;
+	for(int i = num_re_tx_header_bytes; i < num_re_tx_header_bytes + num_re_tx_payload_bytes; i += sizeof(uint16_t))
+	{
+		uint16_t x; 
+		memcpy(&x, data + i, sizeof(uint16_t));
+		if(x == 0)
+			return ctr;
+		else
+			ctr++;
+	}
+	return ctr;
+}
+
+/*
+ * Compact retransmit request:
+ * '\0' '3' uint16_t num_re_tx_pkts, uint8_t encoding, uint8_t num_ranges, 26 bytes
+ *
+ * re_tx_ranges: num_ranges * (uint16_t first id, uint8_t length - 1)
+ * re_tx_bitmap: uint16_t base id, then bit i of the next 24 bytes is set if
+ *               base + i is missing
+ * re_tx_list:   num_ids * uint16_t id, for sparse loss
+ *
+ * Fills pkt with whichever encoding covers more of missing, which must be
+ * sorted. Returns how many entries of missing it covers.
+ */
+inline int build_compact_re_tx_pkt(uint16_t *missing, int num_missing, uint8_t *pkt)
+{
+	memset(pkt, '\0', 32);
+	pkt[1] = re_tx_compact;
+
+	// How far would each encoding get?
+	int range_covers = 0, num_ranges = 0;
+	while(range_covers < num_missing && num_ranges < max_re_tx_ranges)
+	{
+		int len = 1;
+		while(range_covers + len < num_missing && len < 256 && missing[range_covers + len] == missing[range_covers] + len)
+			len++;
+		range_covers += len;
+		num_ranges++;
+	}
+	int bitmap_covers = 0;
+	while(bitmap_covers < num_missing && missing[bitmap_covers] - missing[0] < num_re_tx_bitmap_bits)
+		bitmap_covers++;
+
+	int list_covers = num_missing < max_re_tx_list_ids ? num_missing : max_re_tx_list_ids;
+
+	uint8_t *body = pkt + num_compact_re_tx_header_bytes;
+	if(list_covers > range_covers && list_covers > bitmap_covers)
+	{
+		pkt[compact_encoding_byte] = re_tx_list;
+		pkt[compact_count_byte] = list_covers;
+		memcpy(body, missing, list_covers * sizeof(uint16_t));
+		return list_covers;
+	}
+	if(range_covers >= bitmap_covers)
+	{
+		pkt[compact_encoding_byte] = re_tx_ranges;
+		pkt[compact_count_byte] = num_ranges;
+		int i = 0;
+		for(int r = 0; r < num_ranges; r++)
+		{
+			int len = 1;
+			while(i + len < range_covers && len < 256 && missing[i + len] == missing[i] + len)
+				len++;
+			memcpy(body + r * 3, &missing[i], sizeof(uint16_t));
+			body[r * 3 + 2] = len - 1;
+			i += len;
+		}
+		return range_covers;
+	}
+
+	pkt[compact_encoding_byte] = re_tx_bitmap;
+	memcpy(body, &missing[0], sizeof(uint16_t));
+	for(int i = 0; i < bitmap_covers; i++)
+	{
+		int bit = missing[i] - missing[0];
+		body[2 + bit / 8] |= 1 << (bit % 8);
+	}
+	return bitmap_covers;
+}
+
+/* Expand a compact retransmit request into ids. Returns how many there are. */
+inline int decode_compact_re_tx_pkt(uint8_t *pkt, uint16_t *ids)
+{
+	uint8_t *body = pkt + num_compact_re_tx_header_bytes;
+	int n = 0;
+	if(pkt[compact_encoding_byte] == re_tx_ranges)
+	{
+		for(int r = 0; r < pkt[compact_count_byte] && r < max_re_tx_ranges; r++)
+		{
+			uint16_t first;
+			memcpy(&first, body + r * 3, sizeof(uint16_t));
+			for(int k = 0; k <= body[r * 3 + 2]; k++)
+				ids[n++] = first + k;
+		}
+	}
+	else if(pkt[compact_encoding_byte] == re_tx_list)
+	{
+		for(int i = 0; i < pkt[compact_count_byte] && i < max_re_tx_list_ids; i++)
+			memcpy(&ids[n++], body + i * sizeof(uint16_t), sizeof(uint16_t));
+	}
+	else if(pkt[compact_encoding_byte] == re_tx_bitmap)
+	{
+		uint16_t base;
+		memcpy(&base, body, sizeof(uint16_t));
+		for(int bit = 0; bit < num_re_tx_bitmap_bits; bit++)
+		{
+			if(body[2 + bit / 8] & (1 << (bit % 8)))
+				ids[n++] = base + bit;
+		}
+	}
+	return n;
+}
+
+/* Put the ids of the packets out of 1..num_txed that recvd doesn't have in missing, in order. Returns how many. */
+inline int list_missing(const ChunkBitmap &recvd, uint16_t num_txed, uint16_t *missing)
+{
+	int n = 0;
+	uint32_t first, last;
+	for(uint32_t from = 1; recvd.next_clear_range(from, &first, &last) && first <= num_txed; from = last + 1)
+	{
+		for(uint32_t id = first; id <= last && id <= num_txed; id++)
+			missing[n++] = id;
+	}
+	return n;
+}
+
+/* The ids in a retransmit request of either kind. Returns how many there are. */
+inline int re_tx_pkt_ids(uint8_t *pkt, uint16_t *ids)
+{
+	if(pkt[1] == re_tx_compact)
+		return decode_compact_re_tx_pkt(pkt, ids);
+	int n = length_re_tx_packet(pkt);
+	memcpy(ids, pkt + num_re_tx_header_bytes, n * sizeof(uint16_t));
+	return n;
+}
+
+/*
+ * Build every retransmit request it takes to ask for the num_missing ids
+ * in missing, compact ones or old style ones with up to 13 ids each. pkts
+ * needs room for num_missing of them. Each one says how many there are in
+ * bytes 2-3. Returns how many that is.
+ */
+inline uint16_t build_re_tx_pkts(uint16_t *missing, int num_missing, bool compact, uint8_t (*pkts)[32])
+{
+	const int pkt_ids_per_pkt = num_re_tx_payload_bytes / sizeof(uint16_t);
+	uint16_t num_pkts = 0;
+	for(int i = 0; i < num_missing;)
+	{
+		uint8_t *pkt = pkts[num_pkts++];
+		if(compact)
+		{
+			i += build_compact_re_tx_pkt(missing + i, num_missing - i, pkt);
+			continue;
+		}
+
+		// Whatever's left over after the ids stays 0, which is where length_re_tx_packet() stops
+		memset(pkt, '\0', 32);
+		pkt[1] = re_tx_old;
+		int copy_qty = num_missing - i > pkt_ids_per_pkt ? pkt_ids_per_pkt : num_missing - i;
+		memcpy(&pkt[num_re_tx_header_bytes], &missing[i], copy_qty * sizeof(uint16_t));
+		i += copy_qty;
+	}
+	for(int n = 0; n < num_pkts; n++)
+		memcpy(&pkts[n][2], &num_pkts, sizeof(uint16_t));
+	return num_pkts;
+}
+
+#endif
@@ -1,58 +1,216 @@
-
 /*
- * This is a test to read values from the ads1115
- * using the wiring pi drivers
+ * Read the ads1115 as fast as it converts, see acquisition.h.
+ *
+ * By default it writes " x y z" lines to stdout like it always has, now
+ * led by when they were taken and a batch at a time, so it can be piped
+ * straight into rf24_transfer -S.
+ * With -o it writes timestamped binary records to a file instead, and
+ * with -m it samples a pretend ADC, for trying it out without one.
  */
 
-#include <wiringPi.h>
-#include <ads1115.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <ctime>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ads1115.h"
+#include "acquisition.h"
 
-#include <iostream>
+using namespace std;
 
 // comment out this line to disable the Readings Per Second printout
 #define rps 0
 
-int main(void)
+// Where the ads1115 is
+const char *ads_bus = "/dev/i2c-1";
+const int ads_address = 0x48;
+// BCM GPIO ALERT/RDY is wired to, -1 to go by the clock
+const int ads_rdy_pin = 25;
+
+// Conversions the ring holds, a second is 860
+const size_t ring_records = 1 << 16;
+// Records in a binary batch and lines in a text one
+const size_t binary_batch = 4096;
+const size_t text_batch = 64;
+
+static volatile int interrupt_flag = 0;
+
+void interrupt_handler(int nothing)
+{
+	interrupt_flag = 1;
+}
+
+bool parse_channels(const char *arg, vector<uint8_t> &channels)
 {
-	int16_t x, y, z;
-	// std::chrono::time_point<std::chrono::system_clock> now;
+	channels.clear();
+	for(const char *p = arg; *p != '\0'; p++)
+	{
+		if(*p == ',')
+			continue;
+		if(*p < '0' || *p >= '0' + ads_num_channels || channels.size() == ads_num_channels)
+			return false;
+		channels.push_back(*p - '0');
+	}
+	return channels.empty() == false;
+}
 
-	ads1115Setup(100, 0x48);
-	// Set the sample rate. This is the fastest. 
-	digitalWrite(101, 6);
+/* Print a binary file from -o as "seconds seq channel value" lines */
+int dump_records(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+	{
+		perror("Couldn't open the file");
+		return 6;
+	}
+	AdsFileHeader h;
+	if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, "ADS1", 4) != 0 || h.record_bytes != sizeof(AdsRecord))
+	{
+		fprintf(stderr, "ERROR: %s isn't a file of read_ads records.\n", filename);
+		fclose(f);
+		return 6;
+	}
+	printf("# started at %llu.%06llu, %u samples/sec\n", (unsigned long long)(h.start_unix_us / 1000000),
+		(unsigned long long)(h.start_unix_us % 1000000), h.rate);
+	AdsRecord r;
+	while(fread(&r, sizeof(r), 1, f) == 1)
+		printf("%llu.%06llu %u %u %d\n", (unsigned long long)(r.t_us / 1000000), (unsigned long long)(r.t_us % 1000000),
+			r.seq, r.channel, r.value);
+	fclose(f);
+	return 0;
+}
 
-	int ctr = 0;
+int main(int argc, char **argv)
+{
+	vector<uint8_t> channels = { 0, 1, 2 };
+	const char *out_name = NULL;
+	bool mock = false;
+	uint32_t mock_rate = ads_max_rate;
+	int rdy_pin = ads_rdy_pin;
+	int seconds = 0;
+	int flush_ms = 10;
 
-#ifdef rps	
-	while(true)
+	int c;
+	while((c = getopt(argc, argv, "c:o:m:p:t:f:x:h")) != -1)
 	{
-		time_t start = time(0);
+		switch(c)
+		{
+			case 'c': // Channels
+				if(parse_channels(optarg, channels) == false)
+				{
+					fprintf(stderr, "ERROR: Channels are 0 to 3, e.g. -c 0,1,2\n");
+					return 6;
+				}
+				break;
+			case 'o': // Binary records
+				out_name = optarg;
+				break;
+			case 'm': // Mock ADC
+				mock = true;
+				mock_rate = atoi(optarg);
+				break;
+			case 'p': // ALERT/RDY pin
+				rdy_pin = atoi(optarg);
+				break;
+			case 't': // How long
+				seconds = atoi(optarg);
+				break;
+			case 'f': // Flush interval
+				flush_ms = atoi(optarg);
+				if(flush_ms < 1)
+				{
+					fprintf(stderr, "ERROR: -f is in ms, 1 or more.\n");
+					return 6;
+				}
+				break;
+			case 'x': // Print a binary file
+				return dump_records(optarg);
+			case 'h':
+				printf("Reads the ads1115 in continuous mode, as fast as it converts (860 samples a second).\n");
+				printf("Usage:\n");
+				printf("-c: The channels to read, in turn, e.g. -c 0,1,2 (the default). More than one costs a\n");
+				printf("    conversion every time the channel changes.\n");
+				printf("-o: Write timestamped binary records to this file instead of lines of seconds since it started\n");
+				printf("    and values to stdout.\n");
+				printf("-x: Print a file written with -o as lines of seconds, sequence number, channel and value.\n");
+				printf("-p: The BCM GPIO the ads1115's ALERT/RDY is wired to (default %d), -1 to go by the clock.\n", ads_rdy_pin);
+				printf("-f: Write out what's come in at least every this many ms (default 10).\n");
+				printf("-t: Stop after this many seconds, instead of on Ctrl-c.\n");
+				printf("-m: Read a pretend ADC at this many samples a second, 0 for as fast as it goes. No hardware needed.\n");
+				printf("\n");
+				printf("Examples:\n");
+				printf("./read_ads | sudo ./rf24_transfer -S 20 -s -\n");
+				printf("./read_ads -c 0 -o samples.bin -t 60\n");
+				return 0;
+			case '?':
+				return 6;
+		}
+	}
+
+	signal(SIGINT, interrupt_handler);
+	// Whatever we're piped into going away is the end, not a crash
+	signal(SIGPIPE, SIG_IGN);
 
-		while((uintmax_t)time(0) - start < 10)
+	unique_ptr<AdsSource> adc;
+	if(mock)
+		adc.reset(new MockAds(mock_rate));
+	else
+	{
+		Ads1115 *ads = new Ads1115();
+		adc.reset(ads);
+		if(ads->open(ads_bus, ads_address, rdy_pin) == false)
 		{
-#endif
+			perror("Couldn't talk to the ads1115");
+			return 6;
+		}
+	}
 
-#ifndef rps
-		while(true)
+	int fd = 1;
+	if(out_name != NULL)
+	{
+		fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
 		{
-#endif
-			x = (int16_t)analogRead(100);
-			y = (int16_t)analogRead(101);
-			z = (int16_t)analogRead(102);
-
-			// printf("%s %d %d %d\n",std::ctime(&now), x, y, z);
-			std::cout /*<< ms.count()*/ << " " << x << " " << y << " " << z << "\n";
-			//fflush(stdout);
-			ctr++;
+			perror("Couldn't open the file");
+			return 6;
 		}
-#ifdef rps
-		printf("Readings in one second: %i\n", ctr/10);
-		ctr = 0;
-		delay(1000);
 	}
+
+	AdsWriter writer(fd, out_name == NULL, channels, out_name == NULL ? text_batch : binary_batch);
+	unique_ptr<Acquisition> acq(new Acquisition(*adc, channels, ring_records, writer, flush_ms));
+
+	uint64_t start = now_us();
+#ifdef rps
+	uint64_t last_samples = 0, last_report = start;
+#endif
+	while(interrupt_flag == 0 && writer.failing() == false && (seconds == 0 || now_us() - start < seconds * 1000000ULL))
+	{
+		usleep(100000);
+#ifdef rps
+		if(now_us() - last_report >= 10000000)
+		{
+			uint64_t n = acq->samples();
+			fprintf(stderr, "Readings in one second: %llu\n", (unsigned long long)(n - last_samples) / 10);
+			last_samples = n;
+			last_report = now_us();
+		}
 #endif
-		return 0;
 	}
+	acq->stop();
+	double elapsed = (now_us() - start) / 1e6;
+	fprintf(stderr, "%llu samples in %.1f s, %.0f a second. %llu the ring had no room for (it got to %zu of %zu), %llu timeouts, %llu read errors.\n",
+		(unsigned long long)acq->samples(), elapsed, acq->samples() / elapsed, (unsigned long long)acq->overflowed(),
+		acq->ring_peak(), acq->ring_capacity(), (unsigned long long)acq->timeouts(), (unsigned long long)acq->errors());
+	fprintf(stderr, "%llu written in %llu batches.\n", (unsigned long long)writer.written(), (unsigned long long)writer.batches());
+	if(fd != 1)
+		close(fd);
+	return writer.failing() && interrupt_flag == 0 && out_name != NULL ? 6 : 0;
+}
@@ -1,11 +1,27 @@
 #include <cstdlib>
 #include <iostream>
-#include <fstream>
 #include <sstream>
 #include <string>
-#include <RF24/RF24.h>
+#include <thread>
 #include <unistd.h>
 
+#include "transport.h"
+#include "sim_transport.h"
+#include "file_source.h"
+#include "file_sink.h"
+#include "spsc_ring.h"
+#include "rx_pump.h"
+#include "stripe.h"
+#include "fec.h"
+#include "integrity.h"
+#include "compress.h"
+#include "journal.h"
+#include "delta.h"
+#include "link_control.h"
+#include "telemetry.h"
+#include "packets.h"
+#include "stream.h"
+
 // For stat:
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -13,6 +29,11 @@
 // For signal handler:
 #include <csignal>
 
+// For reading a stream's samples:
+#include <deque>
+#include <fcntl.h>
+#include <poll.h>
+
 // For stol:
 #include <string>
 
@@ -22,10 +43,6 @@ using namespace std;
  * User Configurable Variables: *
 ********************************/
 
-// Need to simulate some packet loss?
-// Uncomment this to drop every packet where pkt_num % 25 == 0.
-#define PKT_LOSS 25
-
 // Sampling rate
 const uint8_t measure_seconds = 4;
 
@@ -37,7 +54,20 @@ const uint8_t measure_seconds = 4;
 // See http://www.airspayce.com/mikem/bcm2835/group__constants.html#ga63c029bd6500167152db4e57736d0939 and the related enumerations for pin information.
 
 // Setup for GPIO 22 CE and CE0 CSN with SPI Speed @ 4Mhz
-RF24 radio(RPI_V2_GPIO_P1_22, BCM2835_SPI_CS0, BCM2835_SPI_SPEED_4MHZ);
+#define RADIO_CE_PIN RPI_V2_GPIO_P1_22
+#define RADIO_CS_PIN BCM2835_SPI_CS0
+#define RADIO_SPI_SPEED BCM2835_SPI_SPEED_4MHZ
+// BCM GPIO the radio's IRQ pin is wired to, or -1 to poll the radio instead
+#define RADIO_IRQ_PIN 24
+
+// Air data rate and CRC length, both ends have to agree on these
+const rf24_datarate_e radio_data_rate = RF24_2MBPS;
+const rf24_crclength_e radio_crc_length = RF24_CRC_8;
+// Channel choice can have a big effect on packet corruption. With more
+// radios (-r) this is the first one's, the others each need their own.
+const uint8_t radio_channel = 110;
+// Radios each end can stripe data across
+const int max_radios = 4;
 
 /*********************
  * System Variables: *
@@ -47,19 +77,143 @@ RF24 radio(RPI_V2_GPIO_P1_22, BCM2835_SPI_CS0, BCM2835_SPI_SPEED_4MHZ);
 const uint64_t addresses[2] = { 0xABCDABCD71LL, 0x544d52687CLL };
 
 static volatile int interrupt_flag = 0;	// Catches Ctrl-c, for canceling transmisison
-static volatile int timer_flag = 0; // For measuring transmission rate
-
-// For determining how many packets we've received in this time interval when measuring reception rate
-volatile uint16_t num_recvd_last = 0;
 
-// These are details about how the packets are built.
-// I guess if the radio's packet size changes you could change them, or if you wanted to increase the pkt_id from
-// uint16_t to uint32_t at the expense of 2 data bytes you could do that oo. 
-const int num_payload_bytes = 29; // 32 - 2 (header) - 1 (\0 at end) = 29
-const int num_re_tx_payload_bytes = 26; // Round down to the nearest even number to keep math simple when dealing with 2 byte pkt ids. 
-const int num_special_header_bytes = 2; // '\0' + some char 
-const int num_header_bytes = 2; // sizeof(uint16_t) = 2
-const int num_re_tx_header_bytes = 4; 
+// millis() when the receiver wrote out the whole file
+volatile uint32_t transfer_done_ms = 0;
+
+// Feature flags sent in byte 6 of the first packet
+const uint8_t flag_window = 0x01; // Selective repeat, the receiver answers status polls
+
+const uint8_t flag_compact_re_tx = 0x02; // The transmitter understands compact retransmit requests
+
+const uint8_t flag_fec = 0x04; // Repair packets follow each block, bytes 7 and 8 are data and repair pkts per block
+
+const uint8_t flag_digest = 0x08; // Bytes 10-17 are the XXH64 of the whole file
+
+const uint8_t flag_sealed = 0x10; // Bytes 30-31 are a CRC-16 of the rest of the first packet
+
+// The first packet's CRC is seeded as if for this segment, so when a repeat
+// of it shows up later it can't pass for data pkt 12544 ('\0' '1')
+const uint32_t first_pkt_seal = 0xffffffff;
+
+const uint8_t flag_compressed = 0x20; // What's sent is compress.h's stream, bytes 18-21 are the original filesize
+
+// Bytes 22-23 are data pkts per segment, 24-25 and 26-27 bits 32-47 of the
+// filesize and the original filesize
+const uint8_t flag_segments = 0x40;
+
+// The transmitter will ask where to pick up from (see poll_resume), so the
+// receiver can carry on from its journal
+const uint8_t flag_resume = 0x80;
+
+// Byte 6 is full, byte 28 has room for more flags. What's sent is a delta.h
+// stream against the receiver's copy, and bytes 18-21 are the new file's size.
+const uint8_t flag2_delta = 0x01;
+// How long the transmitter waits for the receiver's signatures to start, and then for each one
+const uint32_t signature_wait_ms = 1000;
+const uint32_t signature_gap_ms = 200;
+const int sigs_per_pkt = 3;
+// Signature pkts the transmitter can ask for again in one request, and how many times
+const int max_sig_resends = 12;
+const int max_sig_resend_rounds = 8;
+
+// Sent to several receivers at once without ACKs (-M). Each of them is
+// polled in turn for what it's missing, see end_segment_multicast.
+const uint8_t flag2_multicast = 0x02;
+// Receivers a multicast can go to
+const int max_multicast_nodes = 32;
+// Nobody ACKs the control pkts, so they go out a few times
+const int multicast_repeats = 3;
+// How long the transmitter waits for an answer to a poll, and then for a receiver at all
+const uint32_t multicast_reply_ms = 15;
+const uint32_t multicast_node_timeout_ms = 3000;
+// How long a receiver that's done keeps answering polls after the last thing it heard
+const uint32_t multicast_linger_ms = 5000;
+// A receiver's answer to a poll (byte 3): what's in it and how it's doing
+const uint8_t mc_missing = 0; // The ids it's missing from the poll's cursor on, and that's all of them
+const uint8_t mc_missing_more = 1; // The same, but there are more past the last one
+const uint8_t mc_segment_done = 2; // It has all of the segment
+const uint8_t mc_file_ok = 3; // It has the whole file, and it checks out
+const uint8_t mc_file_bad = 4; // It has the whole file, but it doesn't match
+const uint8_t mc_lost = 5; // It can't catch up: it never got the first packet or is on an earlier segment
+// The transmitter's own verdict on a receiver that stopped answering
+const int mc_gone = -1;
+
+// The receiver keeps a loss report queued as its ACK payload (-a), so the
+// transmitter finds out what's missing without ever turning around. The
+// report's state byte is the same as a multicast poll answer's.
+const uint8_t flag2_ack_reports = 0x04;
+// How long the transmitter asks for a fresh report before giving up on the receiver
+const uint32_t ack_report_timeout_ms = 10000;
+// Writes a retransmission gets before it's left for the next report to ask for again
+const int ack_resend_tries = 10;
+
+// Frames only go on the air as long as what's in them, see pack_frame().
+// Both ends have to agree, -F pads them out to 32 bytes again to talk to
+// builds from before this.
+bool dynamic_payloads = true;
+// Frames written and the bytes pack_frame() left off them, for the stats
+atomic<unsigned long> num_frames_written(0), num_bytes_left_off(0);
+
+// Adaptive link control (-A), see link_control.h. The transmitter moves
+// the receiver to another channel or data rate with '\0' '\0' '1' seq
+// channel rate check old_channel old_rate: first with check 0 on the
+// settings they're both on, then with check 1 on the new ones. A receiver
+// that moved but doesn't hear the check goes back to the old ones.
+const int link_request_tries = 20; // Writes of the request before trying the new settings anyway
+const uint32_t link_check_ms = 100; // How long the transmitter tries the check before going back
+const uint32_t link_fallback_ms = 300; // How long the receiver waits for it
+const int scan_samples = 20; // Looks at each channel for a channel scan
+
+// How often the receiver writes down what it has so far
+const uint32_t journal_interval_ms = 1000;
+// How long the transmitter waits to hear where to resume from
+const uint32_t resume_poll_ms = 2000;
+
+// Selective repeat window. A status packet can describe the oldest missing
+// packet plus a bitmap of the 208 after it, so the window can't be bigger.
+const int num_status_bitmap_bytes = 26;
+const int max_window_size = 1 + num_status_bitmap_bytes * 8;
+const uint32_t status_timeout_ms = 10;
+
+// Frames the transmitter's producer thread can build ahead of the radio
+const size_t tx_ring_frames = 1024;
+// Frames the receiver's drain thread can take off the radio ahead of the protocol
+const size_t rx_ring_frames = 1024;
+
+// Samples a stream's input thread can read ahead of the radio (-S), and
+// frames that can wait on it after that, see run_stream_transmitter()
+const size_t stream_ring_samples = 4096;
+const size_t stream_queue_frames = 64;
+// How long the transmitter tries to tell the receiver the stream ended
+const uint32_t stream_end_ms = 1000;
+
+/* One of the radios to send or receive on, see -r */
+struct radio_spec
+{
+	uint8_t channel = radio_channel;
+	int ce_pin = -1; // BCM GPIO, -1 for the RADIO_ defaults above
+	int cs_pin = -1; // 0 for CE0, 1 for CE1
+	int irq_pin = -1;
+};
+
+/* Transmitter options from the command line */
+struct tx_options
+{
+	int window_size = 0; // 0 = send everything, then ask for what's missing
+	bool burst = false; // Keep the TX FIFO full instead of waiting on every ACK
+	int fec_k = 0; // Data pkts per FEC block, 0 for no FEC
+	int fec_r = 0; // Repair pkts per FEC block
+	uint8_t check = check_crc16; // How each data frame is checked
+	int compress_level = 0; // 0 = send the file as is
+	bool delta = false; // Only send what changed from the receiver's copy
+	int multicast = 0; // Receivers to send to at once, 0 for the usual one with ACKs
+	bool ack_reports = false; // Loss reports come back on ACK payloads instead of after an ending packet
+	bool adaptive = false; // Move to whichever channel, data rate and retries get the most through
+	uint8_t channel = radio_channel; // The first radio's, to start with
+	int stream_flush_ms = 0; // Stream samples as they come in (-S) instead of sending a file, 0 for a file
+	int stream_max_age_ms = 0; // Give up on stream frames the radio couldn't send for this long, 0 to never
+};
 
 int hide = 1;
 
@@ -70,45 +224,73 @@ void interrupt_handler(int nothing)
 	interrupt_flag = 1;
 }
 
-uint8_t fletcher_8(uint8_t *data, size_t size)
-{
-	uint8_t sum1 = 0;
-	uint8_t sum2 = 0;
-	//printf("fletcher computation: \n");
-	while(size--)
-	{
-	//	printf("i: %d, c: %c\n", size, *data);
-		sum1+=*data++;
-		sum2+= sum1;
+size_t getFilesize (const char* filename){
+	struct stat st;
+	if(stat(filename, &st) != 0){
+		return 0;
 	}
-	return (sum1&0xF) | (sum2<<4);
+	return st.st_size;
 }
 
-void print_packet(uint8_t *pkt)
+/*
+ * -r channel[:ce:cs[:irq]],... one radio each. The first radio's pins
+ * default to the ones above, the others have to be given (they don't matter
+ * on a simulated link). Every radio needs its own channel.
+ */
+bool parse_radio_specs(const char *arg, vector<radio_spec> &radios)
 {
-	printf("%d \"%s\"\n", (uint16_t*)pkt[0], (char*)pkt+num_payload_bytes);
+	radios.clear();
+	string s(arg);
+	size_t pos = 0;
+	while(pos < s.size())
+	{
+		size_t end = s.find(',', pos);
+		if(end == string::npos)
+			end = s.size();
+		string item = s.substr(pos, end - pos);
+		pos = end + 1;
+
+		radio_spec r;
+		int channel = -1;
+		int n = sscanf(item.c_str(), "%d:%d:%d:%d", &channel, &r.ce_pin, &r.cs_pin, &r.irq_pin);
+		if(n < 1 || n == 2 || channel < 0 || channel > 125 || (n >= 3 && (r.cs_pin < 0 || r.cs_pin > 1 || r.ce_pin < 0)))
+		{
+			cout << "ERROR: Bad radio \"" << item << "\", expected channel[:ce:cs[:irq]] with a channel from 0 to 125.\n";
+			return false;
+		}
+		r.channel = channel;
+		for(size_t i = 0; i < radios.size(); i++)
+		{
+			if(radios[i].channel == r.channel)
+			{
+				cout << "ERROR: Every radio needs a channel of its own.\n";
+				return false;
+			}
+		}
+		radios.push_back(r);
+	}
+	if(radios.empty() || radios.size() > (size_t)max_radios)
+	{
+		cout << "ERROR: -r takes from 1 to " << max_radios << " radios.\n";
+		return false;
+	}
+	return true;
 }
 
-uint16_t length_re_tx_packet(uint8_t *data)
+/* A data packet's id and payload, for debugging */
+void print_packet(const uint8_t *pkt, uint8_t check)
 {
-	uint8_t ctr = 0;
-	for(int i = num_re_tx_header_bytes; i < num_re_tx_header_bytes + num_re_tx_payload_bytes; i += sizeof(uint16_t))
-	{
-		uint16_t x; 
-		memcpy(&x, data + i, sizeof(uint16_t));
-		if(x == 0)
-			return ctr;
-		else
-			ctr++;
-	}
-	return ctr;
+	uint16_t id;
+	memcpy(&id, pkt, sizeof(uint16_t));
+	printf("%d \"%.*s\"\n", id, frame_payload_bytes(check), (const char*)pkt + num_header_bytes);
 }
+
 void print_re_tx_packet(uint8_t *re_tx_request)
 {
 	printf("**************\n");
 	printf("* Pkt id: %c\n", re_tx_request[1]);
 	printf("* Num re_tx_pkts: %d\n", re_tx_request[2]);
-	for(int i = 4; i < num_re_tx_header_bytes + num_re_tx_payload_bytes; i+=sizeof(uint16_t))
+	for(int i = num_re_tx_header_bytes; i < num_re_tx_header_bytes + num_re_tx_payload_bytes; i+=sizeof(uint16_t))
 	{
 		uint16_t val;
 		memcpy(&val, re_tx_request+i, sizeof(uint16_t));
@@ -123,41 +305,384 @@ void print_re_tx_packet(uint8_t *re_tx_request)
 	return;
 }
 
-bool contained_in_array(uint16_t id, uint16_t *array, uint8_t end)
+/* pack_frame(), unless dynamic payloads are off, counting what it saves */
+uint8_t shorten_frame(uint8_t *out, const uint8_t *frame, int check_len)
+{
+	uint8_t len = 32;
+	if(dynamic_payloads)
+		len = pack_frame(out, frame, check_len);
+	else
+		memmove(out, frame, 32);
+	num_frames_written++;
+	num_bytes_left_off += 32 - len;
+	return len;
+}
+
+/* Write a frame, check_len as in pack_frame(): 0 for anything but data and repair pkts */
+bool write_frame(Transport &radio, const uint8_t *frame, int check_len = 0)
+{
+	uint8_t out[32];
+	uint8_t len = shorten_frame(out, frame, check_len);
+	return radio.write(out, len);
+}
+
+/* Read the next frame, zero filling whatever it was short of 32 bytes. Returns how long it was. */
+uint8_t read_frame(Transport &radio, uint8_t *frame)
+{
+	memset(frame, '\0', 32);
+	uint8_t len = dynamic_payloads ? radio.getDynamicPayloadSize() : 32;
+	// RF24 has already thrown out a frame with a bad length
+	if(len == 0 || len > 32)
+		return 0;
+	radio.read(frame, len);
+	return len;
+}
+
+/* What dynamic payloads saved on the frames written, in air time at our data rate */
+void print_frame_stats()
+{
+	if(dynamic_payloads == false || num_frames_written == 0)
+		return;
+	unsigned long left_off = num_bytes_left_off;
+	double us_per_byte = (sim_air_time_us(radio_data_rate, 32, 0) - sim_air_time_us(radio_data_rate, 0, 0)) / 32.0;
+	printf("Dynamic payloads: %lu frames written, %lu bytes shorter than at 32 bytes each, %.1f ms less air time.\n",
+		(unsigned long)num_frames_written, left_off, left_off * us_per_byte / 1000.0);
+}
+
+/* Write every end's telemetry to path (-T), if there is one */
+void export_telemetry(const char *path, const vector<const Telemetry*> &ends)
 {
-	for(int i= 0; i < end; i++)
+	if(path == NULL)
+		return;
+	if(Telemetry::export_all(path, ends))
+		printf("Telemetry written to %s\n", path);
+	else
+		perror("Couldn't write the telemetry");
+}
+
+/*
+ * Send a reply to the transmitter, which should be listening for it. If the
+ * write fails, listen for a moment before trying again: if the transmitter is
+ * already sending again, it was only our ACK that got lost. Leaves the radio
+ * listening.
+ */
+bool write_reply(Transport &radio, uint8_t *pkt, uint32_t timeout_ms)
+{
+	radio.stopListening();
+	uint32_t start = millis();
+	while(interrupt_flag == 0 && millis() - start < timeout_ms)
 	{
-		if(*(array + i * sizeof(uint16_t)) == id)
+		if(write_frame(radio, pkt))
+		{
+			radio.startListening();
+			return true;
+		}
+		// Long enough for a data packet and its retries to get through
+		radio.startListening();
+		uint32_t listen_start = millis();
+		while(radio.available() == false && millis() - listen_start < 3);
+		if(radio.available())
 			return true;
+		radio.stopListening();
 	}
+	radio.startListening();
 	return false;
 }
 
 /* There are no missing packets we need retransmitted, so we'll send an empty re_tx packet to the TX'er */
-void send_all_clear()
+void send_all_clear(Transport &radio)
 {
 	uint8_t data[32];
 	memset(&data, '\0', 32);
-	data[1] = '2';
+	data[1] = re_tx_old;
 
 	// Hopefully the TX'er received the message. 
 	// Since we have everything, it isn't the end
 	// of the world if it doesn't. Since it exits after
 	// sending the ACK there's  no point in us trying to 
 	// send the all clear signal forever, though. 
+	// Give it a second in case it's still turning around.
+	write_reply(radio, data, 1000);
+}
+
+/* We have every packet, but the file they make up isn't the one that was sent */
+void send_file_mismatch(Transport &radio)
+{
+	uint8_t data[32];
+	memset(&data, '\0', 32);
+	data[1] = '7';
+	write_reply(radio, data, 1000);
+}
+
+/*
+ * Resume poll: '\0' '\0' '7'
+ * The receiver answers '\0' '8' segment have: it has every pkt before
+ * segment, and have of the pkts in it. A fresh start is 0 0.
+ */
+void send_resume_status(Transport &radio, uint32_t segment, uint32_t have)
+{
+	uint8_t status[32];
+	memset(&status, '\0', 32);
+	status[1] = '8';
+	memcpy(&status[2], &segment, 4);
+	memcpy(&status[6], &have, 4);
+	write_reply(radio, status, status_timeout_ms);
+}
+
+/*
+ * Fill pkt with a compact retransmit request for what we're missing from
+ * cursor up to last, repair ids we'd want included (see
+ * FecDecoder::wants_repair). Sets more if there's more than fits. Returns
+ * the last id it covers, 0 if there's nothing missing.
+ */
+uint16_t build_loss_report(uint8_t *pkt, uint32_t cursor, uint32_t last, const FileSink &sink, const FecDecoder &fec, bool *more)
+{
+	memset(pkt, '\0', 32);
+	// One more than a pkt can hold, to tell whether there are more
+	vector<uint16_t> ids;
+	const ChunkBitmap &have = sink.chunks();
+	for(uint32_t id = have.next_clear(cursor); id <= sink.num_chunks() && id <= last && ids.size() <= (size_t)max_ids_per_re_tx_pkt; id = have.next_clear(id + 1))
+		ids.push_back(id);
+	if(fec.enabled())
+	{
+		for(uint32_t id = max<uint32_t>(cursor, sink.num_chunks() + 1); id <= last && ids.size() <= (size_t)max_ids_per_re_tx_pkt; id++)
+		{
+			if(fec.wants_repair(id, sink))
+				ids.push_back(id);
+		}
+	}
+	int covered = ids.empty() ? 0 : build_compact_re_tx_pkt(ids.data(), ids.size(), pkt);
+	*more = covered < (int)ids.size();
+	return covered > 0 ? ids[covered - 1] : 0;
+}
+
+/*
+ * Multicast status poll: '\0' '\0' '3' node seq uint16_t cursor uint32_t segment
+ * Only receiver node answers, with '\0' '9' seq state. For mc_missing and
+ * mc_missing_more the rest is a compact retransmit request (bytes 4 on) of
+ * the ids it's missing from cursor on. With FEC those include the repair
+ * ids it hasn't got for blocks it couldn't rebuild, so the transmitter can
+ * work out how many more pkts each block needs. A poll for node 0 tells
+ * everyone the transmitter is done.
+ */
+void send_multicast_status(Transport &radio, const uint8_t *poll, uint8_t state, const FileSink &sink, const FecDecoder &fec)
+{
+	uint8_t status[32];
+	memset(&status, '\0', 32);
+	if(state == mc_missing)
+	{
+		uint16_t cursor;
+		memcpy(&cursor, poll+5, 2);
+		bool more;
+		build_loss_report(status, cursor, fec.enabled() ? fec.last_id() : sink.num_chunks(), sink, fec, &more);
+		if(more)
+			state = mc_missing_more;
+	}
+	status[1] = '9';
+	status[2] = poll[4];
+	status[3] = state;
+	// Nothing ACKed the poll, so the transmitter may not be listening yet
+	delay(1);
+	write_reply(radio, status, multicast_reply_ms);
+}
+
+/*
+ * Signature request: '\0' '\0' '4' id count seq[count]
+ * The receiver answers with signatures of its copy of the file (see
+ * delta.h). With no seqs it sends them all, starting with a header:
+ * '\0' '5' seq=0 block_size num_blocks basis_size id
+ * then '\0' '5' seq 3 x (weak strong), with seq from 1. Otherwise it only
+ * sends the seqs asked for, which never made it the first time. Each is
+ * sealed with a CRC-16. A receiver without a copy sends just the header,
+ * with no blocks.
+ */
+void send_signatures(Transport &radio, const vector<BlockSig> &sigs, uint32_t block_size, uint64_t basis_size, const uint8_t *req)
+{
+	uint32_t num_blocks = sigs.size();
+	uint16_t num_pkts = 1 + (num_blocks + sigs_per_pkt - 1) / sigs_per_pkt;
+	int num_asked = req[4] <= max_sig_resends ? req[4] : max_sig_resends;
+
 	radio.stopListening();
-	radio.write(&data, 32);
+	int i;
+	for(i = 0; i < (num_asked ? num_asked : num_pkts) && interrupt_flag == 0; i++)
+	{
+		uint16_t seq = i;
+		if(num_asked)
+			memcpy(&seq, &req[5 + i * 2], 2);
+		if(seq >= num_pkts)
+			continue;
+		uint8_t pkt[32];
+		memset(&pkt, '\0', 32);
+		pkt[1] = '5';
+		memcpy(&pkt[2], &seq, 2);
+		if(seq == 0)
+		{
+			memcpy(&pkt[4], &block_size, 4);
+			memcpy(&pkt[8], &num_blocks, 4);
+			memcpy(&pkt[12], &basis_size, 8);
+			pkt[20] = req[3];
+		}
+		else
+		{
+			for(int j = 0; j < sigs_per_pkt; j++)
+			{
+				uint32_t b = (seq - 1) * sigs_per_pkt + j;
+				if(b < num_blocks)
+					memcpy(&pkt[4 + j * 8], &sigs[b], 8);
+			}
+		}
+		seal_frame(pkt, check_crc16);
+		// The transmitter sits listening for these until they stop coming
+		uint32_t start = millis();
+		bool sent;
+		while((sent = write_frame(radio, pkt)) == false && millis() - start < signature_gap_ms / 2);
+		if(sent == false)
+			break;
+	}
 	radio.startListening();
+	if(hide!=1) printf("Sent %d packets of block signatures of our copy, %u in all.\n", i, num_pkts);
+}
+
+/*
+ * Get the signatures of the receiver's copy of the file. Ones that never
+ * arrive are left out of known, and just won't be matched. Returns false
+ * if the receiver has no copy, or doesn't answer: older receivers won't.
+ */
+bool request_signatures(Transport &radio, uint32_t *block_size, uint64_t *basis_size, vector<BlockSig> &sigs, vector<bool> &known)
+{
+	uint8_t req[32];
+	memset(&req, '\0', 32);
+	req[2] = '4';
+	req[3] = millis();
+	uint32_t num_blocks = 0;
+	uint32_t num_pkts = 0, num_recvd = 0;
+	vector<bool> got; // Which pkts have arrived, some will twice
+	// The first few tries are for the lot, after that for what went missing
+	for(int attempt = 0; attempt < 3 + max_sig_resend_rounds && num_recvd < num_pkts + (num_pkts == 0) && interrupt_flag == 0; attempt++)
+	{
+		if(num_pkts > 0)
+		{
+			if(attempt < 3)
+				attempt = 3;
+			req[4] = 0;
+			for(uint32_t seq = 1; seq < num_pkts && req[4] < max_sig_resends; seq++)
+			{
+				if(got[seq] == false)
+				{
+					uint16_t s = seq;
+					memcpy(&req[5 + req[4] * 2], &s, 2);
+					req[4]++;
+				}
+			}
+		}
+		else if(attempt >= 3)
+			break;
+		uint32_t recvd_before = num_recvd;
+		if(hide!=1) printf("Signature request %d, asking again for %d, have %u of %u.\n", attempt, req[4], num_recvd, num_pkts);
+		// Listen even if this looks like it failed, it may only have been the ACK that got lost
+		radio.stopListening();
+		uint32_t start = millis();
+		while(interrupt_flag == 0 && write_frame(radio, req) == false && millis() - start < signature_wait_ms);
+		radio.flush_rx();
+		radio.startListening();
+		uint32_t last = millis();
+		while(interrupt_flag == 0 && millis() - last < (num_recvd == recvd_before ? signature_wait_ms : signature_gap_ms))
+		{
+			if(radio.available() == false)
+				continue;
+			uint8_t pkt[32];
+			read_frame(radio, pkt);
+			if(pkt[0] != '\0' || pkt[1] != '5' || frame_ok(pkt, check_crc16) == false)
+				continue;
+			uint16_t seq;
+			memcpy(&seq, &pkt[2], 2);
+			if(seq == 0 && num_pkts == 0 && pkt[20] == req[3])
+			{
+				memcpy(block_size, &pkt[4], 4);
+				memcpy(&num_blocks, &pkt[8], 4);
+				memcpy(basis_size, &pkt[12], 8);
+				if(num_blocks > delta_max_blocks)
+					break;
+				num_pkts = 1 + (num_blocks + sigs_per_pkt - 1) / sigs_per_pkt;
+				sigs.assign(num_blocks, BlockSig());
+				known.assign(num_blocks, false);
+				got.assign(num_pkts, false);
+				got[0] = true;
+				num_recvd = 1;
+			}
+			else if(seq > 0 && seq < num_pkts && got[seq] == false)
+			{
+				got[seq] = true;
+				for(int i = 0; i < sigs_per_pkt; i++)
+				{
+					uint32_t b = (seq - 1) * sigs_per_pkt + i;
+					if(b < num_blocks)
+					{
+						memcpy(&sigs[b], &pkt[4 + i * 8], 8);
+						known[b] = true;
+					}
+				}
+				num_recvd++;
+			}
+			last = millis();
+			if(num_pkts > 0 && num_recvd >= num_pkts)
+				break;
+		}
+		// Nothing came of asking again, it isn't going to
+		if(attempt > 3 && num_recvd == recvd_before)
+			break;
+	}
+	radio.stopListening();
+	if(num_pkts == 0)
+		return false;
+	uint32_t num_known = count(known.begin(), known.end(), true);
+	printf("Receiver's copy is %llu bytes, got signatures for %u of its %u blocks of %u bytes in %u packets.\n",
+		(unsigned long long)*basis_size, num_known, num_blocks, *block_size, num_recvd);
+	return num_known > 0;
+}
+
+/* Ask the receiver where to pick up from. Returns false if it never says, older receivers won't. */
+bool poll_resume(Transport &radio, uint32_t *segment, uint32_t *have)
+{
+	uint8_t poll[32];
+	memset(&poll, '\0', 32);
+	poll[2] = '7';
+	uint32_t start = millis();
+	while(interrupt_flag == 0 && millis() - start < resume_poll_ms)
+	{
+		// Listen even if this looks like it failed, it may only have been the ACK that got lost
+		radio.stopListening();
+		write_frame(radio, poll);
+		radio.startListening();
+		uint32_t listen_start = millis();
+		while(interrupt_flag == 0 && millis() - listen_start < 50)
+		{
+			if(radio.available() == false)
+				continue;
+			uint8_t status[32];
+			read_frame(radio, status);
+			if(status[0] != '\0' || status[1] != '8')
+				continue;
+			memcpy(segment, &status[2], 4);
+			memcpy(have, &status[6], 4);
+			radio.stopListening();
+			return true;
+		}
+	}
+	radio.stopListening();
+	return false;
 }
-int send_missing_pkts(uint8_t *pkt_buf)
+
+int send_missing_pkts(Transport &radio, FileSource &source, uint8_t check)
 {
 	uint16_t num_expecting = 0; // number of re_tx pkts we're looking for
 	uint16_t num_recvd = 0; // number of re_tx pkts we've actually received
 	bool anything_recvd = 0; 
 	uint8_t data[32];
 
-	uint16_t *missing_pkts; // array of the packets we're missing
-	uint16_t missing_pkts_loc = 0;
+	// What we've been asked for, a request is only new if its first id isn't in here yet
+	ChunkBitmap missing_pkts;
+	missing_pkts.resize(source.segment_chunks());
 
 	int first = 0; 
 
@@ -165,34 +690,35 @@ int send_missing_pkts(uint8_t *pkt_buf)
 	uint32_t start = millis();
 	// Wait 20 seconds for a response. If nothing comes in, presumably 
 	// the receiver didn't need any packets re tx'ed and just quit. 
-	while(interrupt_flag == 0 && anything_recvd == 0 || (num_recvd < num_expecting && millis() - start < 60000))
+	while(interrupt_flag == 0 && ((anything_recvd == 0 && millis() - start < 20000) || (anything_recvd == 1 && num_recvd < num_expecting && millis() - start < 60000)))
 	{
 		if(radio.available()){
-			radio.read(&data, 32);
+			read_frame(radio, data);
 			
-			if(data[0] == '\0' && data[1] == '2')
+			if(data[0] == '\0' && (data[1] == re_tx_old || data[1] == re_tx_compact))
 			{
-				// Each re_tx pkt is uniquely ID'd by the first missing packet id it has. We don't want to add the same values to the missing_pkts array multiple times. 
-				uint16_t pkt_id = 0;
-				memcpy(&pkt_id, data + num_re_tx_header_bytes, sizeof(uint16_t));
+				uint16_t ids[max_ids_per_re_tx_pkt];
+				int num_entries = re_tx_pkt_ids(data, ids);
+
+				// Each re_tx pkt is uniquely ID'd by the first missing packet id it has. If that's already in missing_pkts, this is a repeat of one we have. 
+				uint16_t pkt_id = num_entries > 0 ? ids[0] : 0;
 				if(hide!=1) printf("Re_TX_request pkt_id: %d\n", pkt_id);
 				if(first == 0){
 					anything_recvd = 1;
 
 					memcpy(&num_expecting, data+2, sizeof(uint16_t));
 					if(hide!=1) printf("num_expecting: %d\n", num_expecting);
-					missing_pkts = (uint16_t*)malloc(sizeof(uint16_t) * num_expecting*13);
 					first =1;
 				}
-				else if(contained_in_array(pkt_id, missing_pkts, missing_pkts_loc) == true)
+				else if(missing_pkts.test(pkt_id))
 				{
 					if(hide!=1) cout << "We've already seen this packet\n";
 					continue;
 				}
 				else if(hide!=1) cout << "Haven't seen this packet before.\n";
 				num_recvd++;
+				start = millis();
 
-				int num_entries = length_re_tx_packet(data);
 				if(hide!=1)
 				{
 					printf("num_expecting: %d\n", num_expecting);
@@ -200,14 +726,10 @@ int send_missing_pkts(uint8_t *pkt_buf)
 					printf("num_entries: %d\n", num_entries);
 				}
 
-				uint16_t val= 0;
-
 				for(int i = 0; i < num_entries; i++)
 				{
-					memcpy(&val, data+num_re_tx_header_bytes + i * sizeof(uint16_t), sizeof(uint16_t));
-					if(hide!=1) printf("i: %d, val: %d\n", i, val);
-					memcpy(&missing_pkts[missing_pkts_loc], &data[num_re_tx_header_bytes + i * sizeof(uint16_t)], sizeof(uint16_t)); 
-					missing_pkts_loc++;
+					if(hide!=1) printf("i: %d, val: %d\n", i, ids[i]);
+					missing_pkts.set(ids[i]);
 				}
 
 				// if the RX'er doesn't need anything retransmitted num_recvd = 1 and num_expecting = 0
@@ -222,6 +744,10 @@ int send_missing_pkts(uint8_t *pkt_buf)
 				cout << "Received the all clear signal\n";
 				return 1;
 			}	
+			else if(data[0] == '\0' && data[1] == '7')
+			{
+				return 3;
+			}
 			else
 			{
 				if(hide!=1) cout << "Don't recognize this type of packet!\n";
@@ -229,21 +755,19 @@ int send_missing_pkts(uint8_t *pkt_buf)
 		}
 	}
 
+	if(anything_recvd == 0)
+	{
+		cout << "No response from the receiver, assuming it has everything.\n";
+		return 1;
+	}
+
 	/* Re transmit all of the missing packets */
 	cout << "Retransmitting dropped packets.\n";
 	radio.stopListening();
-	for(int i = 0; i < missing_pkts_loc; i++)
+	for(uint32_t pkt_id = missing_pkts.next_set(1); pkt_id <= missing_pkts.size(); pkt_id = missing_pkts.next_set(pkt_id + 1))
 	{
 		uint8_t data[32];
-		memset(&data, '\0', 32);
-		// uint16_t pkt_id = *(missing_pkts + (i * sizeof(uint16_t)));
-		uint16_t pkt_id = missing_pkts[i];
-	
-		memcpy(&data, &pkt_id, sizeof(uint16_t));
-		memcpy(&data[num_header_bytes], pkt_buf+(num_payload_bytes*pkt_id), num_payload_bytes);	
-		
-		uint8_t chk_sum = fletcher_8((uint8_t*)&data[num_header_bytes], num_payload_bytes);
-		data[31] = chk_sum;
+		build_data_pkt(data, pkt_id, source, check);
 
 		if(hide!=1)
 		{
@@ -253,7 +777,7 @@ int send_missing_pkts(uint8_t *pkt_buf)
 	
 		while(interrupt_flag == 0 && true)
 		{
-			if(radio.write(&data, 32) == false)
+			if(write_frame(radio, data, check_bytes(check)) == false)
 			{
 				if(hide!=1)
 				{
@@ -271,98 +795,27 @@ int send_missing_pkts(uint8_t *pkt_buf)
 			}
 		}
 	}
-	free(missing_pkts);
 	return 0;
 }
 
-void request_missing_pkts(uint8_t *pkt_buf, bool *recvd_array, uint16_t num_txed, int num_missing)
+void request_missing_pkts(Transport &radio, const ChunkBitmap &recvd, uint16_t num_txed, int num_missing, bool compact)
 {
-	// Build an array with all of the packets we're missing:
-	uint16_t *missing;
-	// TODO: Fix the missing array. I screwed up how the numbers are stored in it. 
-	uint16_t missing_size = sizeof(uint16_t)*num_missing*2;
-	if(hide!=1) printf("Size of all missing packet nums in bytes: %d\n", missing_size);
-	missing = (uint16_t*)malloc(sizeof(uint16_t) * num_missing);
-	uint16_t missing_loc = 0;
-
-	for(uint16_t i = 1; i <= num_txed; i++)
-	{
-		if(recvd_array[i] == 0)
-		{
-			memcpy(&missing[missing_loc], &i, sizeof(uint16_t));
-			missing_loc++;
-		}
-	}
-
-	// Figure out how many packets we need to send the transmitter to
-	// let it know what packets it needs to resend us. 
-	int pkt_ids_per_pkt = num_re_tx_payload_bytes / sizeof(uint16_t);
-
-	uint16_t num_re_tx_pkts = (missing_loc) / pkt_ids_per_pkt;
-	if((missing_loc) % pkt_ids_per_pkt != 0)
-		num_re_tx_pkts += 1;
-
-	// Ask the transmitter to resend the packets we need
-	uint8_t re_tx_pkt[32];
-	if(missing_loc == 0)
+	// Only called with something missing, the all clear goes out from the RX loop
+	vector<uint16_t> missing(num_missing);
+	uint16_t missing_loc = list_missing(recvd, num_txed, missing.data());
+
+	// Build every re_tx pkt up front, each one says how many there are in total
+	uint32_t round_start = millis();
+	vector<uint8_t> pkts(32 * missing_loc);
+	uint8_t (*re_tx_pkts)[32] = (uint8_t(*)[32])pkts.data();
+	uint16_t num_re_tx_pkts = build_re_tx_pkts(missing.data(), missing_loc, compact, re_tx_pkts);
+	if(hide!=1) printf("Number of packets needed to convey missing packets to transmitter: %d\n", num_re_tx_pkts);
+
+	for(int n = 0; n < num_re_tx_pkts; n++)
 	{
-                // blast the packet for a max time of one minute
-                cout << "Don't need any packets resent, attempting to send all clear to transmitter.\n";
-                uint32_t time = millis();
-                while(interrupt_flag == 0 && time - millis() <= 60000)
-                {
-                        if(radio.write(&re_tx_pkt, 32) == false)
-                        {
-                                if(hide!=1) cout<<"Sending all clear packet failed!\n";
-                                else if(hide!=1)
-                                {
-                                        cout<<"Successfully sent all clear packet!\n";
-					free(missing);
-                                        return;
-                                }
-                        }
-                }
-                cout << "Sent all clear for one minute, no response. Presumabably the transmitter's ACKs are getting lost. Writing to file and exiting.\n";
-		free(missing);
-                return;
-	}
-
-	for(int i=0; i < missing_loc; i+=pkt_ids_per_pkt)
-	{
-		if(hide!=1)
-		{
-			printf("i: %d\n", i);
-		}
-
-		// Build the re_tx packet
-		memset(&re_tx_pkt[0], '\0', 32);
-		re_tx_pkt[0] = '\0';
-		re_tx_pkt[1] = '2';
-		if(hide!=1) printf("Number of packets needed to convey missing packets to transmitter: %d\n", num_re_tx_pkts);
-		memcpy(&re_tx_pkt[2], &num_re_tx_pkts, 2);
-
-		// determine how many pkt ids we're putting into this re_tx
-		// pkt and insert a \0 at the proper place
-		int copy_qty;
-		if(missing_loc - i > pkt_ids_per_pkt)
-		{
-			copy_qty = pkt_ids_per_pkt;
-			re_tx_pkt[30] = '\0';
-		}
-		else
-		{
-			copy_qty = missing_loc - i; 
-			re_tx_pkt[num_re_tx_header_bytes + (sizeof(uint16_t) * copy_qty)] = '\0';
-		}
-
-		if(hide != 1) printf("copy qty: %d\n", copy_qty);
-
-		for(int t = 0; t < copy_qty; t++)
-		{
-			memcpy(&re_tx_pkt[num_re_tx_header_bytes + t*sizeof(uint16_t)], &missing[i+t], sizeof(uint16_t));
-		}
+		uint8_t *re_tx_pkt = re_tx_pkts[n];
 
-		if(hide != 1) print_re_tx_packet(re_tx_pkt);
+		if(hide != 1 && compact == false) print_re_tx_packet(re_tx_pkt);
 
 		// Blast the re_tx_pkt to the transmitter until we receive
 		// an ACK in response
@@ -371,7 +824,7 @@ void request_missing_pkts(uint8_t *pkt_buf, bool *recvd_array, uint16_t num_txed
 		radio.stopListening();
 		while(interrupt_flag == 0)
 		{
-			if(radio.write(&re_tx_pkt, sizeof(re_tx_pkt)))
+			if(write_frame(radio, re_tx_pkt))
 				break;
 			else
 			{
@@ -392,500 +845,2856 @@ void request_missing_pkts(uint8_t *pkt_buf, bool *recvd_array, uint16_t num_txed
 
 		if(hide != 1) cout << "  Got a successful response!\n";
 	}
+	printf("Asked for %d missing packets with %d retransmit request packets in %u ms.\n", missing_loc, num_re_tx_pkts, millis() - round_start);
 	if(hide!=1) cout << "Returning\n";
-	free(missing);
 }
 
-size_t getFilesize (const char* filename){
-	struct stat st;
-	if(stat(filename, &st) != 0){
-		return 0;
+/*
+ * Window status poll: '\0' '\0' '5' seq highest_id
+ * The receiver answers with a status packet:
+ * '\0' '6' seq 0 base_id bitmap[26]
+ * base_id is the oldest packet it's missing, bit i of the bitmap is set if
+ * it has packet base_id + 1 + i.
+ */
+void send_window_status(Transport &radio, uint8_t *poll, const ChunkBitmap &recvd, uint16_t base)
+{
+	uint16_t highest;
+	memcpy(&highest, poll + 4, sizeof(uint16_t));
+
+	uint8_t status[32];
+	memset(&status, '\0', 32);
+	status[1] = '6';
+	status[2] = poll[3];
+	memcpy(&status[4], &base, sizeof(uint16_t));
+	for(int i = 0; i < num_status_bitmap_bytes * 8; i++)
+	{
+		uint32_t id = base + 1 + i;
+		if(id > highest || id > recvd.size())
+			break;
+		if(recvd.test(id))
+			status[6 + i / 8] |= 1 << (i % 8);
 	}
-	return st.st_size;
-}
 
-void sigalrm_handler(int sig)
-{
-	timer_flag = true;
+	// The transmitter is turning around to listen for this, give it a moment
+	write_reply(radio, status, status_timeout_ms);
 }
 
-int main(int argc, char** argv)
+/*
+ * Ask the receiver what it's got. On success, fills resend with every
+ * packet up to highest it's still missing and returns the oldest one.
+ * Returns 0 if we didn't hear back.
+ */
+uint16_t poll_window_status(Transport &radio, uint16_t highest, uint8_t seq, uint16_t *resend, int *resend_len)
 {
-	signal(SIGINT, interrupt_handler); // Ctrl-c interrupt handler
-	fstream *file;
-	uint8_t *packets; // buffer to store all of the packets
-	char *filename = NULL;
-
-	bool role_tx = 1, role_rx = 0;
-	bool role = 0;
+	uint8_t poll[32];
+	memset(&poll, '\0', 32);
+	poll[2] = '5';
+	poll[3] = seq;
+	memcpy(&poll[4], &highest, sizeof(uint16_t));
 
-	bool measure = false;
-	bool hide_progress_bar = false;
+	// Listen even if this looks like it failed, it may only have been the ACK that got lost
+	radio.stopListening();
+	write_frame(radio, poll);
 
-	bool z = false; // Flag to make sure we don't set both the -s and -d flags
-	int c;
-	while ((c = getopt (argc, argv, "s:d:nmhD")) != -1)
+	radio.flush_rx();
+	radio.startListening();
+	uint32_t start = millis();
+	uint16_t base = 0;
+	while(interrupt_flag == 0 && millis() - start < status_timeout_ms)
 	{
-		switch (c)
+		if(radio.available() == false)
+			continue;
+		uint8_t status[32];
+		read_frame(radio, status);
+		// Anything else is left over from an earlier poll
+		if(status[0] != '\0' || status[1] != '6' || status[2] != seq)
+			continue;
+
+		memcpy(&base, &status[4], sizeof(uint16_t));
+		*resend_len = 0;
+		if(base <= highest)
+			resend[(*resend_len)++] = base;
+		for(int i = 0; i < num_status_bitmap_bytes * 8; i++)
 		{
-			case 'D':
-				hide = 0;
-				break;
-			case 'h':
-				cout << "This is a simple wireless file transfer utility built for the nRF24 radio family!\n";
-				cout << "It's built using TMRh20's C++ RF24 library, which can be found on Github:\n";
-				cout << "https://github.com/nRF24/RF24";
-				cout << "\n";
-				cout << "Usage:\n";
-				cout << "-h: Show this help text.\n";
-				cout << "-s: The source file. Use this on the transmitter.\n";
-				cout << "-d: The destination file. Use this on the receiver. It will overwrite any existing files.\n";
-				cout << "-D: Show a bunch of debug messages. \n";
-				cout << "-n: Hide the progress bar on the receiver. Use when measuring, if you like.\n";
-				cout << "-m: Measure the successfull data reception rate. Doesn't count packets where checksums don't match\n";
-				cout << "\n";
-				cout << "Examples:\n";
-				cout << "sudo ./rf24_transfer -s ModernMajorGeneral.txt \n";
-				cout << "sudo ./rf24_transfer -d ModernMajorGeneral-recv.txt \n";
-				break;	
-			case 's': // Specify source file
-				if(z == true)
-				{
-					cout << "Cannot be both transmitter and receiver!\n";
-					return 25; 
-				}
-				filename = optarg;
-				z = true;
-				role = role_tx;
-				break;
-			case 'd': // Specify destination file
-				if(z == true)
-				{
-					cout << "Cannot be both transmitter and receiver!\n";
-					return 25;
-				}
-				filename = optarg;
-				z = true;
-				role = role_rx;
+			uint32_t id = base + 1 + i;
+			if(id > highest)
 				break;
-			case 'm': // Measure data reception rate
-				measure = true;
-				cout << "Measuring!\n";
-				break;
-			case 'n': // Hide the progress bar
-				hide_progress_bar = true;
-				cout << "Hiding progress bar!\n";
-				break;
-			case '?':
-				fprintf (stderr, "Unknown option `-%c'.\n", optopt);
-				return 6;
+			if((status[6 + i / 8] & (1 << (i % 8))) == 0)
+				resend[(*resend_len)++] = id;
 		}
+		break;
+	}
+	radio.stopListening();
+	return base;
+}
 
-		/* for (int index = optind; index < argc; index++)
+/*
+ * Selective repeat: keep up to window_size packets in flight past the oldest
+ * one the receiver is missing, poll it for a status report every so often,
+ * and fill in whatever it reports missing before sending anything new.
+ * Returns once the receiver has everything.
+ */
+int send_window(Transport &radio, FileSource &source, uint16_t total_num_pkts, int window_size, uint8_t check)
+{
+	uint16_t resend[max_window_size];
+	int resend_len = 0, resend_loc = 0;
+	uint32_t base = 1; // Oldest packet the receiver is missing
+	uint32_t next_new = 1; // Next packet we've never sent
+	uint16_t highest_sent = 0;
+	int poll_interval = window_size / 3 > 0 ? window_size / 3 : 1;
+	int since_poll = 0;
+	uint8_t seq = 0;
+	unsigned long num_sent = 0, num_resent = 0;
+	uint32_t last_heard = millis();
+
+	while(interrupt_flag == 0 && base <= total_num_pkts)
+	{
+		uint32_t id = 0;
+		if(resend_loc < resend_len)
 		{
-			printf ("Non-option argument %s\n", argv[index]);
-		} */
+			id = resend[resend_loc++];
+			num_resent++;
+		}
+		else if(next_new <= total_num_pkts && next_new < base + window_size)
+		{
+			id = next_new++;
+		}
+
+		if(id != 0)
+		{
+			uint8_t code[32];
+			build_data_pkt(code, id, source, check);
+			if(write_frame(radio, code, check_bytes(check)) == false && hide!=1)
+				printf("Pkt %d failed.\n", id);
+			highest_sent = id > highest_sent ? id : highest_sent;
+			num_sent++;
+			since_poll++;
+		}
+
+		// Check in when we've sent a bunch, or have nothing left we're allowed to send
+		bool stalled = resend_loc >= resend_len && (next_new > total_num_pkts || next_new >= base + window_size);
+		if(since_poll >= poll_interval || stalled)
+		{
+			uint16_t new_base = poll_window_status(radio, highest_sent, ++seq, resend, &resend_len);
+			if(new_base != 0)
+			{
+				if(hide!=1) printf("Receiver base: %d, missing %d in window\n", new_base, resend_len);
+				base = new_base;
+				resend_loc = 0;
+				since_poll = 0;
+				last_heard = millis();
+			}
+			else if(millis() - last_heard > 10000)
+			{
+				cout << "Receiver stopped answering status polls.\n";
+				return 1;
+			}
+		}
 	}
-	if (measure == true && role == role_tx)
+	printf("Sent %lu data packets, %lu of them retransmissions.\n", num_sent, num_resent);
+	return 0;
+}
+
+/*
+ * Burst mode: keep the radio's 3 deep TX FIFO full with writeFast() instead
+ * of waiting for every ACK. When the frame at the head of the FIFO runs out
+ * of retries it gets one more go with reUseTX(); if it's still stuck we
+ * can't tell which of the queued frames made it, so the FIFO is flushed,
+ * all of them are noted down and the burst carries on.
+ */
+struct burst_state
+{
+	uint16_t queued[3]; // The last few frames we put in the FIFO
+	int num_queued = 0;
+	bool reused = false;
+};
+
+void burst_write(Transport &radio, burst_state &st, const uint8_t *code, uint8_t len, uint16_t id, ChunkBitmap &failed)
+{
+	const int tx_fifo_depth = sizeof(st.queued) / sizeof(st.queued[0]);
+	while(radio.writeFast(code, len) == false)
 	{
-		cout << "ERROR: Cannot measure data reception rate from the transmitter.\n";
-		return 6;
+		if(st.reused == false)
+		{
+			radio.reUseTX();
+			st.reused = true;
+			continue;
+		}
+		if(hide!=1) printf("TX FIFO stuck before pkt %d, flushing.\n", id);
+		radio.flush_tx();
+		for(int i = 0; i < st.num_queued; i++)
+			failed.set(st.queued[i]);
+		st.num_queued = 0;
+		st.reused = false;
 	}
-	
-	// Make sure the user specified a file. 
-	if(z != true)
+	st.reused = false;
+	if(st.num_queued == tx_fifo_depth)
+		memmove(st.queued, st.queued + 1, sizeof(st.queued[0]) * (tx_fifo_depth - 1));
+	else
+		st.num_queued++;
+	st.queued[st.num_queued - 1] = id;
+}
+
+/* Wait for the end of a burst */
+void burst_drain(Transport &radio, burst_state &st, ChunkBitmap &failed)
+{
+	if(radio.txStandBy() == false)
 	{
-		cout << "ERROR: At least one filename is required as an agrument. Use -s [source file] or -d [dest file]\n";
-		return 6;
+		for(int i = 0; i < st.num_queued; i++)
+			failed.set(st.queued[i]);
 	}
+	st.num_queued = 0;
+	st.reused = false;
+}
 
-	// Open the file
-	file = new fstream(filename, fstream::in);
-	if(file == NULL)
+/*
+ * Loss report, as the receiver's ACK payload (-a): '\0' '1' seq state, then
+ * like a multicast poll's answer bytes 4 on are a compact retransmit request
+ * for some of what it's missing. It's cut short after the last byte in use
+ * (see pack_frame), since every byte of it is air time on every ACK. The
+ * receiver loads a new one after every pkt it takes, so the ACK to each pkt carries what it knew a pkt or so
+ * earlier. seq is the last report poll it had seen then, 0 before the first
+ * one of a segment.
+ *
+ * Takes the newest report waiting in the RX FIFO. Returns false if there
+ * wasn't one.
+ */
+bool take_ack_report(Transport &radio, uint8_t *report)
+{
+	bool got = false;
+	uint8_t pkt[32];
+	while(radio.available())
 	{
-		cout << "Could not open the file.\n";
-		return 6;
+		read_frame(radio, pkt);
+		if(pkt[0] == '\0' && pkt[1] == '1' && pkt[3] <= mc_lost)
+		{
+			memcpy(report, pkt, 32);
+			got = true;
+		}
 	}
+	return got;
+}
 
+/*
+ * Note down the gaps a report from the data phase says the receiver has.
+ * Returns how many of the new ones weren't in failed, which were ACKed
+ * and must have arrived broken.
+ */
+int note_ack_report(Transport &radio, ChunkBitmap &reported, const ChunkBitmap &failed)
+{
+	uint8_t report[32];
+	if(take_ack_report(radio, report) == false || report[2] != 0 || (report[3] != mc_missing && report[3] != mc_missing_more))
+		return 0;
+	uint16_t ids[max_ids_per_re_tx_pkt];
+	int n = decode_compact_re_tx_pkt(report, ids);
+	int num_broken = 0;
+	for(int i = 0; i < n; i++)
+	{
+		if(reported.set(ids[i]) && failed.test(ids[i]) == false)
+			num_broken++;
+	}
+	return num_broken;
+}
 
-	/*******************************/
-	/* PRINT PREAMBLE AND GET ROLE */
-	/*******************************/
-
-	radio.begin();                           // Setup and configure rf radio
-	radio.flush_tx();
-	radio.flush_rx();
-	radio.setChannel(110); 			// Channel choice can have a big effect on packet corruption. 
-	radio.setPALevel(RF24_PA_MAX);
-	radio.setDataRate(RF24_2MBPS);
-	radio.setAutoAck(1);                     // Ensure autoACK is enabled
-	radio.setRetries(1,1);                  // Optionally, increase the delay between retries & # of retries
-	// Use 8 bit CRC for a slight performance benefit. 
-	// If sender & receiver CRCs don't match, the sender & receiver won't be able to establish a connection. 
-	radio.setCRCLength(RF24_CRC_8);
+/* Put the transmitter's radio on s */
+void apply_link(Transport &radio, const LinkSettings &s)
+{
+	radio.setChannel(s.channel);
+	radio.setDataRate(s.rate);
+	radio.setRetries(s.ard, s.arc);
+}
 
-	if(hide == 0){
-		radio.printDetails();
+/*
+ * Listen on every channel for a moment at a time and count how often
+ * testRPD() hears something there (-64dBm or more). Returns the quietest,
+ * counting the channels either side since a 2Mbps signal is 2MHz wide, or
+ * current if nothing is quieter. Leaves the radio on current.
+ */
+uint8_t scan_channels(Transport &radio, uint8_t current)
+{
+	const int num_channels = 126;
+	int hits[num_channels] = {};
+	for(int c = 0; c < num_channels && interrupt_flag == 0; c++)
+	{
+		radio.setChannel(c);
+		for(int i = 0; i < scan_samples; i++)
+		{
+			radio.startListening();
+			delayMicroseconds(128);
+			radio.stopListening();
+			hits[c] += radio.testRPD();
+		}
 	}
+	radio.setChannel(current);
 
-	/************/
-	/* RECEIVER */
-	/************/
-	if(role == role_rx)
-	{
-		if(measure == true)
+	auto around = [&](int c) {
+		int n = 0;
+		for(int d = c - 1; d <= c + 1; d++)
 		{
-			signal(SIGALRM, &sigalrm_handler);
+			if(d >= 0 && d < num_channels)
+				n += hits[d];
 		}
-		
-		/* Things we will need later: */
-		uint32_t filesize = 0;
-		uint32_t num_expected = 0; // # of pkts we're expecting
-		unsigned long num_recvd = 0; // # of pkts actually recved
-		uint16_t highest_pkt_num = 0;
-		uint8_t *pkt_buf; // Store every pkt before writing it.
-		bool *recvd_array; // Keep track of which slots in the pkt_buf array have been written to
+		return n;
+	};
+	uint8_t best = current;
+	for(int c = 0; c < num_channels; c++)
+	{
+		if(around(c) < around(best))
+			best = c;
+	}
+	printf("Channel scan: heard something around channel %d %d times out of %d, around channel %d %d times.\n",
+		current, around(current), scan_samples * 3, best, around(best));
+	return best;
+}
+
+/*
+ * Move both ends to to, for link_control.h. The retries are only ours to
+ * set, but a new channel or data rate has to be the receiver's as well.
+ * The request goes on the old settings, and whether or not it's ACKed (it
+ * may only be the ACK that got lost after the receiver moved) the check
+ * goes on the new ones. Nothing ACKing that means the receiver isn't
+ * there, so we go back. Returns whether we moved.
+ */
+bool change_link(Transport &radio, LinkController &link, const LinkSettings &to)
+{
+	LinkSettings from = link.settings();
+	if(to.channel == from.channel && to.rate == from.rate)
+	{
+		apply_link(radio, to);
+		link.moved(to, true);
+		return true;
+	}
+
+	uint8_t pkt[32];
+	memset(&pkt, '\0', sizeof(pkt));
+	pkt[2] = '1';
+	pkt[3] = link.next_seq();
+	pkt[4] = to.channel;
+	pkt[5] = to.rate;
+	pkt[7] = from.channel;
+	pkt[8] = from.rate;
+	bool asked = false;
+	for(int i = 0; i < link_request_tries && asked == false && interrupt_flag == 0; i++)
+		asked = write_frame(radio, pkt);
+
+	apply_link(radio, to);
+	pkt[6] = 1;
+	bool ok = false;
+	uint32_t start = millis();
+	while(ok == false && interrupt_flag == 0 && millis() - start < link_check_ms)
+		ok = write_frame(radio, pkt);
+	if(ok == false)
+		apply_link(radio, from);
+
+	if(hide!=1 || ok == false)
+		printf("%s channel %d at %s%s.\n", ok ? "Moved to" : "Couldn't move to", to.channel, rate_name(to.rate),
+			ok || asked ? "" : ", the receiver didn't hear the request");
+	link.moved(to, ok);
+	return ok;
+}
+
+/* The receiver's side of change_link() */
+void move_radio(Transport &radio, uint8_t channel, rf24_datarate_e rate)
+{
+	radio.stopListening();
+	radio.setChannel(channel);
+	radio.setDataRate(rate);
+	radio.startListening();
+}
 
-		float progress = 0.0;
-		float progress_inc = 0;
-		int progress_ctr = 100;
-		int bar_width = 70;
+/* Best case frames/sec: TX settling, the frame, turning around for the ACK and the ACK itself */
+double link_frame_limit()
+{
+	uint8_t crc = (uint8_t)radio_crc_length;
+	return 1e6 / (2 * sim_settle_us + sim_air_time_us(radio_data_rate, 32, crc) + sim_air_time_us(radio_data_rate, 0, crc));
+}
 
-		/* Open a file for writing to */
-		FILE *output_file;
-		output_file = fopen(filename, "w");
+/* A data frame built ahead of time for the radio stage */
+struct tx_frame
+{
+	uint16_t id;
+	uint8_t len; // Shortened by the producer, see pack_frame()
+	uint8_t data[32];
+};
 
-		if(output_file == NULL)
+/* How one radio's part of send_data() went */
+struct tx_link
+{
+	burst_state st;
+	ChunkBitmap failed; // Stuck in the TX FIFO in burst mode, or never ACKed with link control
+	uint32_t num_sent = 0;
+	unsigned long num_starved = 0;
+	chrono::steady_clock::duration starved = chrono::steady_clock::duration(0);
+};
+
+/*
+ * The producer's half of send_data(): build every data frame of the
+ * segment, and with FEC on each block's repair frames after it, and hand
+ * them to push(). Frame is the layout for the check, so there's nothing
+ * left to look up per frame.
+ */
+template <class Frame, class Push>
+void produce_frames(FileSource &source, uint16_t total_num_pkts, const tx_options &opts, Push &push)
+{
+	bool fec = opts.fec_k > 0;
+	tx_frame f;
+	FecEncoder encoder(fec ? opts.fec_k : 1, opts.fec_r, Frame::payload_bytes);
+	uint32_t block = 0;
+	for(uint32_t id = 1; id <= total_num_pkts && interrupt_flag == 0; id++)
+	{
+		f.id = id;
+		Frame::build(f.data, id, source);
+		if(fec)
+			encoder.add(Frame::payload(f.data));
+		f.len = shorten_frame(f.data, f.data, Frame::check_bytes);
+		push(f);
+		if(fec == false)
+			continue;
+
+		if(encoder.full() || id == total_num_pkts)
 		{
-			cout << "Something weird happened trying to write to the file\n";
-			perror("The following error occurred: ");
-			return 6;
+			for(int j = 0; j < opts.fec_r; j++)
+			{
+				f.id = total_num_pkts + block * opts.fec_r + j + 1;
+				Frame::build(f.data, f.id, encoder.repair(j), source.segment());
+				f.len = shorten_frame(f.data, f.data, Frame::check_bytes);
+				push(f);
+			}
+			encoder.reset();
+			block++;
 		}
+	}
+}
 
-		radio.openWritingPipe(addresses[0]);
-		radio.openReadingPipe(1,addresses[1]);
-		radio.startListening();
-		/* Packet RX Loop: */
-		uint8_t data[32];
-		/* 
-		 * Control flag:
-		 * 0 - have not received starting packet
-		 * 1 - starting packet received, ready for data pkts
-		 */
-		int control = 0; 
-		if(interrupt_flag != 0)
-		{
-			cout << "File transfer canceled by user.\n";
-			return 6;
+/*
+ * Send every data packet once, in two stages. A producer thread reads the
+ * file and builds and checksums frames into a lock-free ring, and the radio
+ * stage does nothing but feed them to the radio, so the radio never waits
+ * on file I/O. With FEC on, the producer also follows each block with its
+ * repair packets. In burst mode, frames that got stuck in the TX FIFO get
+ * one more burst at the end; whatever fails then is left for the receiver
+ * to ask for.
+ *
+ * With more than one radio, each gets its own ring and its own thread, and
+ * the producer deals frames out to them in turn, skipping any that's full,
+ * so a slower link just ends up with fewer of them.
+ *
+ * With loss reports on the ACKs (-a), the data ids they say are missing go
+ * in reported, for end_segment_ack_reports() to send again.
+ *
+ * With link control (-A), every write tells link_ctl how it went, and it
+ * gets to move the link between them.
+ */
+void send_data(const vector<Transport*> &radios, FileSource &source, uint16_t total_num_pkts, const tx_options &opts, ChunkBitmap &reported,
+	LinkController &link_ctl)
+{
+	bool burst = opts.burst;
+	int check_len = check_bytes(opts.check);
+	size_t num_links = radios.size();
+
+	vector<unique_ptr<SpscRing<tx_frame> > > rings;
+	for(size_t i = 0; i < num_links; i++)
+		rings.push_back(unique_ptr<SpscRing<tx_frame> >(new SpscRing<tx_frame>(tx_ring_frames)));
+	atomic<bool> producing(true);
+	thread producer([&]() {
+		size_t next = 0;
+		auto push = [&](const tx_frame &f) {
+			while(interrupt_flag == 0)
+			{
+				for(size_t i = 0; i < num_links; i++)
+				{
+					size_t link = (next + i) % num_links;
+					if(rings[link]->push(f))
+					{
+						next = link + 1;
+						return;
+					}
+				}
+				// Full rings are a good half second of air time, no need to spin
+				this_thread::sleep_for(chrono::milliseconds(1));
+			}
+		};
+		// The check can't change during a transfer, so pick its layout once
+		switch(opts.check)
+		{
+			case check_crc16: produce_frames<crc16_frame>(source, total_num_pkts, opts, push); break;
+			case check_crc32c: produce_frames<crc32c_frame>(source, total_num_pkts, opts, push); break;
+			default: produce_frames<fletcher_frame>(source, total_num_pkts, opts, push); break;
 		}
-		cout << "Waiting for transmission...\n";
+		producing = false;
+	});
+
+	vector<tx_link> links(num_links);
+	auto radio_stage = [&](size_t i) {
+		Transport &radio = *radios[i];
+		SpscRing<tx_frame> &ring = *rings[i];
+		tx_link &link = links[i];
+		link.failed.resize(total_num_pkts);
+		tx_frame f;
 		while(interrupt_flag == 0)
 		{
-			if(measure == true && timer_flag == true)
+			if(ring.pop(f) == false)
 			{
-				unsigned long recvd_this_interval = num_recvd - num_recvd_last;
-				unsigned long rate_this_interval = recvd_this_interval / measure_seconds;
-				int data_rate = rate_this_interval * num_payload_bytes;
-				printf("Received %u pkts in %u seconds - %u pkts/sec - %d bytes/sec \n", recvd_this_interval, measure_seconds, recvd_this_interval / measure_seconds, data_rate);
+				if(producing)
+				{
+					// The producer fell behind
+					link.num_starved++;
+					chrono::steady_clock::time_point wait_start = chrono::steady_clock::now();
+					while(ring.empty() && producing && interrupt_flag == 0)
+						this_thread::yield();
+					link.starved += chrono::steady_clock::now() - wait_start;
+				}
+				// The producer may have pushed its last frames after we looked
+				if(ring.pop(f) == false)
+				{
+					if(producing)
+						continue;
+					break;
+				}
+			}
 
-				num_recvd_last = num_recvd;
-				timer_flag = false;
-				alarm(measure_seconds);
+			if(burst)
+			{
+				burst_write(radio, link.st, f.data, f.len, f.id, link.failed);
 			}
-			// Update our progress bar every 100 pkts
-			if(hide_progress_bar == false && progress_ctr <= 0)
+			else if(radio.write(f.data, f.len))
 			{
-				float normalized_progress = (float)(num_recvd - 1)/(float)(num_expected - 1);
-				cout << "[";
-				int pos = bar_width * normalized_progress;
-				for(int i = 0; i < bar_width; ++i)
+				if(hide != 1)
 				{
-					if (i<pos) cout << "=";
-					else if (i==pos) cout << ">";
-					else cout << " ";
+					cout << "  Sent!\n";
+					usleep(50);
 				}
-				cout << "]" << int(normalized_progress*100.0) << " %\r";
-				cout.flush();
-				progress_ctr =100;
+				if(link_ctl.enabled())
+					link_ctl.sent(true, radio.getARC());
 			}
-			uint8_t data[32];
-			if(radio.available())
+			else
 			{
-				// cout << "control: " << control << "\n";
-				radio.read(&data, 32);
-				/* Receive the starting packet with our file size */
-				if(control == 0 && (char*)data[0] == '\0' && (char)data[1] == '1')
-				{
-					cout << "\n";
-					cout << "File transfer beginning.\n";
-					memcpy(&filesize, data+num_special_header_bytes, 4);
-					num_expected = filesize / num_payload_bytes; 
-					// If filesize is not exactly divisible by
-					// num_payload_bytes we need an extra packet
-					if (filesize % num_payload_bytes != 0)
-						num_expected += 1;
-					printf("Filesize: %d\n", filesize);
-					printf("Expected Pkts: %d\n", num_expected);
-					// pkt_buf =(uint8_t*) calloc(num_expected, num_payload_bytes);
-					pkt_buf = (uint8_t*) malloc((num_expected+1)* num_payload_bytes);
-					memset(pkt_buf, '\0', (num_expected+1)*num_payload_bytes);
-					// recvd_array = (bool*)calloc(num_expected, sizeof(bool));
-					recvd_array = (bool*)malloc((num_expected+1)*sizeof(bool));
-					control = 1;
-					if(measure == true)
-					{
-						alarm(measure_seconds);
-					}
-					continue;
-				}
-				/* Ending Packet */
-				else if (control > 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '9')
+				if(hide!=1)
+					cout << "  Failed.\n";
+				if(link_ctl.enabled())
 				{
-					if(hide!=1)
-					{
-						cout << "\nENDING PACKET\n";
-						cout << "*****************\n";
-						printf("* 0: %c\n", (char*)data[0]);
-						printf("* 1: %c\n", (char*)data[1]);
-						printf("* 2: %c\n", (char*)data[2]);
-						printf("* 3: %c\n", (char*)data[3]);
-						cout << "*****************\n";
-					}
-					uint16_t z_pkt_num = 0;
-					memcpy(&z_pkt_num, &data, 2);
-					uint16_t num_txed;
-					memcpy(&num_txed, data+num_special_header_bytes, 2);
-					if(hide!=1) printf("Received %d out of %d packets\n", num_recvd, num_expected);
-					int num_missing = 0;
-					for(int i = 1; i <= num_expected; i++)
-					{
-						num_missing += (*(recvd_array + (i * sizeof(bool))) == 1 ? 0 : 1);
-					}
-					cout << "\n";
-					if(num_missing == 0)
-						cout<<"No packet loss!\n";
-					else
-						printf("Missing %d packets, asking transmitter to resend them.\n", num_missing);
-
-					if(num_missing ==0)
-					{
-						send_all_clear();
-					}
-					else
-					{
-						request_missing_pkts(pkt_buf, recvd_array, num_expected, num_missing);
-						cout << "Ready to receive the missing packets:\n";
-					}
-					control = 3;
+					link_ctl.sent(false, radio.getARC());
+					link.failed.set(f.id);
 				}
-				/* Receive data packets */
-				// else if(control > 0 && data[0] != '\0')
-				else
-				{
-					uint16_t pkt_num;
-					memcpy(&pkt_num, data, 2);
-					num_recvd++;
-
-					// Drop any packets we've already
-					// seen (The ACK we sent must not
-					// have made it back to the sender
-					if(recvd_array[pkt_num] == 1)
-					{
-						if(hide!=1) printf("Dropped Pkt: %d\n", pkt_num);
-						continue;
-					}
-					if(hide != 1)
-					{
-						printf("pkt_num: %d, num_recvd: %d, num_expected: %d\n", pkt_num, num_recvd, num_expected);
-						printf("\"%s\"\n", (char*)data+num_header_bytes);
-					}
+			}
+			link.num_sent++;
+			// Loss reports only come back on the first radio's ACKs
+			if(opts.ack_reports && i == 0)
+			{
+				int num_broken = note_ack_report(radio, reported, link.failed);
+				if(link_ctl.enabled())
+					link_ctl.broken(num_broken);
+			}
 
-					// Properly keep track of new pkts
-					*(recvd_array + (pkt_num * sizeof(bool))) = 1;
-					memcpy(pkt_buf + (pkt_num * num_payload_bytes), data + num_header_bytes, strnlen((char*)data + num_header_bytes, num_payload_bytes));
-					highest_pkt_num = (pkt_num > highest_pkt_num) ? pkt_num : highest_pkt_num;
-					progress_ctr--;
-				}
-			}
-			/* Check and see if we have everything! */
-			if(control == 3 && num_expected == num_recvd)
-			{
-				uint16_t dsize = strlen((char*)pkt_buf+(highest_pkt_num*num_payload_bytes));
-				int size = (highest_pkt_num-1)*num_payload_bytes + strnlen((char*)pkt_buf+(highest_pkt_num*num_payload_bytes), num_payload_bytes);
-				printf("Received file size: %d\n", size);
-				fwrite(pkt_buf+num_payload_bytes, sizeof(uint8_t), size, output_file);
-				fclose(output_file);
-				puts("Wrote to file!\n");
-				send_all_clear();
-				break;
+			LinkSettings to;
+			bool rescan;
+			if(link_ctl.enabled() && link_ctl.next(to, rescan))
+			{
+				if(rescan)
+					to.channel = scan_channels(radio, link_ctl.settings().channel);
+				change_link(radio, link_ctl, to);
 			}
 		}
-		if(recvd_array != NULL)
+		if(burst)
+			burst_drain(radio, link.st, link.failed);
+	};
+
+	uint32_t start = millis();
+	vector<thread> others;
+	for(size_t i = 1; i < num_links; i++)
+		others.push_back(thread(radio_stage, i));
+	radio_stage(0);
+	for(size_t i = 0; i < others.size(); i++)
+		others[i].join();
+	producer.join();
+
+	uint32_t elapsed = millis() - start;
+	uint32_t num_sent = 0;
+	unsigned long num_starved = 0;
+	chrono::steady_clock::duration starved(0);
+	for(size_t i = 0; i < num_links; i++)
+	{
+		num_sent += links[i].num_sent;
+		num_starved += links[i].num_starved;
+		starved += links[i].starved;
+	}
+	printf("Radio stage: %.0f pkts/sec of a %.0f pkts/sec link limit, waited on the producer %lu times for %ld ms.\n",
+		elapsed ? num_sent * 1000.0 / elapsed : 0.0, link_frame_limit() * num_links, num_starved,
+		(long)chrono::duration_cast<chrono::milliseconds>(starved).count());
+	if(num_links > 1)
+	{
+		printf("Striped over %zu radios:", num_links);
+		for(size_t i = 0; i < num_links; i++)
+			printf(" %u", links[i].num_sent);
+		printf(" pkts.\n");
+	}
+
+	// The receiver's loss reports say which of the stuck ones it really missed
+	if(burst == false || opts.ack_reports)
+		return;
+	// The stuck ones all go again on the first radio
+	Transport &radio = *radios[0];
+	burst_state &st = links[0].st;
+	unsigned long num_stuck = 0;
+	ChunkBitmap still_failed;
+	still_failed.resize(total_num_pkts);
+	for(uint32_t id = 1; interrupt_flag == 0; id++)
+	{
+		// The next one stuck on any link
+		uint32_t next = total_num_pkts + 1;
+		for(size_t i = 0; i < num_links; i++)
+			next = min(next, links[i].failed.next_set(id));
+		if(next > total_num_pkts)
+			break;
+		id = next;
+		num_stuck++;
+		uint8_t code[32];
+		build_data_pkt(code, id, source, opts.check);
+		burst_write(radio, st, code, shorten_frame(code, code, check_len), id, still_failed);
+	}
+	burst_drain(radio, st, still_failed);
+	printf("Burst: %lu packets stuck in the TX FIFO and were sent again, %u still failed.\n", num_stuck, still_failed.count());
+}
+
+void setup_radio(Transport &radio, uint8_t channel)
+{
+	radio.begin();                           // Setup and configure rf radio
+	radio.flush_tx();
+	radio.flush_rx();
+	radio.setChannel(channel);
+	radio.setPALevel(RF24_PA_MAX);
+	radio.setDataRate(radio_data_rate);
+	radio.setAutoAck(1);                     // Ensure autoACK is enabled
+	radio.setRetries(1,1);                  // Optionally, increase the delay between retries & # of retries
+	// Use 8 bit CRC for a slight performance benefit. 
+	// If sender & receiver CRCs don't match, the sender & receiver won't be able to establish a connection. 
+	radio.setCRCLength(radio_crc_length);
+	if(dynamic_payloads)
+		radio.enableDynamicPayloads();
+
+	if(hide == 0){
+		radio.printDetails();
+	}
+}
+
+/************/
+/* RECEIVER */
+/************/
+int run_receiver(const vector<Transport*> &radios, const char *filename, bool measure, bool hide_progress_bar, int node, Telemetry &telemetry)
+{
+	// A separate thread keeps each radio's RX FIFO empty, we read from all of them
+	StripedRx radio(radios, rx_ring_frames);
+	// setup_radio() already turned them on, but the drain threads need to
+	// know to ask how long each frame is
+	if(dynamic_payloads)
+		radio.enableDynamicPayloads();
+
+	/* Things we will need later: */
+	uint64_t filesize = 0;
+	uint64_t num_expected = 0; // # of pkts we're expecting
+	unsigned long num_recvd = 0; // # of pkts actually recved
+	uint8_t tx_flags = 0; // Feature flags from the first packet
+	int fec_k = 0, fec_r = 0; // Data and repair pkts per FEC block
+	uint8_t frame_check = check_fletcher_8; // How each data packet is checked
+	int payload_bytes = num_payload_bytes;
+	uint64_t expected_digest = 0;
+	bool file_ok = true;
+	uint64_t original_size = 0; // Before compression, if the transmitter compressed it
+	string packed_name = string(filename) + ".lz"; // Where the compressed stream goes until it's all here
+	bool delta = false; // What's coming is the changes from our copy
+	string delta_name = string(filename) + ".delta"; // Where they go until they're all here
+	string rebuilt_name = string(filename) + ".new"; // Where the new file is built, our copy stays until it checks out
+	int sigs_id = -1; // The last signature request we answered
+	uint32_t sigs_sent = 0;
+	vector<BlockSig> basis_sigs; // Signatures of our copy, as sent
+	uint32_t basis_block = 0;
+	uint64_t basis_size = 0;
+	bool finished = false; // Got the whole file, whether or not it checked out
+	uint8_t pending_poll[32]; // A multicast poll that waits on us finishing the file
+	bool poll_pending = false;
+	bool ack_reports = false; // Our ACKs carry loss reports, see take_ack_report
+	bool report_due = false; // Something came in since the one that's queued
+	uint8_t report_seq = 0; // The last report poll we saw this segment
+	uint32_t report_cursor = 1; // Where the next report picks up
+	uint32_t highest = 0; // The newest data pkt this segment, everything before it has been sent
+	uint8_t link_seq = 0; // The last link change request, see change_link()
+	bool link_unchecked = false; // We moved for it, but haven't heard its check yet
+	uint32_t link_moved = 0;
+	uint8_t link_back[2] = {}; // The channel and data rate to go back to if we don't
+
+	/* What we have so far goes in a journal, so an interrupted transfer can carry on */
+	Journal journal;
+	Journal::Identity journal_id = {};
+	bool journaling = false;
+	uint32_t journal_saved = 0;
+
+	int progress_ctr = 100;
+	int bar_width = 70;
+
+	/* Open a file for writing to. Each pkt goes straight to its place in it. */
+	FileSink sink;
+	FecDecoder fec;
+	// Don't throw away what's there yet: it may be the copy the transmitter
+	// only sends changes to, or what an earlier transfer got
+	journal.open((string(filename) + ".journal").c_str());
+	if(sink.open(filename, true) == false)
+	{
+		cout << "Something weird happened trying to write to the file\n";
+		perror("The following error occurred: ");
+		return 6;
+	}
+
+	radio.openWritingPipe(addresses[0]);
+	radio.openReadingPipe(1,addresses[1]);
+	if(node > 0)
+	{
+		// The transmitter doesn't wait for ACKs, and a dozen of us sending them would only get in each other's way
+		radio.setAutoAck(false);
+		printf("Receiver %d of a multicast.\n", node);
+	}
+	radio.startListening();
+	/* Packet RX Loop: */
+	/* 
+	 * Control flag:
+	 * 0 - have not received starting packet
+	 * 1 - starting packet received, ready for data pkts
+	 * 3 - ending packet received, waiting on retransmissions
+	 * 4 - segment complete, waiting for the next one
+	 */
+	int control = 0; 
+	// What each control state counts as in the telemetry
+	const char *control_phases[] = { "waiting", "data", "", "retransmit", "next_segment" };
+	int phase_control = -1;
+	// Where the last -m interval started, and the counts then
+	uint32_t measure_start = 0;
+	unsigned long measure_recvd = 0;
+	uint64_t measure_bad = 0, measure_dups = 0;
+
+	// Move on to segment seg, which the transmitter only does once we've got all of this one
+	auto next_segment = [&](uint32_t seg) {
+		if(sink.next_segment() == false)
 		{
-			free(recvd_array);
+			printf("\nTransmitter moved on to segment %u before we had all of segment %u!\n", seg, sink.segment());
+			file_ok = false;
+			return false;
 		}
-		if(pkt_buf != NULL)
+		if(fec.enabled())
+			fec.start(fec_k, fec_r, sink.num_chunks());
+		if(hide!=1) printf("Segment %u, %u packets.\n", seg, sink.num_chunks());
+		control = 1;
+		report_seq = 0;
+		report_cursor = 1;
+		highest = 0;
+		return true;
+	};
+
+	// Queue up a loss report for our next ACK. Until the transmitter polls,
+	// only the gaps behind the newest pkt are missing for sure, and each one
+	// is only reported once: the poll catches any report whose ACK got lost.
+	// With FEC they may still be rebuilt, so they all wait for the poll.
+	// After that it's everything from the poll's cursor on. Reports queue up
+	// behind each other rather than being flushed, so none go missing.
+	auto load_ack_report = [&]() {
+		uint8_t report[32];
+		memset(&report, '\0', 32);
+		uint8_t state = mc_missing;
+		uint32_t next_cursor = report_cursor;
+		if(finished)
+			state = file_ok ? mc_file_ok : mc_file_bad;
+		// The last segment waits on the file being checked
+		else if(sink.complete() && sink.last_segment() == false)
+			state = mc_segment_done;
+		else if(sink.complete())
+			state = mc_missing;
+		else if(control == 3 || fec.enabled() == false)
 		{
-			free(pkt_buf);
+			uint32_t last = control == 3 ? (fec.enabled() ? fec.last_id() : sink.num_chunks()) : highest;
+			bool more;
+			uint16_t covered = build_loss_report(report, report_cursor, last, sink, fec, &more);
+			if(more)
+				state = mc_missing_more;
+			if(control == 1)
+				next_cursor = more ? covered + 1 : highest + 1;
 		}
+		report[1] = '1';
+		report[2] = report_seq;
+		report[3] = state;
+		// With the queue full, the next one covers this stretch as well
+		if(radio.writeAckPayload(1, report, pack_frame(report, report, 0)))
+			report_cursor = next_cursor;
+	};
+
+	// Tell a multicast transmitter how we're doing
+	auto answer_poll = [&](const uint8_t *poll) {
+		uint32_t seg;
+		memcpy(&seg, poll+7, 4);
+		uint8_t state = mc_missing;
+		if(control == 0 || seg > sink.segment())
+			state = mc_lost;
+		else if(finished)
+			state = file_ok ? mc_file_ok : mc_file_bad;
+		else if(seg < sink.segment() || sink.complete())
+			state = mc_segment_done;
+		send_multicast_status(radio, poll, state, sink, fec);
+	};
+
+	if(interrupt_flag != 0)
+	{
+		cout << "File transfer canceled by user.\n";
+		return 6;
 	}
-	/***************/
-	/* TRANSMITTER */
-	/***************/
-	else if(role == role_tx)
+	cout << "Waiting for transmission...\n";
+	while(interrupt_flag == 0)
 	{
-		radio.openWritingPipe(addresses[1]);
-		radio.openReadingPipe(1,addresses[0]);
-		radio.stopListening();
-		// Send the very first packet with the filesize:
-		uint8_t first[32];
-		memset(&first, '\0', sizeof(first));
-		first[1] = '1';
-		uint32_t filesize = getFilesize(filename);
-		if(filesize == 0)
-		{
-			cout << "Error: Will not transmit an empty file!\n";
-			return 6;
+		if(report_due)
+		{
+			load_ack_report();
+			report_due = false;
 		}
-		memcpy(first+2, &filesize, 4);
-		cout << "Attempting to establish connection...";
-		cout.flush();
-		while(interrupt_flag == 0)
+		if(control != phase_control && finished == false)
+		{
+			telemetry.phase(control_phases[control]);
+			phase_control = control;
+		}
+		if(measure == true && control > 0 && millis() - measure_start >= measure_seconds * 1000U)
 		{
-			if(radio.write(first, sizeof(first)) == false)
+			unsigned long recvd_this_interval = num_recvd - measure_recvd;
+			unsigned long rate_this_interval = recvd_this_interval / measure_seconds;
+			int data_rate = rate_this_interval * payload_bytes;
+			if(measure_start != 0)
+				printf("Received %lu pkts in %u seconds - %lu pkts/sec - %d bytes/sec - %llu bad checksums, %llu duplicates\n",
+					recvd_this_interval, measure_seconds, rate_this_interval, data_rate,
+					(unsigned long long)(telemetry.get(Telemetry::checksum_failures) - measure_bad),
+					(unsigned long long)(telemetry.get(Telemetry::duplicates) - measure_dups));
+
+			measure_recvd = num_recvd;
+			measure_bad = telemetry.get(Telemetry::checksum_failures);
+			measure_dups = telemetry.get(Telemetry::duplicates);
+			measure_start = millis();
+		}
+		// Update our progress bar every 100 pkts
+		if(hide_progress_bar == false && progress_ctr <= 0)
+		{
+			float normalized_progress = (float)(num_recvd - 1)/(float)(num_expected - 1);
+			cout << "[";
+			int pos = bar_width * normalized_progress;
+			for(int i = 0; i < bar_width; ++i)
 			{
-				if(hide!=1) cout << "Sending first packet failed.\n";
+				if (i<pos) cout << "=";
+				else if (i==pos) cout << ">";
+				else cout << " ";
 			}
-			else break;
+			cout << "]" << int(normalized_progress*100.0) << " %\r";
+			cout.flush();
+			progress_ctr =100;
 		}
-		if(interrupt_flag == 0)
+		/* We moved to another channel or data rate, but the transmitter didn't follow */
+		if(link_unchecked && millis() - link_moved >= link_fallback_ms)
 		{
-			cout << "Success!\n";
+			move_radio(radio, link_back[0], (rf24_datarate_e)link_back[1]);
+			link_unchecked = false;
+			printf("\nTransmitter didn't follow, back to channel %d at %s.\n", link_back[0], rate_name((rf24_datarate_e)link_back[1]));
 		}
-		else
+		uint8_t data[32];
+		if(radio.available())
 		{
-			cout << "Attempt to establish a connection was canceled by the user.\n";
-			return 6;
-		}
-
-		// Calculate the number of pkts we're TX'ing
-		uint16_t total_num_pkts = filesize / num_payload_bytes; 
-		// If filesize is not exactly divisible by
-		// num_payload_bytes we need an extra packet
-		if (filesize % num_payload_bytes != 0)
-			total_num_pkts += 1;
-		printf("Filesize: %d\n", filesize);
-		printf("Total Number of Packets: %d\n", total_num_pkts);
-		// Initalize the array we'll be transmitting
-		char code[32];
-		memset(&code, '\0', 32);
-
-		// Things we'll need later:
-		int eof = 0;
-		uint16_t special_ctr = 1; // This IDs the data pkts. Starts at 1, 0 is reserved for special packets
-
-		// Store all the packets in a buffer addressed by special_ctr
-		// TODO: don't store entire file in memory, instead use fseek
-		packets = (uint8_t*)malloc(num_payload_bytes * (total_num_pkts+1));
-
-		cout << "Beginning Transmission.\n";
-		// Read the entire file and store it into the packets array
-		uint8_t chk_sum = 0;
-		while(eof==0 && interrupt_flag == 0)
-		{
-			// Transmit normal data packets
-			int checksum_loc = 0;
-			memset(code, '\0', 32);
-			memcpy(code, &special_ctr, 2);
-			for(int i = 0 + num_header_bytes; i < 31; i++)
-			{
-				file->get(code[i]);
-				if(*file==NULL)
-				{
-					if(hide!=1)
-						cout << "Hit EOF!\n";
-					eof = 1;
-					break;
+			// cout << "control: " << control << "\n";
+			uint8_t len = read_frame(radio, data);
+			report_due = ack_reports;
+			/* Receive the starting packet with our file size */
+			if(control == 0 && (char)data[0] == '\0' && (char)data[1] == '1')
+			{
+				if((data[6] & flag_sealed) && frame_ok(data, check_crc16, first_pkt_seal) == false)
+				{
+					if(hide!=1) cout << "Bad CRC on the first packet, ignoring it.\n";
+					continue;
+				}
+				if(node > 0 && (data[28] & flag2_multicast) == 0)
+				{
+					cout << "The transmitter is only sending to one receiver, run this without -M.\n";
+					return 6;
+				}
+				if(node == 0 && (data[28] & flag2_multicast))
+				{
+					cout << "The transmitter is multicasting, give this receiver a number with -M.\n";
+					return 6;
+				}
+				cout << "\n";
+				cout << "File transfer beginning.\n";
+				memcpy(&filesize, data+num_special_header_bytes, 4);
+				if(data[6] & flag_segments)
+				{
+					uint16_t size_high;
+					memcpy(&size_high, data+24, 2);
+					filesize |= (uint64_t)size_high << 32;
+				}
+				// Older transmitters leave this at 0, which is fletcher_8
+				frame_check = data[9];
+				if(frame_check > check_crc32c)
+				{
+					printf("Transmitter wants frame check %d, which we don't know about.\n", frame_check);
+					return 6;
+				}
+				payload_bytes = frame_payload_bytes(frame_check);
+				num_expected = filesize / payload_bytes; 
+				// If filesize is not exactly divisible by
+				// payload_bytes we need an extra packet
+				if (filesize % payload_bytes != 0)
+					num_expected += 1;
+				printf("Filesize: %llu\n", (unsigned long long)filesize);
+				printf("Expected Pkts: %llu\n", (unsigned long long)num_expected);
+				printf("Packets are checked with %s.\n", check_name(frame_check));
+				tx_flags = data[6];
+				if(data[6] & flag_digest)
+					memcpy(&expected_digest, data+10, 8);
+				delta = data[28] & flag2_delta;
+				if((data[6] & flag_compressed) || delta)
+				{
+					memcpy(&original_size, data+18, 4);
+					if(data[6] & flag_segments)
+					{
+						uint16_t original_high;
+						memcpy(&original_high, data+26, 2);
+						original_size |= (uint64_t)original_high << 32;
+					}
+					if(data[6] & flag_compressed)
+						printf("Transmitter compressed the file, it's %llu bytes uncompressed.\n", (unsigned long long)original_size);
+				}
+				if(delta)
+					printf("Transmitter is only sending what changed from our copy, the new file is %llu bytes.\n", (unsigned long long)original_size);
+				if(data[6] & flag_window)
+					cout << "Transmitter is using a selective repeat window.\n";
+				// Everything fits in one segment unless the transmitter says otherwise
+				uint32_t seg_len = num_expected;
+				if(data[6] & flag_segments)
+				{
+					uint16_t seg_len16;
+					memcpy(&seg_len16, data+22, 2);
+					seg_len = seg_len16;
+				}
+				if(seg_len == 0 || num_expected > 0xffffffff)
+				{
+					cout << "The transmitter's segments don't make sense.\n";
+					return 6;
+				}
+				// Without the digest there's no telling whether what we have is from the same file
+				journaling = (data[6] & flag_resume) && (data[6] & flag_digest);
+				journal_id.digest = expected_digest;
+				journal_id.size = filesize;
+				journal_id.original_size = original_size;
+				journal_id.segment_len = seg_len;
+				journal_id.payload_size = payload_bytes;
+				bool resuming = journaling && journal.matches(journal_id);
+				if((data[6] & flag_compressed) || delta)
+				{
+					sink.finish();
+					if(sink.open(data[6] & flag_compressed ? packed_name.c_str() : delta_name.c_str(), resuming) == false)
+					{
+						perror("Couldn't open a file for what the transmitter is sending");
+						return 6;
+					}
 				}
+				if(sink.start(filesize, payload_bytes, seg_len) == false)
+				{
+					perror("Couldn't size the output file");
+					return 6;
+				}
+				if(resuming && sink.restore(journal.segment(), journal.words()))
+				{
+					num_recvd = (uint64_t)sink.segment() * seg_len + sink.num_received();
+					printf("Picking up where we left off, %lu of %llu packets are already here.\n", num_recvd, (unsigned long long)num_expected);
+				}
+				journal_saved = millis();
+				if(data[6] & flag_segments)
+					printf("Transmitter is sending it in segments of %u packets, tracked in %zu bytes.\n", seg_len, sink.bytes());
+				telemetry.note("segment_bitmap_bytes", to_string(sink.bytes()));
+				if(data[6] & flag_fec)
+				{
+					fec_k = data[7];
+					fec_r = data[8];
+					fec.start(fec_k, fec_r, sink.num_chunks());
+					printf("Transmitter is sending %d repair packets per %d data packets.\n", data[8], data[7]);
+				}
+				control = 1;
+				if(data[28] & flag2_ack_reports)
+				{
+					cout << "Loss reports go back on our ACKs.\n";
+					ack_reports = true;
+					report_due = true;
+					radio.enableAckPayload();
+				}
+				continue;
 			}
-			memcpy(packets + (num_payload_bytes * special_ctr), &code[num_header_bytes], num_payload_bytes);
-
-			chk_sum = fletcher_8((uint8_t*)&code[num_header_bytes], num_payload_bytes);
-			code[31] = chk_sum;
-			checksum_loc = 31;
-
-			/* Simulate some packet loss for testing purposes */
-			#ifdef PKT_LOSS
-			if(special_ctr % 25 != 0)
-			{	
-			#endif
-			if(radio.write(&code, 32))
+			/* Signatures of our copy, for the transmitter to send only what changed */
+			else if(control == 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '4')
 			{
-				if(hide != 1)
+				// A repeat of a request we only just answered got in while we were at it
+				if(data[3] == sigs_id && data[4] == 0 && millis() - sigs_sent < 500)
+					continue;
+				// Asking again for some of them, which is for the signatures we already worked out
+				if(data[3] != sigs_id)
 				{
-					cout << "  Sent!\n";
-					usleep(50);
+					basis_size = getFilesize(filename);
+					basis_block = delta_block_size(basis_size);
+					if(basis_size == 0 || delta_signatures(filename, basis_block, basis_sigs) == false)
+						basis_sigs.clear();
 				}
-				else if(hide!=1)
-					cout << "  Failed.\n";
+				send_signatures(radio, basis_sigs, basis_block, basis_size, data);
+				sigs_id = data[3];
+				sigs_sent = millis();
+				continue;
 			}
-			#ifdef PKT_LOSS
-		
+			/* Multicast status poll, which we answer even before the first packet so the transmitter can tell we missed it */
+			else if(node > 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '3')
+			{
+				uint32_t seg;
+				memcpy(&seg, data+7, 4);
+				// Everyone's done, or the transmitter gave up on us
+				if(data[3] == 0)
+				{
+					cout << "\nTransmitter finished without us.\n";
+					file_ok = false;
+					break;
+				}
+				if(data[3] != node)
+					continue;
+				if(control == 4 && seg == sink.segment() + 1 && next_segment(seg) == false)
+					break;
+				// It's done sending, same as an ending packet
+				if(control == 1)
+				{
+					printf("\nTransmitter is asking what we're missing: %d packets.\n", sink.num_missing());
+					control = 3;
+				}
+				// The answer has to wait until the file is written out and checked
+				if(control == 3 && sink.complete() && sink.last_segment())
+				{
+					memcpy(pending_poll, data, 32);
+					poll_pending = true;
+				}
+				else
+					answer_poll(data);
 			}
-			#endif
-
-			special_ctr++;
-		}
-
-		// Send the very last packet:
-		uint8_t last[32];
-		memset(&last, '\0', sizeof(last));
-		if(interrupt_flag ==1)
-		{
-			last[2] = '8';
-
-			radio.write(&last, sizeof(last));
-
-		}
-		else
-		{
-			if(hide!=1) printf("special_ctr: %d\n", special_ctr);
-			last[2] = '9';
-			int receiver_status = 0; 
-			while(receiver_status == 0&& interrupt_flag == 0)
+			/* The transmitter is moving us to another channel or data rate, or checking we got there */
+			else if(node == 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '1')
+			{
+				if(data[6] == 0 && data[4] <= 125 && data[5] <= RF24_250KBPS)
+				{
+					if(hide!=1 && data[3] != link_seq)
+						printf("Moving to channel %d at %s.\n", data[4], rate_name((rf24_datarate_e)data[5]));
+					move_radio(radio, data[4], (rf24_datarate_e)data[5]);
+					link_seq = data[3];
+					link_unchecked = true;
+					link_moved = millis();
+					link_back[0] = data[7];
+					link_back[1] = data[8];
+				}
+				else if(data[6] == 1 && data[3] == link_seq)
+					link_unchecked = false;
+			}
+			/* Nothing else makes sense until we know how big the file is */
+			else if(control == 0)
 			{
-			if(hide!=1) printf("Receiver status is: %d\n", receiver_status);
-			while(true)
+				continue;
+			}
+			/* Ending Packet */
+			else if (control > 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '9')
 			{
-				if(radio.write(&last, sizeof(last)) ==  false)
+				if(hide!=1)
+				{
+					cout << "\nENDING PACKET\n";
+					cout << "*****************\n";
+					printf("* 0: %c\n", data[0]);
+					printf("* 1: %c\n", data[1]);
+					printf("* 2: %c\n", data[2]);
+					printf("* 3: %c\n", data[3]);
+					cout << "*****************\n";
+				}
+				uint16_t z_pkt_num = 0;
+				memcpy(&z_pkt_num, &data, 2);
+				uint16_t num_txed;
+				memcpy(&num_txed, data+num_special_header_bytes, 2);
+				if(hide!=1) printf("Received %lu out of %llu packets\n", num_recvd, (unsigned long long)num_expected);
+				int num_missing = sink.num_missing();
+				cout << "\n";
+				if(fec.enabled())
 				{
-					if(hide!=1) cout << "Final packet TX failed\n";
+					unsigned long num_lost = fec.recovered() + num_missing;
+					printf("FEC rebuilt %lu of %lu lost packets (%.0f%%) in %lu blocks from %lu repair packets, %lu blocks still need retransmits.\n",
+						fec.recovered(), num_lost, num_lost ? 100.0 * fec.recovered() / num_lost : 100.0,
+						fec.blocks_recovered(), fec.repair_received(), fec.blocks_unrecoverable(sink));
 				}
+				if(num_missing == 0)
+					cout<<"No packet loss!\n";
 				else
+					printf("Missing %d packets, asking transmitter to resend them.\n", num_missing);
+
+				// With nothing missing, the all clear (or a verdict on the
+				// whole file) goes out below
+				if(num_missing != 0)
 				{
-					if(hide!=1) cout << "Final packet sent!\n";
-					break;
+					request_missing_pkts(radio, sink.chunks(), sink.num_chunks(), num_missing, tx_flags & flag_compact_re_tx);
+					cout << "Ready to receive the missing packets:\n";
+				}
+				control = 3;
+			}
+			/* Loss report poll, only sent for the report on its ACK. The next one answers it. */
+			else if (control > 0 && ack_reports && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '2')
+			{
+				if(control == 1)
+				{
+					printf("\nTransmitter is done sending, %d packets are missing.\n", sink.num_missing());
+					control = 3;
 				}
+				report_seq = data[3];
+				uint16_t cursor;
+				memcpy(&cursor, data+4, 2);
+				report_cursor = cursor;
+			}
+			/* Next segment */
+			else if (control > 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '6')
+			{
+				uint32_t seg;
+				memcpy(&seg, data+3, 4);
+				// Anything else is a repeat whose ACK got lost
+				if(seg != sink.segment() + 1)
+					continue;
+				if(next_segment(seg) == false)
+					break;
 			}
-			if(interrupt_flag == 0)
+			/* Window status poll */
+			else if (control > 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '5')
 			{
-				cout << "Getting list of dropped packets\n";
-				receiver_status = send_missing_pkts(packets);
+				send_window_status(radio, data, sink.chunks(), sink.next_missing());
 			}
+			/* Resume poll */
+			else if (control > 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '7')
+			{
+				send_resume_status(radio, sink.segment(), sink.num_received());
 			}
-			if(interrupt_flag == 0)
+			/* Transmitter gave up */
+			else if (control > 0 && (char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '8')
 			{
-				cout << "File transfer looks successful!\n";
+				cout << "\nTransmitter canceled the transfer.\n";
+				file_ok = false;
+				break;
 			}
+			/* Receive data packets */
+			// else if(control > 0 && data[0] != '\0')
 			else
 			{
-				cout << "File transfer was canceled by user.\n";
-			}
-			sleep(1);
-		}
-		free(packets);
-	} // tx block
-	radio.closeReadingPipe(addresses[0]);
-	radio.closeReadingPipe(addresses[1]);
-	radio.powerDown();
+				uint16_t pkt_num;
+				memcpy(&pkt_num, data, 2);
+				unpack_data_frame(data, len, frame_check);
+
+				// Nobody ACKs the start of a multicast's next segment, but its pkts say it started
+				if(node > 0 && control == 4 && pkt_num != 0 && frame_ok(data, frame_check, sink.segment() + 1) &&
+					next_segment(sink.segment() + 1) == false)
+					break;
+
+				// 0 is reserved for special packets, and anything
+				// past the end of the file (and its repair
+				// packets) can't be real
+				if(pkt_num == 0 || pkt_num > (fec.enabled() ? fec.last_id() : sink.num_chunks()))
+				{
+					if(hide!=1) printf("Ignoring pkt: %d\n", pkt_num);
+					telemetry.count(Telemetry::ignored);
+					continue;
+				}
+
+				// Drop any packets we've already
+				// seen (The ACK we sent must not
+				// have made it back to the sender
+				if(sink.has(pkt_num))
+				{
+					if(hide!=1) printf("Dropped Pkt: %d\n", pkt_num);
+					telemetry.count(Telemetry::duplicates);
+					continue;
+				}
+
+				// A bad checksum is as good as a dropped packet, we'll ask for it again
+				if(frame_ok(data, frame_check, sink.segment()) == false)
+				{
+					if(hide!=1) printf("Bad checksum on pkt: %d\n", pkt_num);
+					telemetry.count(Telemetry::checksum_failures);
+					continue;
+				}
+				int num_new = 0;
+				if(pkt_num > sink.num_chunks())
+				{
+					// Repair packet, which may fill in some of its block
+					num_new = fec.add_repair(pkt_num, data + num_header_bytes, payload_bytes, sink);
+					if(hide != 1 && num_new > 0)
+						printf("FEC rebuilt %d pkts with repair pkt %d\n", num_new, pkt_num);
+				}
+				else
+				{
+					if(hide != 1)
+					{
+						printf("pkt_num: %d, num_recvd: %lu, num_expected: %llu\n", pkt_num, num_recvd + 1, (unsigned long long)num_expected);
+					}
+
+					if(pkt_num > highest)
+						highest = pkt_num;
+					// Properly keep track of new pkts
+					if(sink.put(pkt_num, data + num_header_bytes) < 0)
+						num_new = -1;
+					else
+					{
+						int rebuilt = fec.data_arrived(pkt_num, sink);
+						num_new = rebuilt < 0 ? -1 : 1 + rebuilt;
+					}
+				}
+				if(num_new < 0)
+				{
+					perror("Couldn't write to the output file");
+					break;
+				}
+				num_recvd += num_new;
+				progress_ctr -= num_new;
+				telemetry.count(Telemetry::data_pkts, num_new);
+			}
+		}
+		/* Write down what we have. The data goes to disk first, so the journal never claims more than is there. */
+		if(journaling && control > 0 && millis() - journal_saved >= journal_interval_ms)
+		{
+			if(sink.sync())
+				journal.save(journal_id, sink.segment(), sink.chunks());
+			journal_saved = millis();
+		}
+		/* This segment's done, but there's more to come */
+		if(control == 3 && sink.complete() && sink.last_segment() == false)
+		{
+			// A multicast transmitter polls for it, and with loss reports it's in the next one
+			if(node == 0 && ack_reports == false)
+				send_all_clear(radio);
+			control = 4;
+		}
+		/* Check and see if we have everything! */
+		if(control == 3 && sink.complete())
+		{
+			finished = true;
+			telemetry.phase("finish");
+			journal.remove();
+			printf("Received file size: %llu\n", (unsigned long long)filesize);
+			if(sink.finish() == false)
+			{
+				perror("Couldn't finish writing the output file");
+				return 6;
+			}
+			// A delta is rebuilt into a new file, so our copy is still there if it goes wrong
+			const char *result = delta ? rebuilt_name.c_str() : filename;
+			if(tx_flags & flag_compressed)
+			{
+				uint32_t unpack_start = millis();
+				const char *unpacked = delta ? delta_name.c_str() : filename;
+				file_ok = lz_decompress_file(packed_name.c_str(), unpacked) && (delta || getFilesize(unpacked) == original_size);
+				unlink(packed_name.c_str());
+				if(file_ok)
+					printf("Decompressed %llu bytes to %llu in %u ms.\n", (unsigned long long)filesize, (unsigned long long)getFilesize(unpacked), millis() - unpack_start);
+				else
+					cout << "Couldn't decompress the file!\n";
+			}
+			if(file_ok && delta)
+			{
+				uint64_t reused = 0;
+				file_ok = delta_apply(delta_name.c_str(), filename, result, &reused) && getFilesize(result) == original_size;
+				if(file_ok)
+					printf("Rebuilt %llu bytes, %llu of them from our copy and %llu from %llu bytes of delta.\n", (unsigned long long)original_size,
+						(unsigned long long)reused, (unsigned long long)(original_size - reused), (unsigned long long)getFilesize(delta_name.c_str()));
+				else
+					cout << "Couldn't rebuild the file from the delta!\n";
+			}
+			if(delta)
+				unlink(delta_name.c_str());
+			puts("Wrote to file!\n");
+			transfer_done_ms = millis();
+			if(file_ok && (tx_flags & flag_digest))
+			{
+				uint64_t digest = 0;
+				file_ok = file_digest(result, &digest) && digest == expected_digest;
+				if(file_ok)
+					cout << "File digest matches the transmitter's.\n";
+				else
+					cout << "File digest doesn't match the transmitter's, the file is damaged!\n";
+			}
+			if(delta)
+			{
+				if(file_ok && rename(result, filename) != 0)
+				{
+					perror("Couldn't replace our copy with the new file");
+					file_ok = false;
+				}
+				if(file_ok == false)
+				{
+					unlink(result);
+					cout << "Our copy of the file is unchanged.\n";
+				}
+			}
+			telemetry.end(file_ok ? (original_size ? original_size : filesize) : 0);
+			if(node > 0)
+			{
+				// Keep answering until the transmitter has heard from everyone,
+				// which may take it a while
+				if(poll_pending)
+					answer_poll(pending_poll);
+				uint32_t heard = millis();
+				while(interrupt_flag == 0 && millis() - heard < multicast_linger_ms)
+				{
+					if(radio.available() == false)
+						continue;
+					read_frame(radio, data);
+					heard = millis();
+					if((char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '3')
+					{
+						if(data[3] == 0)
+							break;
+						if(data[3] == node)
+							answer_poll(data);
+					}
+				}
+				break;
+			}
+			if(ack_reports)
+			{
+				// The transmitter keeps polling until a report says how it went
+				load_ack_report();
+				uint32_t heard = millis();
+				while(interrupt_flag == 0 && millis() - heard < 2000)
+				{
+					if(radio.available() == false)
+						continue;
+					read_frame(radio, data);
+					heard = millis();
+					if((char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '2')
+						report_seq = data[3];
+					load_ack_report();
+				}
+				break;
+			}
+			if(file_ok)
+				send_all_clear(radio);
+			else
+				send_file_mismatch(radio);
+
+			// The transmitter may still be sending retransmissions or another
+			// ending packet. Hang around for a bit so it gets its all clear.
+			uint32_t linger = millis();
+			while(interrupt_flag == 0 && millis() - linger < 2000)
+			{
+				if(radio.available())
+				{
+					read_frame(radio, data);
+					if((char)data[0] == '\0' && (char)data[1] == '\0' && (char)data[2] == '9')
+					{
+						if(file_ok)
+							send_all_clear(radio);
+						else
+							send_file_mismatch(radio);
+						linger = millis();
+					}
+				}
+			}
+			break;
+		}
+	}
+	if(journaling && finished == false && sink.sync() && journal.save(journal_id, sink.segment(), sink.chunks()))
+		cout << "\nSaved how far we got, run it again to pick up from there.\n";
+	sink.finish();
+	radio.print_stats();
+	telemetry.count(Telemetry::ring_full, radio.ring_full());
+	telemetry.end(0);
+	telemetry.print_summary();
+	return interrupt_flag == 0 && file_ok ? 0 : 6;
+}
+
+/***************/
+/* TRANSMITTER */
+/***************/
+/*
+ * Compress the file into packed_name (a mkstemp() template) to send in its
+ * place, and say what that cost against the air time it saves. Returns
+ * false if it didn't work or didn't help, and the file goes as is.
+ */
+bool compress_file(const char *filename, int level, int payload_bytes, char *packed_name)
+{
+	int fd = mkstemp(packed_name);
+	if(fd < 0)
+	{
+		perror("Couldn't make a temporary file to compress into");
+		return false;
+	}
+	close(fd);
+	uint32_t start = millis();
+	uint64_t packed_size = 0;
+	bool ok = lz_compress_file(filename, packed_name, level, &packed_size);
+	uint32_t took = millis() - start;
+	if(ok == false)
+	{
+		cout << "Compressing the file failed, sending it as is.\n";
+		unlink(packed_name);
+		return false;
+	}
+
+	uint64_t size = getFilesize(filename);
+	uint32_t num_pkts = (size + payload_bytes - 1) / payload_bytes;
+	uint32_t num_packed_pkts = (packed_size + payload_bytes - 1) / payload_bytes;
+	printf("Compressed %llu bytes to %llu (%.0f%%) at level %d in %u ms.\n", (unsigned long long)size,
+		(unsigned long long)packed_size, size ? 100.0 * packed_size / size : 100.0, level, took);
+	if(num_packed_pkts >= num_pkts)
+	{
+		cout << "That doesn't save any packets, sending the file as is.\n";
+		unlink(packed_name);
+		return false;
+	}
+	printf("That's %u fewer packets, about %.0f ms less on the air.\n", num_pkts - num_packed_pkts,
+		(num_pkts - num_packed_pkts) * 1000.0 / link_frame_limit());
+	return true;
+}
+
+/*
+ * Get the signatures of the receiver's copy and write what it needs to
+ * rebuild filename from it into delta_name (a mkstemp() template), and say
+ * how much that saves. Returns false if it didn't work or didn't help, and
+ * the whole file goes.
+ */
+bool delta_file(Transport &radio, const char *filename, int payload_bytes, char *delta_name)
+{
+	uint32_t start = millis();
+	uint32_t block_size;
+	uint64_t basis_size;
+	vector<BlockSig> sigs;
+	vector<bool> known;
+	if(request_signatures(radio, &block_size, &basis_size, sigs, known) == false)
+	{
+		cout << "Receiver has no copy of the file to update, sending all of it.\n";
+		return false;
+	}
+	uint32_t sigs_ms = millis() - start;
+	int fd = mkstemp(delta_name);
+	if(fd < 0)
+	{
+		perror("Couldn't make a temporary file for the delta");
+		return false;
+	}
+	close(fd);
+	start = millis();
+	DeltaStats stats;
+	if(delta_encode(filename, sigs, known, block_size, basis_size, delta_name, &stats) == false)
+	{
+		cout << "Working out the delta failed, sending the whole file.\n";
+		unlink(delta_name);
+		return false;
+	}
+	uint64_t size = getFilesize(filename);
+	uint64_t num_pkts = (size + payload_bytes - 1) / payload_bytes;
+	uint64_t num_delta_pkts = (stats.size + payload_bytes - 1) / payload_bytes;
+	printf("%llu of %llu bytes are in the receiver's copy, the delta is %llu bytes (%.1f%%), worked out in %u ms after %u ms getting signatures.\n",
+		(unsigned long long)stats.matched, (unsigned long long)size, (unsigned long long)stats.size,
+		size ? 100.0 * stats.size / size : 100.0, millis() - start, sigs_ms);
+	if(num_delta_pkts >= num_pkts)
+	{
+		cout << "That doesn't save any packets, sending the whole file.\n";
+		unlink(delta_name);
+		return false;
+	}
+	printf("That's %llu fewer packets, about %.0f ms less on the air.\n", (unsigned long long)(num_pkts - num_delta_pkts),
+		(num_pkts - num_delta_pkts) * 1000.0 / link_frame_limit());
+	return true;
+}
+
+/*
+ * Data pkts per segment. Plain pkts can have every id, so whatever older
+ * receivers could take still goes in one piece. Repair pkts take the ids
+ * after the data's, and a window's status says the one after the last it
+ * has, so with those it stops short of the top.
+ */
+uint32_t segment_length(const tx_options &opts)
+{
+	if(opts.fec_k > 0)
+		return max_segment_ids / (opts.fec_k + opts.fec_r) * opts.fec_k;
+	if(opts.window_size > 0)
+		return max_segment_ids;
+	return max_data_ids;
+}
+
+/*
+ * Tell the receiver we're moving on to segment seg: '\0' '\0' '6' seg.
+ * It only gets this once it has given us the all clear for the last one.
+ */
+bool send_segment_start(Transport &radio, uint32_t seg)
+{
+	uint8_t pkt[32];
+	memset(&pkt, '\0', sizeof(pkt));
+	pkt[2] = '6';
+	memcpy(pkt+3, &seg, 4);
+	radio.stopListening();
+	uint32_t start = millis();
+	while(interrupt_flag == 0)
+	{
+		if(write_frame(radio, pkt))
+			return true;
+		if(millis() - start > 10000)
+		{
+			cout << "Receiver stopped responding.\n";
+			return false;
+		}
+	}
+	return false;
+}
+
+/*
+ * Send the ending packet for the segment and resend whatever the receiver
+ * asks for until it's happy. Returns 1 when it is, 2 if it stopped
+ * answering, 3 if it says the file doesn't match.
+ */
+int end_segment(Transport &radio, FileSource &source, uint8_t check)
+{
+	uint8_t last[32];
+	memset(&last, '\0', sizeof(last));
+	last[2] = '9';
+	int receiver_status = 0; 
+	while(receiver_status == 0 && interrupt_flag == 0)
+	{
+		if(hide!=1) printf("Receiver status is: %d\n", receiver_status);
+		// A repeat of an earlier answer (its ACK got lost) could pass for
+		// the answer to this one
+		radio.flush_rx();
+		// If nobody has ACKed this for 10 seconds the receiver is long gone
+		radio.stopListening();
+		uint32_t start = millis();
+		while(interrupt_flag == 0)
+		{
+			if(write_frame(radio, last) == false)
+			{
+				if(hide!=1) cout << "Final packet TX failed\n";
+				if(millis() - start > 10000)
+				{
+					cout << "Receiver stopped responding.\n";
+					receiver_status = 2;
+					break;
+				}
+			}
+			else
+			{
+				if(hide!=1) cout << "Final packet sent!\n";
+				break;
+			}
+		}
+		if(interrupt_flag == 0 && receiver_status == 0)
+		{
+			cout << "Getting list of dropped packets\n";
+			receiver_status = send_missing_pkts(radio, source, check);
+		}
+	}
+	return receiver_status;
+}
+
+/* Send a control pkt to every receiver of a multicast, a few times since nobody ACKs it */
+void multicast_broadcast(Transport &radio, const uint8_t *pkt)
+{
+	radio.stopListening();
+	for(int i = 0; i < multicast_repeats; i++)
+	{
+		write_frame(radio, pkt);
+		delay(1);
+	}
+}
+
+/*
+ * Ask receiver node what it's missing of segment seg, a poll at a time,
+ * each picking up past the last id the one before covered, until it has
+ * told us all of it. Ids past last_id, which a garbled reply could hold,
+ * are dropped. Returns its mc_ state, or mc_gone if it stopped answering.
+ */
+int poll_node(Transport &radio, uint8_t node, uint32_t seg, uint16_t last_id, uint8_t &seq, vector<uint16_t> &missing)
+{
+	missing.clear();
+	uint16_t cursor = 1;
+	uint32_t heard = millis();
+	uint8_t poll[32], reply[32];
+	while(interrupt_flag == 0 && millis() - heard < multicast_node_timeout_ms)
+	{
+		memset(&poll, '\0', sizeof(poll));
+		poll[2] = '3';
+		poll[3] = node;
+		poll[4] = ++seq;
+		memcpy(poll+5, &cursor, 2);
+		memcpy(poll+7, &seg, 4);
+		// Answers to earlier polls are no use now
+		radio.flush_rx();
+		radio.stopListening();
+		write_frame(radio, poll);
+		radio.startListening();
+
+		bool answered = false;
+		uint32_t start = millis();
+		while(interrupt_flag == 0 && answered == false && millis() - start < multicast_reply_ms)
+		{
+			if(radio.available())
+			{
+				read_frame(radio, reply);
+				answered = reply[0] == '\0' && reply[1] == '9' && reply[2] == seq && reply[3] <= mc_lost;
+			}
+		}
+		if(answered == false)
+			continue;
+		heard = millis();
+		if(reply[3] != mc_missing && reply[3] != mc_missing_more)
+			return reply[3];
+		uint16_t ids[max_ids_per_re_tx_pkt];
+		int n = decode_compact_re_tx_pkt(reply, ids);
+		for(int i = 0; i < n; i++)
+		{
+			if(ids[i] > 0 && ids[i] <= last_id)
+				missing.push_back(ids[i]);
+		}
+		if(reply[3] == mc_missing || n == 0)
+			return mc_missing;
+		cursor = ids[n - 1] + 1;
+	}
+	return mc_gone;
+}
+
+/*
+ * What to resend to a multicast's receivers, given what each of them is
+ * missing. Without FEC that's everything any of them is missing, once.
+ * With it, a receiver missing n ids of a block (data and repair) only needs
+ * any n - fec_r more of them, so for each block keep picking whichever id
+ * the most receivers that still need something are missing: one repair pkt
+ * can finish off the block for several receivers at once.
+ */
+vector<uint16_t> plan_multicast_resend(const vector<vector<uint16_t> > &missing, uint16_t num_data, const tx_options &opts)
+{
+	vector<uint16_t> plan;
+	if(opts.fec_k == 0)
+	{
+		for(size_t n = 0; n < missing.size(); n++)
+			plan.insert(plan.end(), missing[n].begin(), missing[n].end());
+		sort(plan.begin(), plan.end());
+		plan.erase(unique(plan.begin(), plan.end()), plan.end());
+		return plan;
+	}
+
+	// Each receiver's ids, by block
+	map<uint32_t, vector<vector<uint16_t> > > blocks;
+	for(size_t n = 0; n < missing.size(); n++)
+	{
+		for(size_t i = 0; i < missing[n].size(); i++)
+		{
+			uint16_t id = missing[n][i];
+			uint32_t b = id <= num_data ? (id - 1) / opts.fec_k : (id - num_data - 1) / opts.fec_r;
+			vector<vector<uint16_t> > &per_node = blocks[b];
+			per_node.resize(missing.size());
+			per_node[n].push_back(id);
+		}
+	}
+	for(map<uint32_t, vector<vector<uint16_t> > >::iterator blk = blocks.begin(); blk != blocks.end(); ++blk)
+	{
+		vector<vector<uint16_t> > &per_node = blk->second;
+		vector<int> need(per_node.size());
+		for(size_t n = 0; n < per_node.size(); n++)
+			need[n] = per_node[n].empty() ? 0 : max<int>(1, (int)per_node[n].size() - opts.fec_r);
+		while(true)
+		{
+			map<uint16_t, int> votes;
+			for(size_t n = 0; n < per_node.size(); n++)
+			{
+				for(size_t i = 0; need[n] > 0 && i < per_node[n].size(); i++)
+					votes[per_node[n][i]]++;
+			}
+			if(votes.empty())
+				break;
+			uint16_t best = votes.begin()->first;
+			for(map<uint16_t, int>::iterator v = votes.begin(); v != votes.end(); ++v)
+			{
+				if(v->second > votes[best])
+					best = v->first;
+			}
+			plan.push_back(best);
+			for(size_t n = 0; n < per_node.size(); n++)
+			{
+				vector<uint16_t>::iterator it = find(per_node[n].begin(), per_node[n].end(), best);
+				if(need[n] > 0 && it != per_node[n].end())
+				{
+					per_node[n].erase(it);
+					need[n]--;
+				}
+			}
+		}
+	}
+	return plan;
+}
+
+/* Build repair pkt id of the current segment again, for a multicast resend */
+void build_repair_pkt(uint8_t *data, uint16_t id, FileSource &source, const tx_options &opts)
+{
+	uint16_t num_data = source.segment_chunks();
+	uint32_t b = (id - num_data - 1) / opts.fec_r;
+	FecEncoder encoder(opts.fec_k, opts.fec_r, frame_payload_bytes(opts.check));
+	uint8_t chunk[32];
+	for(uint32_t d = b * opts.fec_k + 1; d <= num_data && d <= (b + 1) * opts.fec_k; d++)
+	{
+		build_data_pkt(chunk, d, source, opts.check);
+		encoder.add(chunk + num_header_bytes);
+	}
+	build_fec_pkt(data, id, encoder.repair((id - num_data - 1) % opts.fec_r), opts.check, source.segment());
+}
+
+/* The current segment's last pkt id, repair pkts included */
+uint16_t segment_last_id(FileSource &source, const tx_options &opts)
+{
+	uint16_t last_id = source.segment_chunks();
+	if(opts.fec_k > 0)
+		last_id += (source.segment_chunks() + opts.fec_k - 1) / opts.fec_k * opts.fec_r;
+	return last_id;
+}
+
+/* Send pkt id of the current segment again, data or repair, trying up to tries times */
+bool resend_pkt(Transport &radio, uint16_t id, FileSource &source, const tx_options &opts, int tries)
+{
+	uint8_t data[32];
+	if(id <= source.segment_chunks())
+		build_data_pkt(data, id, source, opts.check);
+	else
+		build_repair_pkt(data, id, source, opts);
+	for(int i = 0; i < tries && interrupt_flag == 0; i++)
+	{
+		if(write_frame(radio, data, check_bytes(opts.check)))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * End a segment with loss reports on the ACKs (-a). Send again whatever the
+ * data phase's reports said was missing, then poll: '\0' '\0' '2' seq
+ * uint16_t cursor. Polls are only sent for the report that comes back on
+ * their ACK, so keep sending one until a report built after it does. That
+ * has what the receiver is missing from cursor on, so carry on from past
+ * the last id in it until there's no more, send all of that, and poll again
+ * until it says it's done. The radio never has to turn around for any of
+ * it. Returns like end_segment().
+ */
+int end_segment_ack_reports(Transport &radio, FileSource &source, const tx_options &opts, const ChunkBitmap &reported)
+{
+	uint16_t last_id = segment_last_id(source, opts);
+	vector<uint16_t> resend;
+	for(uint32_t id = reported.next_set(1); id <= reported.size(); id = reported.next_set(id + 1))
+		resend.push_back(id);
+	if(resend.empty() == false)
+		printf("Loss reports during the data phase asked for %zu packets.\n", resend.size());
+
+	vector<vector<uint16_t> > missing(1);
+	uint8_t seq = 0;
+	uint16_t cursor = 1;
+	unsigned long num_polls = 0, num_resent = 0;
+	while(interrupt_flag == 0)
+	{
+		// Each one that doesn't get through costs another poll
+		for(size_t i = 0; i < resend.size() && interrupt_flag == 0; i++)
+			resend_pkt(radio, resend[i], source, opts, ack_resend_tries);
+		num_resent += resend.size();
+		resend.clear();
+
+		if(++seq == 0)
+			seq = 1;
+		uint8_t poll[32], report[32];
+		memset(&poll, '\0', sizeof(poll));
+		poll[2] = '2';
+		poll[3] = seq;
+		memcpy(poll+4, &cursor, 2);
+		bool fresh = false;
+		uint32_t start = millis();
+		for(int tries = 0; interrupt_flag == 0 && fresh == false; tries++)
+		{
+			if(millis() - start > ack_report_timeout_ms)
+			{
+				cout << "Receiver stopped responding.\n";
+				return 2;
+			}
+			// It may be busy, e.g. checking the file
+			if(tries > 3)
+				delay(1);
+			num_polls++;
+			fresh = write_frame(radio, poll) && take_ack_report(radio, report) && report[2] == seq;
+		}
+		if(fresh == false)
+			break;
+
+		if(report[3] == mc_segment_done || report[3] == mc_file_ok || report[3] == mc_file_bad)
+		{
+			printf("Sent %lu packets again and %lu polls for loss reports.\n", num_resent, num_polls);
+			return report[3] == mc_file_bad ? 3 : 1;
+		}
+		uint16_t ids[max_ids_per_re_tx_pkt];
+		int n = decode_compact_re_tx_pkt(report, ids);
+		for(int i = 0; i < n; i++)
+		{
+			if(ids[i] > 0 && ids[i] <= last_id)
+				missing[0].push_back(ids[i]);
+		}
+		if(report[3] == mc_missing_more && n > 0)
+		{
+			cursor = ids[n - 1] + 1;
+			continue;
+		}
+		cursor = 1;
+		resend = plan_multicast_resend(missing, source.segment_chunks(), opts);
+		missing[0].clear();
+	}
+	return 2;
+}
+
+/*
+ * End a segment of a multicast: poll every receiver that isn't done with it
+ * for what it's missing, send what they need between them, and go round
+ * again until they all have it. states[node] is each receiver's last mc_
+ * state, or mc_gone once we've given up on it. Returns 1 while any
+ * receiver is still with us, 2 once none are.
+ */
+int end_segment_multicast(Transport &radio, FileSource &source, const tx_options &opts, const uint8_t *first, vector<int> &states)
+{
+	uint8_t seq = 0;
+	uint16_t last_id = segment_last_id(source, opts);
+	for(int round = 1; interrupt_flag == 0; round++)
+	{
+		vector<vector<uint16_t> > missing;
+		unsigned long num_missing = 0;
+		bool resend_first = false;
+		bool again = false; // Someone still needs something
+		for(size_t node = 1; node < states.size() && interrupt_flag == 0; node++)
+		{
+			if(states[node] != mc_missing)
+				continue;
+			vector<uint16_t> ids;
+			int state = poll_node(radio, node, source.segment(), last_id, seq, ids);
+			if(state == mc_gone)
+				printf("Receiver %zu stopped answering, carrying on without it.\n", node);
+			else if(state == mc_lost && source.segment() == 0)
+			{
+				// It missed the first packet, once it has that it's missing everything
+				resend_first = true;
+				state = mc_missing;
+			}
+			else if(state == mc_lost)
+			{
+				printf("Receiver %zu fell behind, carrying on without it.\n", node);
+				state = mc_gone;
+			}
+			states[node] = state;
+			again = again || state == mc_missing;
+			if(ids.empty() == false)
+			{
+				num_missing += ids.size();
+				missing.push_back(ids);
+			}
+		}
+		if(resend_first)
+			multicast_broadcast(radio, first);
+		if(again == false)
+			break;
+		if(missing.empty())
+			continue;
+
+		vector<uint16_t> plan = plan_multicast_resend(missing, source.segment_chunks(), opts);
+		printf("Round %d: %zu receivers are missing %lu packets between them, resending %zu.\n", round, missing.size(), num_missing, plan.size());
+		radio.stopListening();
+		for(size_t i = 0; i < plan.size() && interrupt_flag == 0; i++)
+			resend_pkt(radio, plan[i], source, opts, 1);
+	}
+	for(size_t node = 1; node < states.size(); node++)
+	{
+		if(states[node] != mc_gone)
+			return 1;
+	}
+	return 2;
+}
+
+int run_transmitter(const vector<Transport*> &radios, const char *filename, const tx_options &opts, Telemetry &telemetry)
+{
+	// Everything but data pkts goes over the first radio
+	Transport &radio = *radios[0];
+	radio.openWritingPipe(addresses[1]);
+	radio.openReadingPipe(1,addresses[0]);
+	radio.stopListening();
+	for(size_t i = 1; i < radios.size(); i++)
+	{
+		radios[i]->openWritingPipe(addresses[1]);
+		radios[i]->stopListening();
+	}
+	// A dozen receivers can't all ACK the same pkt
+	for(size_t i = 0; i < radios.size() && opts.multicast > 0; i++)
+		radios[i]->setAutoAck(false);
+
+	// What goes out may be the changes from the receiver's copy, compressed
+	telemetry.phase(opts.delta ? "delta" : "prepare");
+	char delta_name[] = "/tmp/rf24_transfer.XXXXXX";
+	bool delta = opts.delta && delta_file(radio, filename, frame_payload_bytes(opts.check), delta_name);
+	const char *send_name = delta ? delta_name : filename;
+	char packed_name[] = "/tmp/rf24_transfer.XXXXXX";
+	bool compressed = opts.compress_level > 0 && compress_file(send_name, opts.compress_level, frame_payload_bytes(opts.check), packed_name);
+
+	// Open the file
+	FileSource source;
+	bool opened = source.open(compressed ? packed_name : send_name, frame_payload_bytes(opts.check));
+	// The source keeps it open, so the temporary files can go now
+	if(compressed)
+		unlink(packed_name);
+	if(delta)
+		unlink(delta_name);
+	if(opened == false)
+	{
+		cout << "Could not open the file.\n";
+		return 6;
+	}
+
+	// Send the very first packet with the filesize:
+	uint8_t first[32];
+	memset(&first, '\0', sizeof(first));
+	first[1] = '1';
+	uint64_t filesize = source.size();
+	if(filesize == 0)
+	{
+		cout << "Error: Will not transmit an empty file!\n";
+		return 6;
+	}
+	uint32_t seg_len = segment_length(opts);
+	uint64_t num_segments = (source.num_chunks() + seg_len - 1) / seg_len;
+	if(filesize >> 48 != 0 || source.num_chunks() > 0xffffffff)
+	{
+		cout << "Error: The file is too big.\n";
+		return 6;
+	}
+	memcpy(first+2, &filesize, 4);
+	first[6] = flag_compact_re_tx;
+	if(opts.window_size > 0)
+		first[6] |= flag_window;
+	if(opts.fec_k > 0)
+	{
+		first[6] |= flag_fec;
+		first[7] = opts.fec_k;
+		first[8] = opts.fec_r;
+	}
+	first[9] = opts.check;
+	uint64_t digest;
+	if(file_digest(filename, &digest))
+	{
+		// The digest is how the receiver knows it's the same file. Resuming
+		// asks the receiver where it's at, which only works with one.
+		first[6] |= flag_digest;
+		if(opts.multicast == 0)
+			first[6] |= flag_resume;
+		memcpy(first+10, &digest, 8);
+	}
+	uint64_t original_size = getFilesize(filename);
+	if(compressed)
+		first[6] |= flag_compressed;
+	if(delta)
+		first[28] |= flag2_delta;
+	if(opts.multicast > 0)
+		first[28] |= flag2_multicast;
+	if(opts.ack_reports)
+		first[28] |= flag2_ack_reports;
+	if(compressed || delta)
+		memcpy(first+18, &original_size, 4);
+	if(num_segments > 1)
+	{
+		// Older receivers only know 32 bit sizes and one segment, so they
+		// only get what they can handle
+		first[6] |= flag_segments;
+		uint16_t seg_len16 = seg_len;
+		uint16_t size_high = filesize >> 32;
+		uint16_t original_high = original_size >> 32;
+		memcpy(first+22, &seg_len16, 2);
+		memcpy(first+24, &size_high, 2);
+		memcpy(first+26, &original_high, 2);
+	}
+	first[6] |= flag_sealed;
+	seal_frame(first, check_crc16, first_pkt_seal);
+	telemetry.phase("connect");
+	cout << "Attempting to establish connection...";
+	cout.flush();
+	if(opts.multicast > 0)
+	{
+		// Anyone who misses it says so when they're polled, see end_segment_multicast
+		multicast_broadcast(radio, first);
+		printf("Sending to %d receivers at once.\n", opts.multicast);
+	}
+	while(interrupt_flag == 0 && opts.multicast == 0)
+	{
+		if(write_frame(radio, first) == false)
+		{
+			if(hide!=1) cout << "Sending first packet failed.\n";
+		}
+		else break;
+	}
+	if(interrupt_flag == 0)
+	{
+		cout << "Success!\n";
+	}
+	else
+	{
+		cout << "Attempt to establish a connection was canceled by the user.\n";
+		return 6;
+	}
+
+	printf("Filesize: %llu\n", (unsigned long long)filesize);
+	printf("Total Number of Packets: %llu\n", (unsigned long long)source.num_chunks());
+	if(num_segments > 1)
+		printf("Sending it in %llu segments of %u packets.\n", (unsigned long long)num_segments, seg_len);
+
+	// Everything before resume_seg, and resume_have pkts of it, made it last time
+	uint32_t resume_seg = 0, resume_have = 0;
+	if((first[6] & flag_resume) && poll_resume(radio, &resume_seg, &resume_have) &&
+		resume_seg < num_segments && (resume_seg > 0 || resume_have > 0))
+	{
+		uint64_t have = (uint64_t)resume_seg * seg_len + resume_have;
+		printf("Receiver already has %llu of the packets, only sending the rest.\n", (unsigned long long)have);
+	}
+	else
+	{
+		resume_seg = 0;
+		resume_have = 0;
+	}
+
+	// The receiver turned them on when it got the first packet
+	if(opts.ack_reports)
+		radio.enableAckPayload();
+
+	// Start off on the quietest channel, then see what it can take
+	LinkController link_ctl;
+	if(opts.adaptive)
+	{
+		telemetry.phase("scan");
+		LinkSettings start = { opts.channel, radio_data_rate, 1, 1 };
+		uint8_t quietest = scan_channels(radio, start.channel);
+		link_ctl.verbose = hide != 1;
+		link_ctl.start(start, frame_payload_bytes(opts.check), opts.ack_reports);
+		if(quietest != start.channel)
+		{
+			LinkSettings to = start;
+			to.channel = quietest;
+			change_link(radio, link_ctl, to);
+		}
+	}
+
+	cout << "Beginning Transmission.\n";
+	uint32_t tx_ms = 0;
+	uint64_t num_sent = 0;
+	int receiver_status = 1;
+	// How each receiver of a multicast is doing, from 1
+	vector<int> node_states(opts.multicast + 1, mc_missing);
+	size_t bitmap_bytes = 0; // What keeping track of a segment's pkts takes, the most of any
+	for(uint32_t seg = resume_seg; seg < num_segments && interrupt_flag == 0 && receiver_status == 1; seg++)
+	{
+		source.select(seg, seg_len);
+		uint16_t total_num_pkts = source.segment_chunks();
+		// The receiver is already on the segment we're resuming
+		if(seg > resume_seg && opts.multicast > 0)
+		{
+			uint8_t pkt[32];
+			memset(&pkt, '\0', sizeof(pkt));
+			pkt[2] = '6';
+			memcpy(pkt+3, &seg, 4);
+			multicast_broadcast(radio, pkt);
+			for(size_t node = 1; node < node_states.size(); node++)
+			{
+				if(node_states[node] == mc_segment_done)
+					node_states[node] = mc_missing;
+			}
+		}
+		else if(seg > resume_seg)
+		{
+			if(send_segment_start(radio, seg) == false)
+			{
+				receiver_status = 2;
+				break;
+			}
+			if(hide!=1) printf("Segment %u, %d packets.\n", seg, total_num_pkts);
+		}
+
+		// Part way through a segment, the receiver's retransmit requests are
+		// exactly the pkts it's missing
+		ChunkBitmap reported;
+		reported.resize(total_num_pkts);
+		if(reported.bytes() > bitmap_bytes)
+			bitmap_bytes = reported.bytes();
+		if(seg != resume_seg || resume_have == 0)
+		{
+			telemetry.phase("data");
+			uint32_t tx_start = millis();
+			if(opts.window_size > 0)
+			{
+				send_window(radio, source, total_num_pkts, opts.window_size, opts.check);
+			}
+			else
+			{
+				send_data(radios, source, total_num_pkts, opts, reported, link_ctl);
+			}
+			tx_ms += millis() - tx_start;
+			num_sent += total_num_pkts;
+		}
+
+		telemetry.phase("retransmit");
+		if(interrupt_flag == 0 && opts.multicast > 0)
+			receiver_status = end_segment_multicast(radio, source, opts, first, node_states);
+		else if(interrupt_flag == 0 && opts.ack_reports)
+			receiver_status = end_segment_ack_reports(radio, source, opts, reported);
+		else if(interrupt_flag == 0)
+			receiver_status = end_segment(radio, source, opts.check);
+	}
+	printf("Data phase took %u ms, %.0f pkts/sec.\n", tx_ms, tx_ms ? num_sent * 1000.0 / tx_ms : 0.0);
+	link_ctl.print_stats();
+	telemetry.note("segments", to_string(num_segments));
+	telemetry.note("segment_bitmap_bytes", to_string(bitmap_bytes));
+
+	if(interrupt_flag ==1)
+	{
+		// Send the very last packet:
+		uint8_t last[32];
+		memset(&last, '\0', sizeof(last));
+		last[2] = '8';
+		if(opts.multicast > 0)
+			multicast_broadcast(radio, last);
+		else
+			write_frame(radio, last);
+		telemetry.end(0);
+		telemetry.print_summary();
+		cout << "File transfer was canceled by user.\n";
+	}
+	else
+	{
+		if(opts.multicast > 0)
+		{
+			// Let the receivers that are done go
+			uint8_t done[32];
+			memset(&done, '\0', sizeof(done));
+			done[2] = '3';
+			multicast_broadcast(radio, done);
+
+			int num_ok = 0, num_bad = 0;
+			for(size_t node = 1; node < node_states.size(); node++)
+			{
+				num_ok += node_states[node] == mc_file_ok;
+				num_bad += node_states[node] == mc_file_bad;
+			}
+			printf("%d of %d receivers got the file, %d got it damaged and %d stopped answering.\n",
+				num_ok, opts.multicast, num_bad, opts.multicast - num_ok - num_bad);
+			receiver_status = num_bad > 0 ? 3 : num_ok == opts.multicast ? 1 : 2;
+		}
+		telemetry.end(receiver_status == 1 ? original_size : 0);
+		telemetry.print_summary();
+		if(receiver_status == 1)
+		{
+			cout << "File transfer looks successful!\n";
+		}
+		else if(receiver_status == 3)
+		{
+			cout << "Receiver says the file it got doesn't match what was sent.\n";
+			sleep(1);
+			return 6;
+		}
+		else
+		{
+			cout << "File transfer may not have completed.\n";
+		}
+		sleep(1);
+	}
+	return interrupt_flag == 0 ? 0 : 6;
+}
+
+/**********/
+/* STREAM */
+/**********/
+
+/*
+ * Read samples a line at a time from fd until it runs out or we're
+ * interrupted. A line that says when it was taken keeps its spacing from
+ * the others, moved onto our clock by the least any of them so far took
+ * to get here. That's worked out over everything a read() brings before
+ * any of it is stamped, so a whole batch keeps its spacing, and none of
+ * it is stamped after it came in. No line goes back before the one before
+ * it, so input that comes faster than it was taken (a recorded file, say)
+ * bunches up. Anything else is stamped with when it came in. Samples the
+ * ring has no room for are counted and thrown away, so the newest keep
+ * coming.
+ */
+void read_stream_input(int fd, SpscRing<StreamSample> &ring, uint64_t start_us, atomic<bool> &done,
+	atomic<unsigned long> &num_samples, atomic<unsigned long> &num_overflowed)
+{
+	char buf[4096];
+	string line;
+	struct pollfd p = { fd, POLLIN, 0 };
+	bool lined_up = false;
+	int64_t offset = 0; // From the input's times to ours, the least any line took
+	uint64_t last_t = 0; // No sample goes back before this one
+	vector<StreamSample> got;
+	vector<bool> got_timed;
+	while(interrupt_flag == 0)
+	{
+		// Don't block for good, Ctrl-c has to get through
+		if(poll(&p, 1, 100) <= 0)
+			continue;
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if(n <= 0)
+			break;
+		// Every line in buf came in now
+		uint64_t now = now_us() - start_us;
+		got.clear();
+		got_timed.clear();
+		for(ssize_t i = 0; i < n; i++)
+		{
+			if(buf[i] != '\n')
+			{
+				line += buf[i];
+				continue;
+			}
+			StreamSample s;
+			bool timed;
+			if(parse_stream_sample(line.c_str(), s, &timed) > 0)
+			{
+				if(timed)
+				{
+					int64_t took = (int64_t)(now - s.t_us);
+					if(lined_up == false || took < offset)
+						offset = took;
+					lined_up = true;
+				}
+				got.push_back(s);
+				got_timed.push_back(timed);
+			}
+			line.clear();
+		}
+		for(size_t i = 0; i < got.size(); i++)
+		{
+			StreamSample &s = got[i];
+			int64_t t = got_timed[i] ? (int64_t)s.t_us + offset : (int64_t)(now_us() - start_us);
+			s.t_us = t < (int64_t)last_t ? last_t : t;
+			last_t = s.t_us;
+			num_samples++;
+			if(ring.push(s) == false)
+				num_overflowed++;
+		}
+	}
+	done = true;
+}
+
+/* A stream frame waiting on the radio */
+struct stream_tx_frame
+{
+	uint8_t frame[32];
+	uint64_t first_us; // When its first sample was taken
+	int samples;
+	int sample_bytes;
+};
+
+/*
+ * Send samples from filename ("-" for stdin) as they come in, see stream.h.
+ * A thread reads them into a ring, and this one packs them into frames and
+ * keeps the radio busy with them. A frame goes out once it's full or its
+ * first sample has waited flush_ms. Full frames wait in a short queue
+ * while the radio's busy. With a max age, any frame older than that is
+ * dropped instead of sent; without, they wait, and once the queue is full
+ * the ring fills up behind it.
+ */
+int run_stream_transmitter(const vector<Transport*> &radios, const char *filename, const tx_options &opts, Telemetry &telemetry)
+{
+	Transport &radio = *radios[0];
+	radio.openWritingPipe(addresses[1]);
+	radio.openReadingPipe(1,addresses[0]);
+	radio.stopListening();
+
+	int fd = strcmp(filename, "-") == 0 ? 0 : open(filename, O_RDONLY);
+	if(fd < 0)
+	{
+		cout << "Could not open the file.\n";
+		return 6;
+	}
+
+	SpscRing<StreamSample> samples(stream_ring_samples);
+	atomic<bool> input_done(false);
+	atomic<unsigned long> num_samples(0), num_overflowed(0);
+	uint64_t start_us = now_us();
+	thread reader(read_stream_input, fd, ref(samples), start_us, ref(input_done), ref(num_samples), ref(num_overflowed));
+
+	telemetry.phase("stream");
+	cout << "Streaming, frames go out every " << opts.stream_flush_ms << " ms or when they're full.\n";
+	StreamPacker packer;
+	deque<stream_tx_frame> queue;
+	StreamSample next;
+	bool have_next = false; // Popped, but didn't fit in the last frame
+	uint16_t seq = 0;
+	unsigned long num_frames = 0, num_sent = 0, num_stale = 0, stale_samples = 0;
+	uint64_t sent_bytes = 0;
+	Histogram latency_us; // From a frame's first sample being taken to its ACK
+	uint64_t flush_us = (uint64_t)opts.stream_flush_ms * 1000, max_age_us = (uint64_t)opts.stream_max_age_ms * 1000;
+
+	auto queue_frame = [&]() {
+		stream_tx_frame f;
+		f.first_us = packer.first_us();
+		f.samples = packer.size();
+		f.sample_bytes = packer.sample_bytes();
+		seq = next_stream_seq(seq);
+		memcpy(f.frame, packer.take(seq), 32);
+		queue.push_back(f);
+		num_frames++;
+	};
+
+	while(interrupt_flag == 0)
+	{
+		// Pack everything that's come in, as long as there's room to queue it
+		while(queue.size() < stream_queue_frames && (have_next || samples.pop(next)))
+		{
+			have_next = packer.add(next) == false;
+			if(have_next && packer.empty())
+				have_next = false; // It won't ever fit
+			else if(have_next)
+				queue_frame();
+		}
+		// Done first: once it is, everything it read is in the ring
+		bool input_over = input_done && samples.empty() && have_next == false;
+		uint64_t now = now_us() - start_us;
+		if(packer.empty() == false && queue.size() < stream_queue_frames && (input_over || now - packer.first_us() >= flush_us))
+			queue_frame();
+		if(queue.empty())
+		{
+			if(input_over)
+				break;
+			usleep(100);
+			continue;
+		}
+
+		stream_tx_frame &f = queue.front();
+		if(max_age_us > 0 && now - f.first_us > max_age_us)
+		{
+			if(hide!=1) printf("Frame %u is %llu ms old, dropping it.\n", stream_frame::id(f.frame), (unsigned long long)(now - f.first_us) / 1000);
+			num_stale++;
+			stale_samples += f.samples;
+			queue.pop_front();
+		}
+		else if(write_frame(radio, f.frame, stream_frame::check_bytes))
+		{
+			latency_us.add(now_us() - start_us - f.first_us);
+			num_sent++;
+			sent_bytes += f.sample_bytes;
+			queue.pop_front();
+		}
+	}
+	reader.join();
+	if(fd != 0)
+		close(fd);
+
+	// '\0' '\0' 'E' and the last seq, so the receiver knows what it missed at the end
+	uint8_t end[32];
+	memset(&end, '\0', sizeof(end));
+	end[2] = stream_end;
+	memcpy(end+3, &seq, 2);
+	uint32_t end_start = millis();
+	while(write_frame(radio, end) == false && millis() - end_start < stream_end_ms);
+
+	telemetry.note("samples", to_string(num_samples));
+	telemetry.note("samples_overflowed", to_string(num_overflowed));
+	telemetry.note("frames", to_string(num_frames));
+	telemetry.note("frames_stale", to_string(num_stale));
+	telemetry.note("latency_mean_us", to_string((uint64_t)latency_us.mean()));
+	telemetry.note("latency_p99_us", to_string(latency_us.percentile(0.99)));
+	telemetry.note("latency_max_us", to_string(latency_us.max()));
+	telemetry.end(sent_bytes);
+	telemetry.print_summary();
+	printf("Stream: %lu samples in %lu frames, %lu frames sent, %lu (%lu samples) too old to send, %lu samples the ring had no room for.\n",
+		(unsigned long)num_samples, num_frames, num_sent, num_stale, stale_samples, (unsigned long)num_overflowed);
+	printf("Sample to ACK: %.1f ms on average, 99%% within %.1f ms, %.1f ms at most.\n",
+		latency_us.mean() / 1000.0, latency_us.percentile(0.99) / 1000.0, latency_us.max() / 1000.0);
+	return interrupt_flag == 0 ? 0 : 6;
+}
+
+/*
+ * Write the samples in a stream to filename ("-" for stdout) as a time
+ * series, a line each, until the transmitter says it's done. A blank line
+ * goes where frames went missing, which gnuplot and friends take as a
+ * break in the line. Every frame's samples are flushed as they come in,
+ * for anything plotting them live.
+ */
+int run_stream_receiver(const vector<Transport*> &radios, const char *filename, Telemetry &telemetry)
+{
+	StripedRx radio(radios, rx_ring_frames);
+	if(dynamic_payloads)
+		radio.enableDynamicPayloads();
+
+	bool to_stdout = strcmp(filename, "-") == 0;
+	FILE *out = to_stdout ? stdout : fopen(filename, "w");
+	if(out == NULL)
+	{
+		cout << "Something weird happened trying to write to the file\n";
+		perror("The following error occurred: ");
+		return 6;
+	}
+	// Keep what we've got to say out of the samples
+	FILE *status = to_stdout ? stderr : stdout;
+
+	radio.openWritingPipe(addresses[0]);
+	radio.openReadingPipe(1,addresses[1]);
+	radio.startListening();
+
+	telemetry.phase("stream");
+	fprintf(status, "Waiting for a stream.\n");
+	StreamUnpacker unpacker;
+	StreamSample samples[max_stream_samples];
+	unsigned long num_samples = 0;
+	uint64_t sample_bytes = 0;
+	bool ended = false;
+	while(interrupt_flag == 0 && ended == false)
+	{
+		if(radio.available() == false)
+			continue;
+		uint8_t data[32];
+		uint8_t len = read_frame(radio, data);
+		if(len == 0)
+			continue;
+		// No frame has seq 0
+		if(data[0] == '\0' && data[1] == '\0')
+		{
+			if(data[2] == stream_end)
+			{
+				uint16_t last_seq;
+				memcpy(&last_seq, data+3, 2);
+				unpacker.finish(last_seq);
+				ended = true;
+			}
+			else
+				telemetry.count(Telemetry::ignored);
+			continue;
+		}
+		stream_frame::unpack(data, len);
+		if(stream_frame::ok(data, 0) == false)
+		{
+			telemetry.count(Telemetry::checksum_failures);
+			continue;
+		}
+		bool gap;
+		int n = unpacker.unpack(data, samples, &gap);
+		if(n < 0)
+		{
+			telemetry.count(Telemetry::duplicates);
+			continue;
+		}
+		if(unpacker.frames() == 1)
+			fprintf(status, "Stream beginning.\n");
+		telemetry.count(Telemetry::data_pkts);
+		if(gap && unpacker.frames() > 1)
+			fprintf(out, "\n");
+		for(int i = 0; i < n; i++)
+		{
+			print_stream_sample(out, samples[i]);
+			sample_bytes += 2 * samples[i].channels;
+		}
+		num_samples += n;
+		fflush(out);
+	}
+	if(to_stdout == false)
+		fclose(out);
+
+	telemetry.note("samples", to_string(num_samples));
+	telemetry.note("frames_lost", to_string(unpacker.lost()));
+	telemetry.note("restarts", to_string(unpacker.restarts()));
+	telemetry.end(sample_bytes);
+	fprintf(status, "Stream %s: %lu samples in %lu frames, %lu frames lost, %lu repeats.\n", ended ? "ended" : "interrupted",
+		num_samples, unpacker.frames(), unpacker.lost(), unpacker.duplicates());
+	return interrupt_flag == 0 ? 0 : 6;
+}
+
+/*
+ * Run both ends of a transfer in this process over the lossy channel
+ * emulator, with the receiver on its own thread. A multicast goes to a
+ * receiver thread each, writing to dst.1, dst.2 and so on.
+ */
+int run_simulation(const SimConfig &sim_cfg, const vector<radio_spec> &specs, const char *src, const char *dst,
+	const tx_options &opts, bool hide_progress_bar, const char *telemetry_path, const string &args)
+{
+	SimMedium medium(sim_cfg);
+	int num_receivers = opts.multicast > 0 ? opts.multicast : 1;
+	// Every end keeps its own telemetry, and they all go in the one file
+	vector<unique_ptr<Telemetry> > telemetry;
+	for(int end = 0; end <= num_receivers; end++)
+	{
+		string role = end == 0 ? "transmitter" : opts.multicast > 0 ? "receiver " + to_string(end) : "receiver";
+		telemetry.push_back(unique_ptr<Telemetry>(new Telemetry(role.c_str())));
+		telemetry.back()->note("args", args);
+	}
+	// A radio per channel at each end
+	vector<unique_ptr<SimRadio> > sim_radios;
+	vector<unique_ptr<MeteredTransport> > metered;
+	vector<vector<Transport*> > radios(num_receivers + 1);
+	for(int end = 0; end <= num_receivers; end++)
+	{
+		vector<Transport*> raw;
+		for(size_t i = 0; i < specs.size(); i++)
+		{
+			sim_radios.push_back(unique_ptr<SimRadio>(new SimRadio(medium)));
+			setup_radio(*sim_radios.back(), specs[i].channel);
+			raw.push_back(sim_radios.back().get());
+		}
+		radios[end] = meter_radios(raw, *telemetry[end], metered);
+	}
+
+	vector<int> rx_results(num_receivers + 1);
+	vector<string> dst_names(num_receivers + 1, dst);
+	vector<thread> receivers;
+	uint32_t start = millis();
+	for(int node = 1; node <= num_receivers; node++)
+	{
+		if(opts.multicast > 0)
+			dst_names[node] += "." + to_string(node);
+		receivers.push_back(thread([&, node]() {
+			if(opts.stream_flush_ms > 0)
+				rx_results[node] = run_stream_receiver(radios[node], dst_names[node].c_str(), *telemetry[node]);
+			else
+				rx_results[node] = run_receiver(radios[node], dst_names[node].c_str(), false, hide_progress_bar, opts.multicast > 0 ? node : 0,
+					*telemetry[node]);
+		}));
+	}
+	int tx_result = opts.stream_flush_ms > 0 ? run_stream_transmitter(radios[0], src, opts, *telemetry[0]) :
+		run_transmitter(radios[0], src, opts, *telemetry[0]);
+	// If the transmitter gave up, don't leave the receivers waiting for it
+	if(tx_result != 0)
+		interrupt_flag = 1;
+	int rx_result = 0;
+	for(int node = 1; node <= num_receivers; node++)
+	{
+		receivers[node - 1].join();
+		if(rx_results[node] != 0)
+			rx_result = rx_results[node];
+	}
+	uint32_t elapsed = (transfer_done_ms != 0 ? transfer_done_ms : millis()) - start;
+
+	medium.print_stats();
+	print_frame_stats();
+	// A stream has no size, the transmitter's summary says what went over
+	if(opts.stream_flush_ms == 0)
+	{
+		size_t filesize = getFilesize(src);
+		printf("Sim transfer: %zu bytes in %u ms, %.0f bytes/sec\n", filesize, elapsed, elapsed ? filesize * 1000.0 / elapsed : 0.0);
+	}
+	vector<const Telemetry*> ends;
+	for(size_t i = 0; i < telemetry.size(); i++)
+		ends.push_back(telemetry[i].get());
+	export_telemetry(telemetry_path, ends);
+
+	for(size_t i = 0; i < sim_radios.size(); i++)
+		sim_radios[i]->powerDown();
+	return tx_result != 0 ? tx_result : rx_result;
+}
+
+int main(int argc, char** argv)
+{
+	signal(SIGINT, interrupt_handler); // Ctrl-c interrupt handler
+	char *src_filename = NULL;
+	char *dst_filename = NULL;
+
+	bool measure = false;
+	bool hide_progress_bar = false;
+
+	bool simulate = false;
+	SimConfig sim_cfg;
+	tx_options opts;
+	const char *telemetry_path = NULL;
+	// How it was run, to go with the telemetry
+	string args = argv[0];
+	for(int i = 1; i < argc; i++)
+		args += string(" ") + argv[i];
+	vector<radio_spec> radio_specs(1);
+	int multicast = 0; // Receivers with -s, which one this is with -d
+	bool stream = false;
+
+	int c;
+	while ((c = getopt (argc, argv, "s:d:nmhDL:w:bf:c:z:ur:M:aFAT:S:")) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+				hide = 0;
+				break;
+			case 'h':
+				cout << "This is a simple wireless file transfer utility built for the nRF24 radio family!\n";
+				cout << "It's built using TMRh20's C++ RF24 library, which can be found on Github:\n";
+				cout << "https://github.com/nRF24/RF24";
+				cout << "\n";
+				cout << "Usage:\n";
+				cout << "-h: Show this help text.\n";
+				cout << "-s: The source file. Use this on the transmitter.\n";
+				cout << "-d: The destination file. Use this on the receiver. An existing file is kept until the transfer starts,\n";
+				cout << "    for the transmitter to send only what changed from it (-u) or to carry on an interrupted transfer\n";
+				cout << "    (see [destination].journal). Otherwise it's overwritten.\n";
+				cout << "-D: Show a bunch of debug messages. \n";
+				cout << "-n: Hide the progress bar on the receiver. Use when measuring, if you like.\n";
+				cout << "-m: Measure the successfull data reception rate. Doesn't count packets where checksums don't match\n";
+				cout << "-T: Write this end's telemetry to a file at the end, as CSV if its name ends in .csv or JSON otherwise:\n";
+				cout << "    how long writes took and how many retries, checksum failures, duplicates, time per phase, goodput.\n";
+				cout << "-w: Transmitter only. Selective repeat with a window of this many packets (max 209).\n";
+				cout << "    The receiver reports gaps as it goes instead of waiting for the end.\n";
+				cout << "-b: Transmitter only. Burst mode, keeps the radio's TX FIFO full instead of waiting for each ACK.\n";
+				cout << "-f: Transmitter only. Forward error correction, e.g. -f 32/4 follows every 32 data packets with 4 repair\n";
+				cout << "    packets, so the receiver can rebuild up to 4 lost packets per block without asking for them.\n";
+				cout << "-c: Transmitter only. How each packet is checked: fletcher, crc16 (default) or crc32c. The CRCs\n";
+				cout << "    also cover the packet id, and cost 1 or 3 bytes of payload more than fletcher.\n";
+				cout << "-z: Transmitter only. Compress the file before sending it, at a level from 1 (fastest) to 9 (smallest).\n";
+				cout << "-u: Transmitter only. Update the receiver's copy of the file, sending only what changed.\n";
+				cout << "-a: Transmitter only. The receiver reports what it's missing in its ACKs, so nobody has to stop\n";
+				cout << "    and listen for retransmit requests.\n";
+				cout << "-A: Transmitter only. Move to the quietest channel first, then keep changing the data rate and\n";
+				cout << "    retries (and channel, if it goes bad) to whatever gets the most through. The receiver follows.\n";
+				cout << "-F: Pad every frame out to the full 32 bytes, instead of sending only what's in it. Use the same on\n";
+				cout << "    both ends, and to talk to builds from before frames were shortened.\n";
+				cout << "-S: Stream samples instead of sending a file, use on both ends. The transmitter reads lines of numbers\n";
+				cout << "    from -s (- for stdin) as they come, e.g. from read_ads, optionally led by the time they were taken in\n";
+				cout << "    seconds (12.345678). The receiver writes them to -d (- for stdout) with a timestamp each. -S 20\n";
+				cout << "    sends whatever's come in every 20 ms, -S 20/500 also gives up on samples the radio couldn't get\n";
+				cout << "    through in 500 ms.\n";
+				cout << "-r: Stripe data over several radios, each on its own channel, as channel[:ce:cs[:irq]],...\n";
+				cout << "    e.g. -r 110,90:23:1 adds a second radio with CE on GPIO 23 and CSN on CE1. Use the same on both ends.\n";
+				cout << "-M: Multicast. With -s, send to this many receivers at once (max " << max_multicast_nodes << "). With -d, this receiver's\n";
+				cout << "    number, from 1 up to that many. Every receiver needs a different one.\n";
+				cout << "-L: Don't use the radio. Send -s to -d over a simulated lossy link, e.g. -L loss=0.05,rate=1M\n";
+				cout << "    Options: rate=250K|1M|2M loss=P ge=PGB/PBG[/LB[/LG]] corrupt=P busy=CH/P rateloss=L2M/L1M/L250K\n";
+				cout << "    fifo=N seed=N speed=X\n";
+				cout << "\n";
+				cout << "Examples:\n";
+				cout << "sudo ./rf24_transfer -s ModernMajorGeneral.txt \n";
+				cout << "sudo ./rf24_transfer -d ModernMajorGeneral-recv.txt \n";
+				cout << "./rf24_transfer -L ge=0.01/0.3 -s ModernMajorGeneral.txt -d ModernMajorGeneral-recv.txt \n";
+				cout << "./read_ads | sudo ./rf24_transfer -S 20/500 -s - \n";
+				break;	
+			case 's': // Specify source file
+				src_filename = optarg;
+				break;
+			case 'd': // Specify destination file
+				dst_filename = optarg;
+				break;
+			case 'm': // Measure data reception rate
+				measure = true;
+				cout << "Measuring!\n";
+				break;
+			case 'n': // Hide the progress bar
+				hide_progress_bar = true;
+				cout << "Hiding progress bar!\n";
+				break;
+			case 'w': // Selective repeat window
+				opts.window_size = atoi(optarg);
+				if(opts.window_size < 1 || opts.window_size > max_window_size)
+				{
+					cout << "ERROR: The window must be between 1 and " << max_window_size << " packets.\n";
+					return 6;
+				}
+				break;
+			case 'b': // Burst mode
+				opts.burst = true;
+				break;
+			case 'f': // Forward error correction
+				if(sscanf(optarg, "%d/%d", &opts.fec_k, &opts.fec_r) != 2 || opts.fec_k < 1 || opts.fec_r < 1 || opts.fec_k + opts.fec_r > 256)
+				{
+					cout << "ERROR: FEC is given as data/repair packets per block, e.g. 32/4, with no more than 256 in all.\n";
+					return 6;
+				}
+				break;
+			case 'c': // Frame check
+				if(strcmp(optarg, "fletcher") == 0)
+					opts.check = check_fletcher_8;
+				else if(strcmp(optarg, "crc16") == 0)
+					opts.check = check_crc16;
+				else if(strcmp(optarg, "crc32c") == 0)
+					opts.check = check_crc32c;
+				else
+				{
+					cout << "ERROR: The frame check must be fletcher, crc16 or crc32c.\n";
+					return 6;
+				}
+				break;
+			case 'z': // Compression
+				opts.compress_level = atoi(optarg);
+				if(opts.compress_level < 1 || opts.compress_level > lz_max_level)
+				{
+					cout << "ERROR: The compression level must be between 1 and " << lz_max_level << ".\n";
+					return 6;
+				}
+				break;
+			case 'u': // Delta against the receiver's copy
+				opts.delta = true;
+				break;
+			case 'a': // Loss reports in ACK payloads
+				opts.ack_reports = true;
+				break;
+			case 'T': // Telemetry export
+				telemetry_path = optarg;
+				break;
+			case 'A': // Adaptive link control
+				opts.adaptive = true;
+				break;
+			case 'F': // Fixed size frames
+				dynamic_payloads = false;
+				break;
+			case 'r': // Radios to stripe over
+				if(parse_radio_specs(optarg, radio_specs) == false)
+					return 6;
+				break;
+			case 'M': // Multicast
+				multicast = atoi(optarg);
+				if(multicast < 1 || multicast > max_multicast_nodes)
+				{
+					cout << "ERROR: -M takes a number from 1 to " << max_multicast_nodes << ".\n";
+					return 6;
+				}
+				break;
+			case 'S': // Stream
+				stream = true;
+				if(sscanf(optarg, "%d/%d", &opts.stream_flush_ms, &opts.stream_max_age_ms) < 1 || opts.stream_flush_ms < 1 ||
+					opts.stream_max_age_ms < 0)
+				{
+					cout << "ERROR: -S is how long samples can wait to be sent in ms, then optionally how long to keep trying, e.g. 20/500.\n";
+					return 6;
+				}
+				break;
+			case 'L': // Simulated link
+				if(parse_sim_spec(optarg, sim_cfg) == false)
+					return 6;
+				simulate = true;
+				break;
+			case '?':
+				fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+				return 6;
+		}
+
+		/* for (int index = optind; index < argc; index++)
+		{
+			printf ("Non-option argument %s\n", argv[index]);
+		} */
+	}
+
+	if(opts.burst && opts.window_size > 0)
+	{
+		cout << "ERROR: Burst mode and selective repeat (-w) can't be used together.\n";
+		return 6;
+	}
+	if(opts.fec_k > 0 && opts.window_size > 0)
+	{
+		cout << "ERROR: FEC and selective repeat (-w) can't be used together.\n";
+		return 6;
+	}
+
+	// The transmitter takes -M as how many receivers there are, the receiver as which one it is
+	if(src_filename != NULL)
+		opts.multicast = multicast;
+	if(opts.multicast > 0 && (opts.window_size > 0 || opts.delta))
+	{
+		cout << "ERROR: Selective repeat (-w) and delta updates (-u) need replies from a single receiver, they don't work with -M.\n";
+		return 6;
+	}
+	if(opts.multicast > 0 && opts.check == check_fletcher_8)
+	{
+		cout << "ERROR: Multicast needs a CRC frame check (-c crc16 or crc32c), fletcher can't tell segments apart.\n";
+		return 6;
+	}
+	if(opts.ack_reports && (opts.window_size > 0 || opts.multicast > 0))
+	{
+		cout << "ERROR: Loss reports on ACKs (-a) don't go with selective repeat (-w) or multicast (-M), which have their own.\n";
+		return 6;
+	}
+	if(opts.ack_reports && dynamic_payloads == false)
+	{
+		cout << "ERROR: Loss reports on ACKs (-a) need dynamic payloads, they don't go with -F.\n";
+		return 6;
+	}
+	if(opts.window_size > 0 && radio_specs.size() > 1)
+	{
+		cout << "ERROR: Selective repeat (-w) only works over one radio.\n";
+		return 6;
+	}
+	if(opts.adaptive && (opts.window_size > 0 || opts.burst || opts.multicast > 0 || radio_specs.size() > 1))
+	{
+		cout << "ERROR: Link control (-A) goes by every write's ACK to one receiver over one radio, it doesn't work with -w, -b, -M or -r.\n";
+		return 6;
+	}
+	if(stream && (opts.window_size > 0 || opts.burst || opts.fec_k > 0 || opts.compress_level > 0 || opts.delta || multicast > 0 ||
+		opts.ack_reports || opts.adaptive || radio_specs.size() > 1))
+	{
+		cout << "ERROR: A stream (-S) goes to one receiver over one radio, it doesn't work with -w, -b, -f, -z, -u, -M, -a, -A or -r.\n";
+		return 6;
+	}
+	opts.channel = radio_specs[0].channel;
+
+	if(simulate == true)
+	{
+		if(src_filename == NULL || dst_filename == NULL)
+		{
+			cout << "ERROR: A simulated transfer needs both -s [source file] and -d [dest file]\n";
+			return 6;
+		}
+		return run_simulation(sim_cfg, radio_specs, src_filename, dst_filename, opts, hide_progress_bar, telemetry_path, args);
+	}
+
+	if(src_filename != NULL && dst_filename != NULL)
+	{
+		cout << "Cannot be both transmitter and receiver!\n";
+		return 25; 
+	}
+	if (measure == true && src_filename != NULL)
+	{
+		cout << "ERROR: Cannot measure data reception rate from the transmitter.\n";
+		return 6;
+	}
+	
+	// Make sure the user specified a file. 
+	if(src_filename == NULL && dst_filename == NULL)
+	{
+		cout << "ERROR: At least one filename is required as an agrument. Use -s [source file] or -d [dest file]\n";
+		return 6;
+	}
+
+#ifdef SIM_ONLY
+	cout << "ERROR: Built without radio support, use -L to run a simulated transfer.\n";
+	return 6;
+#else
+	vector<unique_ptr<RF24Transport> > hw_radios;
+	vector<Transport*> radios;
+	for(size_t i = 0; i < radio_specs.size(); i++)
+	{
+		const radio_spec &r = radio_specs[i];
+		if(i > 0 && r.ce_pin < 0)
+		{
+			cout << "ERROR: Radio " << i + 1 << " needs its CE and CS pins, e.g. -r 110,90:23:1\n";
+			return 6;
+		}
+		// The radios share the SPI bus, each on its own chip select
+		if(r.ce_pin < 0)
+			hw_radios.push_back(unique_ptr<RF24Transport>(new RF24Transport(RADIO_CE_PIN, RADIO_CS_PIN, RADIO_SPI_SPEED, RADIO_IRQ_PIN)));
+		else
+			hw_radios.push_back(unique_ptr<RF24Transport>(new RF24Transport(r.ce_pin, r.cs_pin, RADIO_SPI_SPEED, r.irq_pin)));
+		setup_radio(*hw_radios.back(), r.channel);
+		radios.push_back(hw_radios.back().get());
+	}
+
+	Telemetry telemetry(dst_filename != NULL ? "receiver" : "transmitter");
+	telemetry.note("args", args);
+	vector<unique_ptr<MeteredTransport> > metered;
+	vector<Transport*> metered_radios = meter_radios(radios, telemetry, metered);
+	int result;
+	if(dst_filename != NULL && stream)
+		result = run_stream_receiver(metered_radios, dst_filename, telemetry);
+	else if(dst_filename != NULL)
+		result = run_receiver(metered_radios, dst_filename, measure, hide_progress_bar, multicast, telemetry);
+	else if(stream)
+		result = run_stream_transmitter(metered_radios, src_filename, opts, telemetry);
+	else
+		result = run_transmitter(metered_radios, src_filename, opts, telemetry);
+	print_frame_stats();
+	export_telemetry(telemetry_path, vector<const Telemetry*>(1, &telemetry));
+
+	for(size_t i = 0; i < radios.size(); i++)
+	{
+		radios[i]->closeReadingPipe(addresses[0]);
+		radios[i]->closeReadingPipe(addresses[1]);
+		radios[i]->powerDown();
+	}
+	return result;
+#endif
 } // main
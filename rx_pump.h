@@ -0,0 +1,232 @@
+/*
+ * Receive side drain thread.
+ *
+ * RxPump wraps another Transport. A background thread sleeps in
+ * waitAvailable() (on the IRQ pin, if the radio has one) and empties the
+ * radio's 3 deep RX FIFO into a much deeper ring as soon as frames show up,
+ * so the protocol code can take its time printing or answering an ending
+ * packet without the radio refusing frames. available() and read() work
+ * from the ring; everything else is passed straight through.
+ *
+ * The radio itself is only ever touched with radio_lock held, since the
+ * protocol thread still writes replies while the drain thread reads.
+ */
+
+#ifndef RX_PUMP_H
+#define RX_PUMP_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "spsc_ring.h"
+#include "transport.h"
+
+class RxPump : public Transport, public CacheAligned
+{
+public:
+	RxPump(Transport &r, size_t ring_frames) : radio(r), ring(ring_frames), running(true), have_frame(false),
+		num_drained(0), max_depth(0), num_ring_full(0)
+	{
+		drain_thread = std::thread(&RxPump::drain, this);
+	}
+
+	~RxPump()
+	{
+		running = false;
+		drain_thread.join();
+	}
+
+	bool begin()
+	{
+		std::lock_guard<std::mutex> l(radio_lock);
+		dynamic = false;
+		return radio.begin();
+	}
+	void powerDown() { std::lock_guard<std::mutex> l(radio_lock); radio.powerDown(); }
+	void printDetails() { std::lock_guard<std::mutex> l(radio_lock); radio.printDetails(); }
+
+	void setChannel(uint8_t channel) { std::lock_guard<std::mutex> l(radio_lock); radio.setChannel(channel); }
+	void setPALevel(uint8_t level) { std::lock_guard<std::mutex> l(radio_lock); radio.setPALevel(level); }
+	bool setDataRate(rf24_datarate_e speed) { std::lock_guard<std::mutex> l(radio_lock); return radio.setDataRate(speed); }
+	void setAutoAck(bool enable) { std::lock_guard<std::mutex> l(radio_lock); radio.setAutoAck(enable); }
+	void setRetries(uint8_t delay, uint8_t count) { std::lock_guard<std::mutex> l(radio_lock); radio.setRetries(delay, count); }
+	void setCRCLength(rf24_crclength_e length) { std::lock_guard<std::mutex> l(radio_lock); radio.setCRCLength(length); }
+
+	void openWritingPipe(uint64_t address) { std::lock_guard<std::mutex> l(radio_lock); radio.openWritingPipe(address); }
+	void openReadingPipe(uint8_t number, uint64_t address) { std::lock_guard<std::mutex> l(radio_lock); radio.openReadingPipe(number, address); }
+	void closeReadingPipe(uint8_t pipe) { std::lock_guard<std::mutex> l(radio_lock); radio.closeReadingPipe(pipe); }
+
+	void startListening() { std::lock_guard<std::mutex> l(radio_lock); radio.startListening(); }
+	void stopListening() { std::lock_guard<std::mutex> l(radio_lock); radio.stopListening(); }
+	uint8_t flush_tx() { std::lock_guard<std::mutex> l(radio_lock); return radio.flush_tx(); }
+
+	uint8_t flush_rx()
+	{
+		uint8_t status;
+		{
+			std::lock_guard<std::mutex> l(radio_lock);
+			status = radio.flush_rx();
+		}
+		Frame f;
+		while(ring.pop(f))
+			;
+		have_frame = false;
+		return status;
+	}
+
+	bool write(const void *buf, uint8_t len) { std::lock_guard<std::mutex> l(radio_lock); return radio.write(buf, len); }
+	bool writeFast(const void *buf, uint8_t len) { std::lock_guard<std::mutex> l(radio_lock); return radio.writeFast(buf, len); }
+	void reUseTX() { std::lock_guard<std::mutex> l(radio_lock); radio.reUseTX(); }
+	bool txStandBy() { std::lock_guard<std::mutex> l(radio_lock); return radio.txStandBy(); }
+	void enableAckPayload()
+	{
+		std::lock_guard<std::mutex> l(radio_lock);
+		radio.enableAckPayload();
+		dynamic = true;
+	}
+	bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len) { std::lock_guard<std::mutex> l(radio_lock); return radio.writeAckPayload(pipe, buf, len); }
+	void enableDynamicPayloads()
+	{
+		std::lock_guard<std::mutex> l(radio_lock);
+		radio.enableDynamicPayloads();
+		dynamic = true;
+	}
+	bool testRPD() { std::lock_guard<std::mutex> l(radio_lock); return radio.testRPD(); }
+	uint8_t getARC() { std::lock_guard<std::mutex> l(radio_lock); return radio.getARC(); }
+	// The drain thread asked the radio when it took the frame off
+	uint8_t getDynamicPayloadSize() { return next.len; }
+
+	/* Waits a little for the drain thread before saying no, so callers can spin on it */
+	bool available()
+	{
+		if(poll())
+			return true;
+		waitAvailable(idle_wait_us);
+		return poll();
+	}
+
+	/* available() without the wait */
+	bool poll()
+	{
+		if(have_frame)
+			return true;
+		if(ring.pop(next))
+			return have_frame = true;
+		return false;
+	}
+
+	void read(void *buf, uint8_t len)
+	{
+		memset(buf, 0, len);
+		if(available() == false)
+			return;
+		memcpy(buf, next.data, len < next.len ? len : next.len);
+		have_frame = false;
+	}
+
+	void waitAvailable(uint32_t timeout_us)
+	{
+		std::unique_lock<std::mutex> l(wake_lock);
+		wake.wait_for(l, std::chrono::microseconds(timeout_us), [this]() { return ring.empty() == false; });
+	}
+
+	unsigned long ring_full() const { return num_ring_full; }
+
+	void print_stats()
+	{
+		printf("RX drain: %lu frames, ring peaked at %zu of %zu, full %lu times\n",
+			(unsigned long)num_drained, (size_t)max_depth, ring.capacity(), (unsigned long)num_ring_full);
+	}
+
+private:
+	struct Frame
+	{
+		uint8_t data[32];
+		uint8_t len;
+	};
+
+	// How long available() waits on an empty ring before giving up
+	static const uint32_t idle_wait_us = 1000;
+	// How long the drain thread sleeps on the radio between checks
+	static const uint32_t drain_wait_us = 5000;
+
+	Transport &radio;
+	std::mutex radio_lock;
+	bool dynamic = false; // Frames are as long as they were sent, only touched with radio_lock held
+	SpscRing<Frame> ring;
+	std::atomic<bool> running;
+	std::thread drain_thread;
+
+	// Wakes the protocol thread when the ring goes from empty to not
+	std::mutex wake_lock;
+	std::condition_variable wake;
+
+	// Consumer side lookahead, so available() can pop
+	Frame next;
+	bool have_frame;
+
+	std::atomic<unsigned long> num_drained;
+	std::atomic<size_t> max_depth;
+	std::atomic<unsigned long> num_ring_full;
+
+	void drain()
+	{
+		// The drain thread has to beat a 3 frame FIFO, so let it jump the
+		// queue when we're allowed to (we usually run as root for the SPI)
+		struct sched_param sp;
+		sp.sched_priority = sched_get_priority_min(SCHED_FIFO);
+		pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+
+		while(running)
+		{
+			bool got = false, stalled = false;
+			{
+				std::lock_guard<std::mutex> l(radio_lock);
+				while(radio.available())
+				{
+					// Leave the rest in the radio, it just won't ACK until
+					// there's room again
+					if(ring.full())
+					{
+						num_ring_full++;
+						stalled = true;
+						break;
+					}
+					Frame f;
+					f.len = dynamic ? radio.getDynamicPayloadSize() : sizeof(f.data);
+					// RF24 throws out a frame with a bad length itself
+					if(f.len == 0 || f.len > sizeof(f.data))
+						continue;
+					radio.read(f.data, f.len);
+					ring.push(f);
+					num_drained++;
+					got = true;
+				}
+			}
+			if(stalled)
+			{
+				// Give the protocol thread a chance to catch up
+				std::this_thread::sleep_for(std::chrono::microseconds(rx_poll_us));
+			}
+			if(got)
+			{
+				size_t depth = ring.size();
+				if(depth > max_depth)
+					max_depth = depth;
+				std::lock_guard<std::mutex> l(wake_lock);
+				wake.notify_one();
+			}
+			else if(stalled == false)
+			{
+				radio.waitAvailable(drain_wait_us);
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,744 @@
+/*
+ * In-process lossy channel emulator.
+ *
+ * A SimMedium is the "air" shared by any number of SimRadio endpoints. A
+ * frame written by one radio reaches every other radio that is listening
+ * on the same channel and data rate with a reading pipe open on the
+ * writer's address, much like the real thing. Each of them loses frames on
+ * its own, and with auto-ack on only the first one to hear it answers. The
+ * emulator models:
+ *
+ *  - Enhanced ShockBurst auto-ACK with ARD/ARC retries and PID duplicate
+ *    suppression on the receiving end
+ *  - the 3 deep RX FIFO (frames arriving at a full FIFO are not ACKed)
+ *  - the 3 deep TX FIFO behind writeFast(), which stalls on a frame that
+ *    runs out of retries until reUseTX() or a flush
+ *  - ACK payloads, which go back with the ACK (and are lost with it) and
+ *    land in the writer's RX FIFO
+ *  - dynamic payloads: frames only take the air time of what was written,
+ *    instead of being padded to 32 bytes, and a radio can't make out
+ *    frames sent the other way
+ *  - air time at 250Kbps, 1Mbps and 2Mbps, including PLL settling and
+ *    the ACK turnaround, paced in real time so both ends see a realistic
+ *    packet rate
+ *  - uniform loss, Gilbert-Elliott burst loss and corrupted payloads that
+ *    slip past the hardware CRC
+ *  - busy channels, which lose more frames and show up on testRPD(), and
+ *    a weak link that loses more at the faster data rates
+ *
+ * The loss spec is a comma separated list of key=value pairs:
+ *
+ *   rate=250K|1M|2M    override the data rate the program asks for
+ *   loss=P             drop each frame (data or ACK) with probability P
+ *   ge=PGB/PBG[/LB[/LG]]
+ *                      Gilbert-Elliott burst loss. PGB is the chance of
+ *                      going from the good to the bad state, PBG the way
+ *                      back, LB/LG the loss rate in each state
+ *                      (default 1 and 0)
+ *   corrupt=P          flip one payload bit with probability P
+ *   busy=CH/P          something else is on channel CH (and the ones next to
+ *                      it): lose frames there with probability P, and have
+ *                      testRPD() see it as often. Give it more than once for
+ *                      more channels.
+ *   rateloss=L2M/L1M/L250K
+ *                      extra loss at each data rate, for a link at the edge
+ *                      of its range
+ *   fifo=N             RX FIFO depth (default 3)
+ *   seed=N             seed for the loss generator (default 1)
+ *   speed=X            run X times faster than real time, 0 to not pace
+ *
+ * e.g. "rate=1M,ge=0.01/0.25,corrupt=0.001"
+ */
+
+#ifndef SIM_TRANSPORT_H
+#define SIM_TRANSPORT_H
+
+#include <stdlib.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "transport.h"
+
+struct SimConfig
+{
+	int rate = -1; // rf24_datarate_e, or -1 to use whatever the radio is set to
+	double loss = 0;
+	bool ge = false;
+	double ge_p_gb = 0, ge_p_bg = 1, ge_loss_bad = 1, ge_loss_good = 0;
+	double corrupt = 0;
+	std::map<int, double> busy; // Channel, loss on it
+	double rate_loss[3] = { 0, 0, 0 }; // Indexed by rf24_datarate_e
+	uint8_t fifo_depth = 3;
+	uint32_t seed = 1;
+	double speed = 1;
+};
+
+struct SimStats
+{
+	unsigned long frames = 0; // calls to write()
+	unsigned long attempts = 0; // frames actually put on the air
+	unsigned long lost = 0;
+	unsigned long unheard = 0; // nobody was listening
+	unsigned long acks_lost = 0;
+	unsigned long corrupted = 0;
+	unsigned long fifo_full = 0;
+	unsigned long dups = 0;
+	uint64_t air_us = 0;
+};
+
+/* Parse a loss spec (see the top of this file). Returns false on garbage. */
+inline bool parse_sim_spec(const char *spec, SimConfig &cfg)
+{
+	std::string s(spec);
+	size_t pos = 0;
+	while(pos < s.size())
+	{
+		size_t end = s.find(',', pos);
+		if(end == std::string::npos)
+			end = s.size();
+		std::string item = s.substr(pos, end - pos);
+		pos = end + 1;
+		if(item.empty())
+			continue;
+
+		size_t eq = item.find('=');
+		if(eq == std::string::npos)
+		{
+			fprintf(stderr, "Bad sim option \"%s\", expected key=value\n", item.c_str());
+			return false;
+		}
+		std::string key = item.substr(0, eq);
+		const char *val = item.c_str() + eq + 1;
+
+		if(key == "rate")
+		{
+			if(strcmp(val, "250K") == 0) cfg.rate = RF24_250KBPS;
+			else if(strcmp(val, "1M") == 0) cfg.rate = RF24_1MBPS;
+			else if(strcmp(val, "2M") == 0) cfg.rate = RF24_2MBPS;
+			else
+			{
+				fprintf(stderr, "Unknown sim data rate \"%s\", use 250K, 1M or 2M\n", val);
+				return false;
+			}
+		}
+		else if(key == "loss") cfg.loss = atof(val);
+		else if(key == "corrupt") cfg.corrupt = atof(val);
+		else if(key == "fifo") cfg.fifo_depth = atoi(val);
+		else if(key == "seed") cfg.seed = strtoul(val, NULL, 0);
+		else if(key == "speed") cfg.speed = atof(val);
+		else if(key == "busy")
+		{
+			int ch;
+			double p;
+			if(sscanf(val, "%d/%lf", &ch, &p) != 2 || ch < 0 || ch > 125)
+			{
+				fprintf(stderr, "Sim option busy needs CH/P, with a channel from 0 to 125\n");
+				return false;
+			}
+			cfg.busy[ch] = p;
+		}
+		else if(key == "rateloss")
+		{
+			double v[3] = { 0, 0, 0 };
+			if(sscanf(val, "%lf/%lf/%lf", &v[0], &v[1], &v[2]) < 1)
+			{
+				fprintf(stderr, "Sim option rateloss needs L2M[/L1M[/L250K]]\n");
+				return false;
+			}
+			cfg.rate_loss[RF24_2MBPS] = v[0];
+			cfg.rate_loss[RF24_1MBPS] = v[1];
+			cfg.rate_loss[RF24_250KBPS] = v[2];
+		}
+		else if(key == "ge")
+		{
+			double v[4] = { 0, 1, 1, 0 };
+			int n = sscanf(val, "%lf/%lf/%lf/%lf", &v[0], &v[1], &v[2], &v[3]);
+			if(n < 2)
+			{
+				fprintf(stderr, "Sim option ge needs at least PGB/PBG\n");
+				return false;
+			}
+			cfg.ge = true;
+			cfg.ge_p_gb = v[0];
+			cfg.ge_p_bg = v[1];
+			cfg.ge_loss_bad = v[2];
+			cfg.ge_loss_good = v[3];
+		}
+		else
+		{
+			fprintf(stderr, "Unknown sim option \"%s\"\n", key.c_str());
+			return false;
+		}
+	}
+	if(cfg.fifo_depth == 0)
+		cfg.fifo_depth = 1;
+	return true;
+}
+
+/* On-air time of one frame in microseconds: preamble, 5 byte address, 9 bit PCF, payload, CRC */
+inline uint32_t sim_air_time_us(int rate, uint8_t payload_len, uint8_t crc_bytes)
+{
+	uint32_t bits = 8 * (1 + 5 + payload_len + crc_bytes) + 9;
+	switch(rate)
+	{
+		case RF24_2MBPS: return (bits + 1) / 2;
+		case RF24_250KBPS: return bits * 4;
+		default: return bits;
+	}
+}
+
+const uint32_t sim_settle_us = 130; // PLL settling on every RX<->TX switch
+const uint32_t sim_spi_us_per_byte = 2; // 4MHz SPI
+
+class SimRadio;
+
+class SimMedium
+{
+public:
+	SimMedium(const SimConfig &config) : cfg(config), rng(config.seed) {}
+
+	SimConfig cfg;
+	SimStats stats;
+	std::mutex lock;
+
+	// Everything below is protected by lock
+	std::vector<SimRadio*> radios;
+	std::condition_variable frame_arrived; // Stands in for the IRQ pin
+
+	double uniform()
+	{
+		return std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+	}
+
+	/* How busy channel is with something else, a 2Mbps channel is 2MHz wide */
+	double busy(int channel) const
+	{
+		double p = 0;
+		for(int c = channel - 1; c <= channel + 1; c++)
+		{
+			std::map<int, double>::const_iterator it = cfg.busy.find(c);
+			if(it != cfg.busy.end() && it->second > p)
+				p = it->second;
+		}
+		return p;
+	}
+
+	/* Decide the fate of one frame going from one radio to another, on channel at rate */
+	bool frame_lost(const SimRadio *from, const SimRadio *to, int channel, int rate)
+	{
+		bool lost = cfg.loss > 0 && uniform() < cfg.loss;
+		double extra = busy(channel);
+		if(rate >= 0 && rate < 3 && cfg.rate_loss[rate] > 0)
+			extra = 1 - (1 - extra) * (1 - cfg.rate_loss[rate]);
+		if(extra > 0 && uniform() < extra)
+			lost = true;
+		if(cfg.ge)
+		{
+			bool &bad = ge_bad[std::make_pair(from, to)];
+			if(bad)
+				bad = uniform() >= cfg.ge_p_bg;
+			else
+				bad = uniform() < cfg.ge_p_gb;
+			double p = bad ? cfg.ge_loss_bad : cfg.ge_loss_good;
+			if(p > 0 && uniform() < p)
+				lost = true;
+		}
+		return lost;
+	}
+
+	void print_stats()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		printf("Sim link: %lu frames, %lu on air (%lu retries), %lu lost, %lu with nobody listening, %lu ACKs lost, %lu corrupted, %lu dropped on full RX FIFO, %lu duplicates discarded\n",
+			stats.frames, stats.attempts, stats.attempts - stats.frames, stats.lost, stats.unheard, stats.acks_lost,
+			stats.corrupted, stats.fifo_full, stats.dups);
+		printf("Sim air time: %llu ms\n", (unsigned long long)(stats.air_us / 1000));
+	}
+
+private:
+	std::mt19937 rng;
+	std::map<std::pair<const SimRadio*, const SimRadio*>, bool> ge_bad;
+};
+
+class SimRadio : public Transport
+{
+public:
+	SimRadio(SimMedium &m) : medium(m)
+	{
+		std::lock_guard<std::mutex> l(medium.lock);
+		medium.radios.push_back(this);
+		memset(pipe_open, 0, sizeof(pipe_open));
+	}
+
+	~SimRadio()
+	{
+		std::lock_guard<std::mutex> l(medium.lock);
+		for(size_t i = 0; i < medium.radios.size(); i++)
+		{
+			if(medium.radios[i] == this)
+			{
+				medium.radios.erase(medium.radios.begin() + i);
+				break;
+			}
+		}
+	}
+
+	bool begin()
+	{
+		std::lock_guard<std::mutex> l(medium.lock);
+		// RF24::begin() defaults
+		channel = 76;
+		rate = RF24_1MBPS;
+		auto_ack = true;
+		ard = 5;
+		arc = 15;
+		crc_bytes = 2;
+		listening = false;
+		ack_payload = false;
+		dynamic = false;
+		rx.clear();
+		ack_payloads.clear();
+		return true;
+	}
+	void powerDown() { stopListening(); }
+	void printDetails()
+	{
+		printf("Simulated radio: channel %d, %s, ARD %dus, ARC %d, CRC %d bytes, auto-ack %s\n",
+			channel, rate_name(effective_rate()), 250 * (ard + 1), arc, crc_bytes, auto_ack ? "on" : "off");
+	}
+
+	void setChannel(uint8_t c) { std::lock_guard<std::mutex> l(medium.lock); channel = c; }
+	void setPALevel(uint8_t level) {}
+	bool setDataRate(rf24_datarate_e speed) { std::lock_guard<std::mutex> l(medium.lock); rate = speed; return true; }
+	void setAutoAck(bool enable) { std::lock_guard<std::mutex> l(medium.lock); auto_ack = enable; }
+	void setRetries(uint8_t delay, uint8_t count) { std::lock_guard<std::mutex> l(medium.lock); ard = delay & 0xf; arc = count & 0xf; }
+	void setCRCLength(rf24_crclength_e length) { std::lock_guard<std::mutex> l(medium.lock); crc_bytes = (uint8_t)length; }
+
+	void openWritingPipe(uint64_t address) { std::lock_guard<std::mutex> l(medium.lock); writing_address = address; }
+	void openReadingPipe(uint8_t number, uint64_t address)
+	{
+		if(number > 5)
+			return;
+		std::lock_guard<std::mutex> l(medium.lock);
+		pipes[number] = address;
+		pipe_open[number] = true;
+	}
+	void closeReadingPipe(uint8_t pipe)
+	{
+		if(pipe > 5)
+			return;
+		std::lock_guard<std::mutex> l(medium.lock);
+		pipe_open[pipe] = false;
+	}
+
+	void startListening()
+	{
+		{
+			std::lock_guard<std::mutex> l(medium.lock);
+			listening = true;
+		}
+		pace(sim_settle_us);
+	}
+	void stopListening()
+	{
+		{
+			std::lock_guard<std::mutex> l(medium.lock);
+			listening = false;
+			// RF24 flushes leftover ACK payloads so they don't go out as frames
+			ack_payloads.clear();
+		}
+		pace(sim_settle_us);
+	}
+	uint8_t flush_tx()
+	{
+		max_rt = false;
+		tx_fifo.clear();
+		std::lock_guard<std::mutex> l(medium.lock);
+		ack_payloads.clear();
+		return 0;
+	}
+	uint8_t flush_rx() { std::lock_guard<std::mutex> l(medium.lock); rx.clear(); return 0; }
+
+	bool write(const void *buf, uint8_t len)
+	{
+		uint8_t frame[32];
+		len = pad(frame, buf, len);
+		uint8_t pid = next_pid();
+		spend(sim_spi_us_per_byte * (len + 1) + sim_settle_us);
+		return transmit(frame, len, pid);
+	}
+
+	bool writeFast(const void *buf, uint8_t len)
+	{
+		uint8_t frame[32];
+		len = pad(frame, buf, len);
+		if(max_rt)
+		{
+			// The radio is stalled on a failed frame, the rest just queue up
+			if(tx_fifo.size() >= 3)
+				return false;
+			queue_tx(frame, len, next_pid());
+			return true;
+		}
+
+		uint8_t pid = next_pid();
+		// The upload overlaps the previous frame on the air, unless the radio was idle
+		spend((tx_active ? 0 : sim_spi_us_per_byte * (len + 1)) + sim_settle_us);
+		tx_active = true;
+		if(transmit(frame, len, pid) == false)
+		{
+			max_rt = true;
+			queue_tx(frame, len, pid);
+		}
+		return true;
+	}
+
+	void reUseTX()
+	{
+		if(max_rt == false)
+			return;
+		max_rt = false;
+		// Work through the FIFO until it's empty or stuck again
+		while(tx_fifo.empty() == false)
+		{
+			TxFrame &f = tx_fifo.front();
+			spend(sim_settle_us);
+			if(transmit(f.data.data(), f.data.size(), f.pid) == false)
+			{
+				max_rt = true;
+				return;
+			}
+			tx_fifo.pop_front();
+		}
+	}
+
+	bool txStandBy()
+	{
+		tx_active = false;
+		if(max_rt)
+		{
+			flush_tx();
+			return false;
+		}
+		return true;
+	}
+
+	bool available()
+	{
+		{
+			std::lock_guard<std::mutex> l(medium.lock);
+			if(rx.empty() == false)
+				return true;
+		}
+		// Nothing on the air for us, let the other end have the CPU
+		std::this_thread::yield();
+		return false;
+	}
+
+	// RF24 turns dynamic payloads on along with ACK payloads
+	void enableAckPayload() { std::lock_guard<std::mutex> l(medium.lock); ack_payload = dynamic = true; }
+	void enableDynamicPayloads() { std::lock_guard<std::mutex> l(medium.lock); dynamic = true; }
+
+	bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len)
+	{
+		if(len > 32)
+			len = 32;
+		spend(sim_spi_us_per_byte * (len + 1));
+		std::lock_guard<std::mutex> l(medium.lock);
+		if(ack_payload == false || ack_payloads.size() >= 3)
+			return false;
+		Frame f;
+		f.data.assign((const uint8_t*)buf, (const uint8_t*)buf + len);
+		ack_payloads.push_back(f);
+		return true;
+	}
+
+	bool testRPD()
+	{
+		std::lock_guard<std::mutex> l(medium.lock);
+		double p = medium.busy(channel);
+		return p > 0 && medium.uniform() < p;
+	}
+
+	uint8_t getARC() { return last_arc; }
+
+	uint8_t getDynamicPayloadSize()
+	{
+		std::lock_guard<std::mutex> l(medium.lock);
+		return rx.empty() ? 0 : rx.front().data.size();
+	}
+
+	void waitAvailable(uint32_t timeout_us)
+	{
+		std::unique_lock<std::mutex> l(medium.lock);
+		if(rx.empty())
+			medium.frame_arrived.wait_for(l, std::chrono::microseconds(timeout_us));
+	}
+
+	void read(void *buf, uint8_t len)
+	{
+		std::lock_guard<std::mutex> l(medium.lock);
+		memset(buf, 0, len);
+		if(rx.empty())
+			return;
+		const std::vector<uint8_t> &f = rx.front().data;
+		memcpy(buf, f.data(), len < f.size() ? len : f.size());
+		rx.pop_front();
+	}
+
+private:
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+	};
+
+	// A frame waiting in the TX FIFO behind one that ran out of retries
+	struct TxFrame
+	{
+		uint8_t pid;
+		std::vector<uint8_t> data;
+	};
+
+	// Per sender PID and payload of the last accepted frame, for duplicate suppression
+	struct LastSeen
+	{
+		uint8_t pid;
+		std::vector<uint8_t> data;
+	};
+
+	SimMedium &medium;
+	uint8_t channel = 76;
+	int rate = RF24_1MBPS;
+	bool auto_ack = true;
+	uint8_t ard = 5, arc = 15;
+	uint8_t crc_bytes = 2;
+	bool listening = false;
+	uint64_t writing_address = 0;
+	uint64_t pipes[6];
+	bool pipe_open[6];
+	uint8_t tx_pid = 0; // PID of the frame on the air
+	uint8_t next_tx_pid = 0;
+	std::deque<Frame> rx;
+	bool ack_payload = false;
+	std::deque<Frame> ack_payloads; // Queued to go back with our ACKs
+	bool dynamic = false; // Dynamic payloads
+	// TX FIFO state, only touched by the thread writing to this radio
+	std::deque<TxFrame> tx_fifo;
+	bool max_rt = false;
+	bool tx_active = false;
+	uint8_t last_arc = 0; // Retries the last frame took
+	std::map<const SimRadio*, LastSeen> last_seen;
+	std::chrono::steady_clock::time_point busy_until;
+
+	static const char *rate_name(int r)
+	{
+		switch(r)
+		{
+			case RF24_2MBPS: return "2Mbps";
+			case RF24_250KBPS: return "250Kbps";
+			default: return "1Mbps";
+		}
+	}
+
+	int effective_rate() const
+	{
+		return medium.cfg.rate >= 0 ? medium.cfg.rate : rate;
+	}
+
+	/* Everyone who would hear us right now. medium.lock must be held. */
+	void find_receivers(std::vector<SimRadio*> &found)
+	{
+		found.clear();
+		for(size_t i = 0; i < medium.radios.size(); i++)
+		{
+			SimRadio *r = medium.radios[i];
+			if(r == this || r->listening == false || r->channel != channel || r->effective_rate() != effective_rate() ||
+				r->dynamic != dynamic)
+				continue;
+			for(int p = 0; p < 6; p++)
+			{
+				if(r->pipe_open[p] && r->pipes[p] == writing_address)
+				{
+					found.push_back(r);
+					break;
+				}
+			}
+		}
+	}
+
+	/* medium.lock must be held. Returns true if the frame would be ACKed. */
+	bool accept(const SimRadio *from, const uint8_t *buf, uint8_t len)
+	{
+		if(rx.size() >= medium.cfg.fifo_depth)
+		{
+			medium.stats.fifo_full++;
+			return false;
+		}
+
+		Frame f;
+		f.data.assign(buf, buf + len);
+		LastSeen &last = last_seen[from];
+		if(from->auto_ack && last.pid == from->tx_pid && last.data == f.data)
+		{
+			// Retransmission of a frame whose ACK got lost
+			medium.stats.dups++;
+			return true;
+		}
+		last.pid = from->tx_pid;
+		last.data = f.data;
+
+		if(medium.cfg.corrupt > 0 && medium.uniform() < medium.cfg.corrupt)
+		{
+			int bit = (int)(medium.uniform() * len * 8) % (len * 8);
+			f.data[bit / 8] ^= 1 << (bit % 8);
+			medium.stats.corrupted++;
+		}
+		rx.push_back(f);
+		medium.frame_arrived.notify_all();
+		return true;
+	}
+
+	/* Copy a frame to write into buf, padded out to 32 bytes unless dynamic payloads are on. Returns its length on the air. */
+	uint8_t pad(uint8_t *frame, const void *buf, uint8_t len)
+	{
+		if(len > 32)
+			len = 32;
+		memset(frame, 0, 32);
+		memcpy(frame, buf, len);
+		std::lock_guard<std::mutex> l(medium.lock);
+		return dynamic ? len : 32;
+	}
+
+	/* Count a new frame and give it the next packet id */
+	uint8_t next_pid()
+	{
+		std::lock_guard<std::mutex> l(medium.lock);
+		medium.stats.frames++;
+		next_tx_pid = (next_tx_pid + 1) & 3;
+		return next_tx_pid;
+	}
+
+	void queue_tx(const uint8_t *buf, uint8_t len, uint8_t pid)
+	{
+		TxFrame f;
+		f.pid = pid;
+		f.data.assign(buf, buf + len);
+		tx_fifo.push_back(f);
+	}
+
+	/*
+	 * Put one frame on the air, with auto-ack retries. Returns true once
+	 * it's ACKed (or always, without auto-ack), false when the retries run
+	 * out.
+	 */
+	bool transmit(const uint8_t *buf, uint8_t len, uint8_t pid)
+	{
+		int r;
+		bool ack;
+		uint8_t retries, retry_delay, crc;
+		{
+			std::lock_guard<std::mutex> l(medium.lock);
+			r = effective_rate();
+			ack = auto_ack;
+			retries = arc;
+			retry_delay = ard;
+			crc = crc_bytes;
+			tx_pid = pid;
+		}
+
+		for(int attempt = 0; attempt <= retries; attempt++)
+		{
+			last_arc = attempt;
+			// The frame lands at the end of its air time, so whoever is
+			// listening by then hears it
+			spend(sim_air_time_us(r, len, crc));
+
+			bool delivered = false, acked = false;
+			uint8_t ack_len = 0;
+			{
+				std::lock_guard<std::mutex> l(medium.lock);
+				medium.stats.attempts++;
+				std::vector<SimRadio*> to;
+				find_receivers(to);
+				// Real radios would all ACK at once and garble each
+				// other, let the first one stand in for that
+				if(ack && to.size() > 1)
+					to.resize(1);
+				if(to.empty())
+					medium.stats.unheard++;
+				for(size_t i = 0; i < to.size(); i++)
+				{
+					if(medium.frame_lost(this, to[i], channel, r))
+					{
+						medium.stats.lost++;
+						continue;
+					}
+					delivered = to[i]->accept(this, buf, len);
+					if(delivered && ack)
+					{
+						acked = medium.frame_lost(to[i], this, channel, r) == false;
+						if(acked == false)
+							medium.stats.acks_lost++;
+						// The payload waits for an ACK that gets through
+						if(ack_payload && to[i]->ack_payload && to[i]->ack_payloads.empty() == false)
+						{
+							Frame &f = to[i]->ack_payloads.front();
+							ack_len = f.data.size();
+							if(acked && rx.size() < medium.cfg.fifo_depth)
+								rx.push_back(f);
+							if(acked)
+								to[i]->ack_payloads.pop_front();
+						}
+					}
+				}
+			}
+
+			// Without auto-ack the radio always reports success
+			if(ack == false)
+				return true;
+			if(delivered)
+			{
+				spend(sim_settle_us + sim_air_time_us(r, ack_len, crc));
+				if(acked)
+					return true;
+			}
+			spend(250 * (retry_delay + 1));
+		}
+		return false;
+	}
+
+	/* Account for time this radio keeps the air busy */
+	void spend(uint32_t us)
+	{
+		{
+			std::lock_guard<std::mutex> l(medium.lock);
+			medium.stats.air_us += us;
+		}
+		pace(us);
+	}
+
+	/* Hold the calling thread for the modeled air time */
+	void pace(uint32_t us)
+	{
+		if(medium.cfg.speed <= 0)
+			return;
+		using namespace std::chrono;
+		steady_clock::time_point now = steady_clock::now();
+		// Don't let a long idle period turn into a burst of catch-up
+		if(busy_until < now - milliseconds(2))
+			busy_until = now;
+		busy_until += microseconds((long)(us / medium.cfg.speed));
+		if(busy_until - now > microseconds(100))
+			std::this_thread::sleep_until(busy_until);
+	}
+};
+
+#endif
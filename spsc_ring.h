@@ -0,0 +1,102 @@
+/*
+ * Lock-free ring for handing items from exactly one producer thread to
+ * exactly one consumer thread.
+ *
+ * Each side only ever writes its own index, and publishes it with a release
+ * store after the slot is filled (or emptied), so neither side ever blocks
+ * the other. The indices live on separate cache lines so the two threads
+ * don't fight over one.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <vector>
+
+/*
+ * Before C++17 plain new only promises malloc's alignment, which would put
+ * the indices back on a shared cache line. Anything holding a ring that
+ * goes on the heap gets this too.
+ */
+struct CacheAligned
+{
+	static void *operator new(size_t size)
+	{
+		void *p;
+		if(posix_memalign(&p, 64, size) != 0)
+			throw std::bad_alloc();
+		return p;
+	}
+	static void operator delete(void *p) { free(p); }
+};
+
+template <typename T>
+class SpscRing : public CacheAligned
+{
+public:
+	/* capacity is rounded up to a power of two */
+	explicit SpscRing(size_t capacity) : head(0), tail(0)
+	{
+		size_t n = 1;
+		while(n < capacity)
+			n <<= 1;
+		slots.resize(n);
+		mask = n - 1;
+	}
+
+	size_t capacity() const { return slots.size(); }
+
+	/* Producer side: no room for another push */
+	bool full() const
+	{
+		return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) == slots.size();
+	}
+
+	/* Consumer side: nothing to pop */
+	bool empty() const
+	{
+		return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+	}
+
+	/* Items waiting, only a snapshot if the other side is busy */
+	size_t size() const
+	{
+		// head first, it can only catch up to tail, never pass it
+		size_t h = head.load(std::memory_order_acquire);
+		return tail.load(std::memory_order_acquire) - h;
+	}
+
+	/* Producer side. Returns false if the ring is full. */
+	bool push(const T &item)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if(t - head.load(std::memory_order_acquire) == slots.size())
+			return false;
+		slots[t & mask] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* Consumer side. Returns false if the ring is empty. */
+	bool pop(T &item)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if(h == tail.load(std::memory_order_acquire))
+			return false;
+		item = slots[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<T> slots;
+	size_t mask;
+	alignas(64) std::atomic<size_t> head; // Next slot to read, only the consumer writes it
+	alignas(64) std::atomic<size_t> tail; // Next slot to write, only the producer writes it
+};
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * Live streaming (-S) of samples like read_ads's, as they're taken.
+ *
+ * A file transfer needs the whole file, and its size, before it can start.
+ * A stream instead packs samples into frames as they come in and sends
+ * each one as soon as it's full or its first sample has waited flush_ms,
+ * so no sample waits longer than that to go on the air. There's no size
+ * and no end but the one the transmitter sends when its input runs out.
+ *
+ * A stream frame looks like a data frame, checked with CRC-16:
+ *
+ *   uint16_t seq | uint32_t t_us | uint8_t info | samples | CRC-16
+ *
+ * seq counts frames from 1 and wraps back to 1, 0 is for control packets.
+ * t_us is when the first sample was taken, in us since the stream started
+ * (it wraps every 71 minutes, the receiver carries on counting). The top
+ * 4 bits of info are channels - 1, the bottom 4 how many samples there
+ * are. The first sample is channels int16_t values, every one after it a
+ * uint16_t of us since the one before and then its values. With three
+ * channels that's three samples to a frame.
+ *
+ * Every frame says all there is to know about it, so a receiver can start
+ * listening halfway through. A gap in seq is frames that never made it:
+ * with a max age, frames the radio still couldn't get through by then are
+ * dropped, since on a live plot the newest samples are worth more than
+ * old ones. Without one the transmitter keeps trying, and samples wait in
+ * a ring until there's no more room.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "packets.h"
+
+typedef crc16_frame stream_frame;
+
+const int max_stream_channels = 8;
+const int max_stream_samples = 15;
+// '\0' '\0' 'E' uint16_t last seq: the input ran out
+const uint8_t stream_end = 'E';
+
+// Where things go in a stream frame's payload
+const int stream_time_byte = 0;
+const int stream_info_byte = 4;
+const int stream_samples_byte = 5;
+const int stream_bytes = stream_frame::payload_bytes;
+
+struct StreamSample
+{
+	uint64_t t_us; // Since the stream started
+	int channels;
+	int16_t v[max_stream_channels];
+};
+
+/*
+ * Read a line of whitespace separated values into s. Returns how many, 0
+ * for none. A line can start with when it was taken, in seconds with a
+ * point ("12.345678", the values never have one); that goes in s.t_us and
+ * sets *timed.
+ */
+inline int parse_stream_sample(const char *line, StreamSample &s, bool *timed)
+{
+	s.channels = 0;
+	const char *p = line;
+	*timed = false;
+	char *end;
+	unsigned long long secs = strtoull(p, &end, 10);
+	if(end != p && *end == '.')
+	{
+		uint64_t us = 0;
+		int digits = 0;
+		for(p = end + 1; *p >= '0' && *p <= '9'; p++)
+		{
+			if(digits++ < 6)
+				us = us * 10 + (*p - '0');
+		}
+		for(; digits < 6; digits++)
+			us *= 10;
+		s.t_us = secs * 1000000 + us;
+		*timed = true;
+	}
+	while(s.channels < max_stream_channels)
+	{
+		long v = strtol(p, &end, 10);
+		if(end == p)
+			break;
+		s.v[s.channels++] = v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+		p = end;
+	}
+	return s.channels;
+}
+
+/* The next frame's seq, skipping 0 */
+inline uint16_t next_stream_seq(uint16_t seq)
+{
+	return seq == 0xffff ? 1 : seq + 1;
+}
+
+/* Fills in a frame a sample at a time */
+class StreamPacker
+{
+public:
+	StreamPacker() : num(0), channels(0), used(0), last(0) { memset(frame, '\0', 32); }
+
+	bool empty() const { return num == 0; }
+	int size() const { return num; }
+	/* Sample values in the frame so far */
+	int sample_bytes() const { return num * 2 * channels; }
+	/* When the first sample was taken */
+	uint64_t first_us() const { return first; }
+
+	/* Add s if it fits. If it doesn't, take() what's there first. */
+	bool add(const StreamSample &s)
+	{
+		uint8_t *p = stream_frame::payload(frame);
+		if(num == 0)
+		{
+			if(s.channels < 1 || stream_samples_byte + 2 * s.channels > stream_bytes)
+				return false;
+			memset(frame, '\0', 32);
+			channels = s.channels;
+			first = last = s.t_us;
+			uint32_t t = first;
+			memcpy(p + stream_time_byte, &t, sizeof(uint32_t));
+			used = stream_samples_byte;
+		}
+		else
+		{
+			if(s.channels != channels || num == max_stream_samples || s.t_us - last > 0xffff ||
+				used + 2 + 2 * channels > stream_bytes)
+				return false;
+			uint16_t gap = s.t_us - last;
+			memcpy(p + used, &gap, sizeof(uint16_t));
+			used += 2;
+			last = s.t_us;
+		}
+		memcpy(p + used, s.v, 2 * channels);
+		used += 2 * channels;
+		num++;
+		return true;
+	}
+
+	/* The frame so far as seq, sealed, and start on the next. Returns the frame. */
+	const uint8_t *take(uint16_t seq)
+	{
+		stream_frame::payload(frame)[stream_info_byte] = (channels - 1) << 4 | num;
+		stream_frame::set_id(frame, seq);
+		stream_frame::check_type::seal(frame, 0);
+		num = 0;
+		return frame;
+	}
+
+private:
+	uint8_t frame[32];
+	int num, channels, used;
+	uint64_t first, last;
+};
+
+/* Takes stream frames apart, and keeps track of what went missing between them */
+class StreamUnpacker
+{
+public:
+	StreamUnpacker() : last_seq(0), t_base(0), last_t(0), num_frames(0), num_lost(0), num_dups(0), num_restarts(0) {}
+
+	/*
+	 * Put the samples in frame, which has already been checked, in out.
+	 * Returns how many there are, or -1 for a repeat of the last frame
+	 * (its ACK didn't make it back). *gap is set if something's missing
+	 * just before them: frames that never made it, or the transmitter
+	 * starting a new stream.
+	 */
+	int unpack(const uint8_t *frame, StreamSample *out, bool *gap)
+	{
+		uint16_t seq = stream_frame::id(frame);
+		*gap = false;
+		if(seq == last_seq)
+		{
+			num_dups++;
+			return -1;
+		}
+		const uint8_t *p = stream_frame::payload(frame);
+		uint32_t t;
+		memcpy(&t, p + stream_time_byte, sizeof(uint32_t));
+		if(num_frames > 0 && t < last_t)
+		{
+			// Carry on counting past the wrap. Going back by less than
+			// that is the transmitter starting over.
+			if(last_t - t > 0x80000000)
+				t_base += (uint64_t)1 << 32;
+			else
+			{
+				num_restarts++;
+				last_seq = 0;
+				*gap = true;
+			}
+		}
+		uint32_t lost = last_seq == 0 ? 0 : seq > last_seq ? seq - last_seq - 1 : 0xffff - last_seq + seq - 1;
+		*gap = *gap || lost > 0;
+		num_lost += lost;
+		last_seq = seq;
+		last_t = t;
+		num_frames++;
+
+		int channels = (p[stream_info_byte] >> 4) + 1;
+		int num = p[stream_info_byte] & 0x0f;
+		uint64_t at = t_base + t;
+		int used = stream_samples_byte;
+		for(int i = 0; i < num; i++)
+		{
+			if(i > 0)
+			{
+				uint16_t since;
+				memcpy(&since, p + used, sizeof(uint16_t));
+				used += 2;
+				at += since;
+			}
+			if(used + 2 * channels > stream_bytes)
+				return i;
+			out[i].t_us = at;
+			out[i].channels = channels;
+			memcpy(out[i].v, p + used, 2 * channels);
+			used += 2 * channels;
+		}
+		return num;
+	}
+
+	/* The stream ended with frame seq, count whatever was missing off the end of it */
+	void finish(uint16_t seq)
+	{
+		if(last_seq != 0 && seq != last_seq)
+			num_lost += seq > last_seq ? seq - last_seq : 0xffff - last_seq + seq;
+		last_seq = seq;
+	}
+
+	unsigned long frames() const { return num_frames; }
+	unsigned long lost() const { return num_lost; }
+	unsigned long duplicates() const { return num_dups; }
+	unsigned long restarts() const { return num_restarts; }
+
+private:
+	uint16_t last_seq;
+	uint64_t t_base;
+	uint32_t last_t;
+	unsigned long num_frames, num_lost, num_dups, num_restarts;
+};
+
+/* One line of the time series: seconds since the stream started, then the values */
+inline int print_stream_sample(FILE *out, const StreamSample &s)
+{
+	int n = fprintf(out, "%llu.%06llu", (unsigned long long)(s.t_us / 1000000), (unsigned long long)(s.t_us % 1000000));
+	for(int c = 0; c < s.channels; c++)
+		n += fprintf(out, " %d", s.v[c]);
+	n += fprintf(out, "\n");
+	return n;
+}
+
+#endif
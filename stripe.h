@@ -0,0 +1,155 @@
+/*
+ * Receiving on several radios at once.
+ *
+ * With more than one radio (-r), each pair of radios is a link of its own,
+ * on its own channel, and the transmitter spreads data packets across them.
+ * Everything else, the first packet, ending packets, retransmit requests
+ * and their answers, only ever goes over the first link.
+ *
+ * StripedRx puts an RxPump on every radio and reads from all of them as
+ * one, so the protocol code sees a single stream of frames in about the
+ * order they arrived. Anything that isn't reading goes to the first radio.
+ * The others only ever receive data, so they're left listening throughout.
+ */
+
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <memory>
+#include <vector>
+
+#include "rx_pump.h"
+#include "transport.h"
+
+class StripedRx : public Transport
+{
+public:
+	StripedRx(const std::vector<Transport*> &radios, size_t ring_frames) : cur(0), next_pump(0), others_listening(false)
+	{
+		for(size_t i = 0; i < radios.size(); i++)
+			pumps.push_back(std::unique_ptr<RxPump>(new RxPump(*radios[i], ring_frames)));
+	}
+
+	size_t size() const { return pumps.size(); }
+
+	bool begin()
+	{
+		bool ok = true;
+		for(size_t i = 0; i < pumps.size(); i++)
+			ok = pumps[i]->begin() && ok;
+		return ok;
+	}
+	void powerDown() { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->powerDown(); }
+	void printDetails() { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->printDetails(); }
+
+	// Every link has its own channel, see setup_radio()
+	void setChannel(uint8_t channel) { pumps[0]->setChannel(channel); }
+	void setPALevel(uint8_t level) { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->setPALevel(level); }
+	bool setDataRate(rf24_datarate_e speed)
+	{
+		bool ok = true;
+		for(size_t i = 0; i < pumps.size(); i++)
+			ok = pumps[i]->setDataRate(speed) && ok;
+		return ok;
+	}
+	void setAutoAck(bool enable) { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->setAutoAck(enable); }
+	void setRetries(uint8_t delay, uint8_t count) { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->setRetries(delay, count); }
+	void setCRCLength(rf24_crclength_e length) { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->setCRCLength(length); }
+
+	void openWritingPipe(uint64_t address) { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->openWritingPipe(address); }
+	void openReadingPipe(uint8_t number, uint64_t address) { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->openReadingPipe(number, address); }
+	void closeReadingPipe(uint8_t pipe) { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->closeReadingPipe(pipe); }
+
+	void startListening()
+	{
+		pumps[0]->startListening();
+		if(others_listening)
+			return;
+		for(size_t i = 1; i < pumps.size(); i++)
+			pumps[i]->startListening();
+		others_listening = true;
+	}
+	void stopListening() { pumps[0]->stopListening(); }
+	uint8_t flush_tx() { return pumps[0]->flush_tx(); }
+	// Only replies get flushed, and they only come over the first link
+	uint8_t flush_rx() { return pumps[0]->flush_rx(); }
+
+	bool write(const void *buf, uint8_t len) { return pumps[0]->write(buf, len); }
+	bool writeFast(const void *buf, uint8_t len) { return pumps[0]->writeFast(buf, len); }
+	void reUseTX() { pumps[0]->reUseTX(); }
+	bool txStandBy() { return pumps[0]->txStandBy(); }
+	// Loss reports only ride the first link's ACKs
+	void enableAckPayload() { pumps[0]->enableAckPayload(); }
+	bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len) { return pumps[0]->writeAckPayload(pipe, buf, len); }
+	void enableDynamicPayloads() { for(size_t i = 0; i < pumps.size(); i++) pumps[i]->enableDynamicPayloads(); }
+	bool testRPD() { return pumps[0]->testRPD(); }
+	uint8_t getARC() { return pumps[0]->getARC(); }
+	uint8_t getDynamicPayloadSize() { return pumps[cur]->getDynamicPayloadSize(); }
+
+	/* Takes turns between the radios, so a busy one can't starve the others */
+	bool available()
+	{
+		if(poll())
+			return true;
+		pumps[0]->waitAvailable(idle_wait_us);
+		return poll();
+	}
+
+	void read(void *buf, uint8_t len)
+	{
+		if(available() == false)
+		{
+			memset(buf, 0, len);
+			return;
+		}
+		pumps[cur]->read(buf, len);
+	}
+
+	void waitAvailable(uint32_t timeout_us) { pumps[0]->waitAvailable(timeout_us); }
+
+	/* Times a ring filled up and left frames waiting in its radio */
+	unsigned long ring_full() const
+	{
+		unsigned long n = 0;
+		for(size_t i = 0; i < pumps.size(); i++)
+			n += pumps[i]->ring_full();
+		return n;
+	}
+
+	void print_stats()
+	{
+		for(size_t i = 0; i < pumps.size(); i++)
+		{
+			if(pumps.size() > 1)
+				printf("Radio %zu: ", i);
+			pumps[i]->print_stats();
+		}
+	}
+
+private:
+	// Frames on the other radios don't wake the first one's waitAvailable(),
+	// so don't sleep on it for long
+	static const uint32_t idle_wait_us = 200;
+
+	std::vector<std::unique_ptr<RxPump> > pumps;
+	size_t cur; // Where the frame available() found is
+	size_t next_pump;
+	bool others_listening;
+
+	bool poll()
+	{
+		for(size_t i = 0; i < pumps.size(); i++)
+		{
+			size_t j = (next_pump + i) % pumps.size();
+			if(pumps[j]->poll())
+			{
+				cur = j;
+				next_pump = j + 1;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,407 @@
+/*
+ * Transfer telemetry (-T).
+ *
+ * Each end of a transfer keeps a Telemetry: counters, a histogram of how
+ * long every radio write took, how many hardware retries each one needed,
+ * and how long it spent in each phase of the protocol. Everything that can
+ * be touched from more than one thread (the radio stages of a striped
+ * transfer, the RX drain threads) is a relaxed atomic, and a write costs
+ * two clock reads and a few increments, so it's always on. At the end of a
+ * transfer it can be written out as JSON or CSV, one record per end, to
+ * line up runs with different link settings.
+ *
+ * MeteredTransport sits between the protocol and a radio and does the
+ * timing, so every write is counted whoever makes it.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "transport.h"
+
+/*
+ * Power of two buckets: bucket 0 counts zeros, bucket b values from
+ * 2^(b-1) to 2^b - 1. Percentiles come out as the top of their bucket, so
+ * they're within a factor of two, which is plenty to tell a clean link
+ * from one that retries.
+ */
+class Histogram
+{
+public:
+	static const int num_buckets = 24;
+
+	Histogram() : total(0), num(0), biggest(0)
+	{
+		for(int b = 0; b < num_buckets; b++)
+			counts[b] = 0;
+	}
+
+	void add(uint32_t v)
+	{
+		int b = v == 0 ? 0 : 32 - __builtin_clz(v);
+		if(b >= num_buckets)
+			b = num_buckets - 1;
+		counts[b].fetch_add(1, std::memory_order_relaxed);
+		num.fetch_add(1, std::memory_order_relaxed);
+		total.fetch_add(v, std::memory_order_relaxed);
+		uint32_t m = biggest.load(std::memory_order_relaxed);
+		while(v > m && biggest.compare_exchange_weak(m, v, std::memory_order_relaxed) == false);
+	}
+
+	uint64_t count() const { return num; }
+	uint32_t max() const { return biggest; }
+	double mean() const { return num ? (double)total / num : 0.0; }
+	uint64_t bucket(int b) const { return counts[b]; }
+	/* The largest value bucket b holds */
+	static uint32_t bucket_top(int b) { return b == 0 ? 0 : (uint32_t)((1ULL << b) - 1); }
+
+	/* The value fraction p of them are at or under, to within the bucket */
+	uint32_t percentile(double p) const
+	{
+		uint64_t n = num;
+		if(n == 0)
+			return 0;
+		uint64_t want = (uint64_t)(p * n + 0.5), seen = 0;
+		if(want == 0)
+			want = 1;
+		for(int b = 0; b < num_buckets; b++)
+		{
+			seen += counts[b];
+			if(seen >= want)
+				return bucket_top(b) < max() ? bucket_top(b) : max();
+		}
+		return max();
+	}
+
+private:
+	std::atomic<uint64_t> counts[num_buckets];
+	std::atomic<uint64_t> total, num;
+	std::atomic<uint32_t> biggest;
+};
+
+class Telemetry
+{
+public:
+	enum Counter
+	{
+		// Either end
+		writes,           // write(), ACKed or not
+		writes_failed,    // Ran out of retries
+		write_retries,    // Auto-retries all the write()s took
+		fast_writes,      // writeFast(), which burst mode uses and can't be timed per frame
+		frames_read,
+		// The receiver
+		data_pkts,        // New data, counting what FEC rebuilt
+		duplicates,       // Data we already had, whose ACK got lost
+		checksum_failures,
+		ignored,          // Ids that can't be real
+		ring_full,        // Times the RX drain ring filled and left frames in the radio
+		num_counters
+	};
+
+	static const char *counter_name(int c)
+	{
+		static const char *names[num_counters] = {
+			"writes", "writes_failed", "write_retries", "fast_writes", "frames_read",
+			"data_pkts", "duplicates", "checksum_failures", "ignored", "ring_full"
+		};
+		return names[c];
+	}
+
+	Histogram write_us; // How long each write() took
+	Histogram retries;  // Auto-retries each write() took
+
+	explicit Telemetry(const char *end) : role(end), phase_start(0), started(0), finished(0), num_bytes(0)
+	{
+		for(int c = 0; c < num_counters; c++)
+			counters[c] = 0;
+	}
+
+	void count(Counter c, uint64_t n = 1) { counters[c].fetch_add(n, std::memory_order_relaxed); }
+	uint64_t get(Counter c) const { return counters[c]; }
+
+	/* Something about the run to go with the numbers, like the options it had */
+	void note(const std::string &key, const std::string &value) { notes.push_back(std::make_pair(key, value)); }
+
+	/*
+	 * From now on we're in phase name, until the next one or end(). The
+	 * protocol thread is the only one that calls this, and the first call
+	 * starts the clock for goodput.
+	 */
+	void phase(const char *name)
+	{
+		if(finished != 0)
+			return;
+		uint32_t now = millis();
+		if(cur_phase.empty() == false)
+			add_phase(cur_phase, now - phase_start);
+		else if(started == 0)
+			started = now;
+		cur_phase = name;
+		phase_start = now;
+	}
+
+	/* The transfer's over, bytes of the file made it. Only the first call counts. */
+	void end(uint64_t bytes)
+	{
+		if(finished != 0)
+			return;
+		phase("");
+		cur_phase.clear();
+		finished = millis();
+		if(started == 0)
+			started = finished;
+		num_bytes = bytes;
+	}
+
+	uint32_t elapsed_ms() const { return finished ? finished - started : 0; }
+	double goodput() const { return elapsed_ms() ? num_bytes * 1000.0 / elapsed_ms() : 0.0; }
+
+	void print_summary() const
+	{
+		if(write_us.count() > 0)
+			printf("Writes (%s): %llu, %llu failed, %.2f retries each, took %.0f us on average, %u at the median, %u at 99%%, %u at most.\n",
+				role.c_str(), (unsigned long long)write_us.count(), (unsigned long long)get(writes_failed), retries.mean(),
+				write_us.mean(), write_us.percentile(0.5), write_us.percentile(0.99), write_us.max());
+		if(phases.empty() == false)
+		{
+			printf("Phases (%s):", role.c_str());
+			for(size_t i = 0; i < phases.size(); i++)
+				printf(" %s %u ms%s", phases[i].first.c_str(), phases[i].second, i + 1 < phases.size() ? "," : "");
+			printf("\n");
+		}
+	}
+
+	/* Write every end's record to path, as CSV if it ends in .csv and JSON otherwise */
+	static bool export_all(const char *path, const std::vector<const Telemetry*> &ends)
+	{
+		FILE *f = fopen(path, "w");
+		if(f == NULL)
+			return false;
+		size_t n = strlen(path);
+		bool csv = n >= 4 && strcmp(path + n - 4, ".csv") == 0;
+		if(csv)
+		{
+			fprintf(f, "role,metric,value\n");
+			for(size_t i = 0; i < ends.size(); i++)
+				ends[i]->write_csv(f);
+		}
+		else
+		{
+			fprintf(f, "[\n");
+			for(size_t i = 0; i < ends.size(); i++)
+			{
+				ends[i]->write_json(f);
+				fprintf(f, "%s\n", i + 1 < ends.size() ? "," : "");
+			}
+			fprintf(f, "]\n");
+		}
+		return fclose(f) == 0;
+	}
+
+private:
+	std::string role;
+	std::atomic<uint64_t> counters[num_counters];
+	std::vector<std::pair<std::string, std::string> > notes;
+	std::vector<std::pair<std::string, uint32_t> > phases; // In the order they first came up
+	std::string cur_phase;
+	uint32_t phase_start, started, finished;
+	uint64_t num_bytes;
+
+	void add_phase(const std::string &name, uint32_t ms)
+	{
+		for(size_t i = 0; i < phases.size(); i++)
+		{
+			if(phases[i].first == name)
+			{
+				phases[i].second += ms;
+				return;
+			}
+		}
+		phases.push_back(std::make_pair(name, ms));
+	}
+
+	static std::string json_string(const std::string &s)
+	{
+		std::string out = "\"";
+		for(size_t i = 0; i < s.size(); i++)
+		{
+			char c = s[i];
+			if(c == '"' || c == '\\')
+				out += '\\';
+			if((unsigned char)c < 0x20)
+				c = ' ';
+			out += c;
+		}
+		return out + "\"";
+	}
+
+	static void write_histogram_json(FILE *f, const char *name, const Histogram &h)
+	{
+		fprintf(f, "    \"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"max\": %u, \"buckets\": [",
+			name, (unsigned long long)h.count(), h.mean(), h.percentile(0.5), h.percentile(0.9), h.percentile(0.99), h.max());
+		// Up to the last one in use, each as [top, count]
+		int last = Histogram::num_buckets - 1;
+		while(last > 0 && h.bucket(last) == 0)
+			last--;
+		for(int b = 0; b <= last; b++)
+			fprintf(f, "%s[%u, %llu]", b ? ", " : "", Histogram::bucket_top(b), (unsigned long long)h.bucket(b));
+		fprintf(f, "]}");
+	}
+
+	void write_json(FILE *f) const
+	{
+		fprintf(f, "  {\n    \"role\": %s,\n", json_string(role).c_str());
+		for(size_t i = 0; i < notes.size(); i++)
+			fprintf(f, "    %s: %s,\n", json_string(notes[i].first).c_str(), json_string(notes[i].second).c_str());
+		fprintf(f, "    \"bytes\": %llu,\n    \"elapsed_ms\": %u,\n    \"goodput_bytes_per_sec\": %.0f,\n",
+			(unsigned long long)num_bytes, elapsed_ms(), goodput());
+		fprintf(f, "    \"counters\": {");
+		for(int c = 0; c < num_counters; c++)
+			fprintf(f, "%s\"%s\": %llu", c ? ", " : "", counter_name(c), (unsigned long long)get((Counter)c));
+		fprintf(f, "},\n    \"phases_ms\": {");
+		for(size_t i = 0; i < phases.size(); i++)
+			fprintf(f, "%s%s: %u", i ? ", " : "", json_string(phases[i].first).c_str(), phases[i].second);
+		fprintf(f, "},\n");
+		write_histogram_json(f, "write_us", write_us);
+		fprintf(f, ",\n");
+		write_histogram_json(f, "retries", retries);
+		fprintf(f, "\n  }");
+	}
+
+	static void write_histogram_csv(FILE *f, const std::string &role, const char *name, const Histogram &h)
+	{
+		fprintf(f, "%s,%s_count,%llu\n", role.c_str(), name, (unsigned long long)h.count());
+		fprintf(f, "%s,%s_mean,%.1f\n", role.c_str(), name, h.mean());
+		fprintf(f, "%s,%s_p50,%u\n", role.c_str(), name, h.percentile(0.5));
+		fprintf(f, "%s,%s_p90,%u\n", role.c_str(), name, h.percentile(0.9));
+		fprintf(f, "%s,%s_p99,%u\n", role.c_str(), name, h.percentile(0.99));
+		fprintf(f, "%s,%s_max,%u\n", role.c_str(), name, h.max());
+		for(int b = 0; b < Histogram::num_buckets; b++)
+		{
+			if(h.bucket(b) > 0)
+				fprintf(f, "%s,%s_le_%u,%llu\n", role.c_str(), name, Histogram::bucket_top(b), (unsigned long long)h.bucket(b));
+		}
+	}
+
+	void write_csv(FILE *f) const
+	{
+		// Notes are free text, so they're quoted
+		for(size_t i = 0; i < notes.size(); i++)
+		{
+			std::string v = "\"";
+			for(size_t j = 0; j < notes[i].second.size(); j++)
+			{
+				char c = notes[i].second[j];
+				if(c == '"')
+					v += '"';
+				v += c == '\n' ? ' ' : c;
+			}
+			fprintf(f, "%s,%s,%s\"\n", role.c_str(), notes[i].first.c_str(), v.c_str());
+		}
+		fprintf(f, "%s,bytes,%llu\n", role.c_str(), (unsigned long long)num_bytes);
+		fprintf(f, "%s,elapsed_ms,%u\n", role.c_str(), elapsed_ms());
+		fprintf(f, "%s,goodput_bytes_per_sec,%.0f\n", role.c_str(), goodput());
+		for(int c = 0; c < num_counters; c++)
+			fprintf(f, "%s,%s,%llu\n", role.c_str(), counter_name(c), (unsigned long long)get((Counter)c));
+		for(size_t i = 0; i < phases.size(); i++)
+			fprintf(f, "%s,phase_%s_ms,%u\n", role.c_str(), phases[i].first.c_str(), phases[i].second);
+		write_histogram_csv(f, role, "write_us", write_us);
+		write_histogram_csv(f, role, "retries", retries);
+	}
+};
+
+/* Passes everything through to a radio, timing and counting the writes on the way */
+class MeteredTransport : public Transport
+{
+public:
+	MeteredTransport(Transport &r, Telemetry &t) : radio(r), tel(t) {}
+
+	bool begin() { return radio.begin(); }
+	void powerDown() { radio.powerDown(); }
+	void printDetails() { radio.printDetails(); }
+
+	void setChannel(uint8_t channel) { radio.setChannel(channel); }
+	void setPALevel(uint8_t level) { radio.setPALevel(level); }
+	bool setDataRate(rf24_datarate_e speed) { return radio.setDataRate(speed); }
+	void setAutoAck(bool enable) { radio.setAutoAck(enable); }
+	void setRetries(uint8_t delay, uint8_t count) { radio.setRetries(delay, count); }
+	void setCRCLength(rf24_crclength_e length) { radio.setCRCLength(length); }
+
+	void openWritingPipe(uint64_t address) { radio.openWritingPipe(address); }
+	void openReadingPipe(uint8_t number, uint64_t address) { radio.openReadingPipe(number, address); }
+	void closeReadingPipe(uint8_t pipe) { radio.closeReadingPipe(pipe); }
+
+	void startListening() { radio.startListening(); }
+	void stopListening() { radio.stopListening(); }
+	uint8_t flush_tx() { return radio.flush_tx(); }
+	uint8_t flush_rx() { return radio.flush_rx(); }
+
+	bool write(const void *buf, uint8_t len)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool ok = radio.write(buf, len);
+		tel.write_us.add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+		uint8_t arc = radio.getARC();
+		tel.retries.add(arc);
+		tel.count(Telemetry::writes);
+		tel.count(Telemetry::write_retries, arc);
+		if(ok == false)
+			tel.count(Telemetry::writes_failed);
+		return ok;
+	}
+	bool writeFast(const void *buf, uint8_t len)
+	{
+		bool ok = radio.writeFast(buf, len);
+		if(ok)
+			tel.count(Telemetry::fast_writes);
+		return ok;
+	}
+	void reUseTX() { radio.reUseTX(); }
+	bool txStandBy() { return radio.txStandBy(); }
+
+	bool available() { return radio.available(); }
+	void read(void *buf, uint8_t len)
+	{
+		radio.read(buf, len);
+		tel.count(Telemetry::frames_read);
+	}
+
+	void enableAckPayload() { radio.enableAckPayload(); }
+	bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len) { return radio.writeAckPayload(pipe, buf, len); }
+	void enableDynamicPayloads() { radio.enableDynamicPayloads(); }
+	uint8_t getDynamicPayloadSize() { return radio.getDynamicPayloadSize(); }
+	bool testRPD() { return radio.testRPD(); }
+	uint8_t getARC() { return radio.getARC(); }
+
+	void waitAvailable(uint32_t timeout_us) { radio.waitAvailable(timeout_us); }
+
+private:
+	Transport &radio;
+	Telemetry &tel;
+};
+
+/* Put a MeteredTransport in front of each radio. held keeps them. */
+inline std::vector<Transport*> meter_radios(const std::vector<Transport*> &radios, Telemetry &t,
+	std::vector<std::unique_ptr<MeteredTransport> > &held)
+{
+	std::vector<Transport*> metered;
+	for(size_t i = 0; i < radios.size(); i++)
+	{
+		held.push_back(std::unique_ptr<MeteredTransport>(new MeteredTransport(*radios[i], t)));
+		metered.push_back(held.back().get());
+	}
+	return metered;
+}
+
+#endif
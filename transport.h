@@ -0,0 +1,195 @@
+/*
+ * Radio transport interface.
+ *
+ * The protocol code in rf24_transfer.cpp only talks to a Transport, so it
+ * can run on top of a real nRF24L01+ (RF24Transport) or on top of the
+ * in-process lossy channel emulator in sim_transport.h.
+ *
+ * The method names deliberately mirror TMRh20's RF24 library so the
+ * protocol reads the same as it did when it used the radio directly.
+ *
+ * Build with -DSIM_ONLY to leave out the RF24 library entirely, e.g. on a
+ * Linux box with no radio attached.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+
+#ifndef SIM_ONLY
+#include <RF24/RF24.h>
+#include "gpio_irq.h"
+#else
+
+// The same values the RF24 library uses, so the rest of the program
+// doesn't need to care which one it was built against.
+typedef enum { RF24_PA_MIN = 0, RF24_PA_LOW, RF24_PA_HIGH, RF24_PA_MAX, RF24_PA_ERROR } rf24_pa_dbm_e;
+typedef enum { RF24_1MBPS = 0, RF24_2MBPS, RF24_250KBPS } rf24_datarate_e;
+typedef enum { RF24_CRC_DISABLED = 0, RF24_CRC_8, RF24_CRC_16 } rf24_crclength_e;
+
+// RF24 provides these on the Pi.
+inline uint32_t millis()
+{
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline void delay(uint32_t ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void delayMicroseconds(uint32_t us)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+#endif
+
+class Transport
+{
+public:
+	virtual ~Transport() {}
+
+	virtual bool begin() = 0;
+	virtual void powerDown() = 0;
+	virtual void printDetails() = 0;
+
+	virtual void setChannel(uint8_t channel) = 0;
+	virtual void setPALevel(uint8_t level) = 0;
+	virtual bool setDataRate(rf24_datarate_e speed) = 0;
+	virtual void setAutoAck(bool enable) = 0;
+	virtual void setRetries(uint8_t delay, uint8_t count) = 0;
+	virtual void setCRCLength(rf24_crclength_e length) = 0;
+
+	virtual void openWritingPipe(uint64_t address) = 0;
+	virtual void openReadingPipe(uint8_t number, uint64_t address) = 0;
+	virtual void closeReadingPipe(uint8_t pipe) = 0;
+
+	virtual void startListening() = 0;
+	virtual void stopListening() = 0;
+	virtual uint8_t flush_tx() = 0;
+	virtual uint8_t flush_rx() = 0;
+
+	// Blocks until the frame is ACKed or the hardware gives up retrying.
+	virtual bool write(const void *buf, uint8_t len) = 0;
+
+	// Queues a frame in the 3 deep TX FIFO and returns without waiting for
+	// its ACK. Returns false, queueing nothing, if the FIFO is full and the
+	// frame at its head has run out of retries.
+	virtual bool writeFast(const void *buf, uint8_t len) = 0;
+	// Gives the frame at the head of the TX FIFO another round of retries.
+	virtual void reUseTX() = 0;
+	// Waits for the TX FIFO to empty. If a frame runs out of retries the
+	// FIFO is flushed and false returned.
+	virtual bool txStandBy() = 0;
+
+	virtual bool available() = 0;
+	virtual void read(void *buf, uint8_t len) = 0;
+
+	// ACK payloads: a listening radio sends back what it has queued (up to 3
+	// of them) with its next ACKs instead of an empty ACK, and they turn up
+	// in the writer's RX FIFO. Both ends have to enable them. The queue is
+	// the TX FIFO, which stopListening() and flush_tx() empty.
+	virtual void enableAckPayload() = 0;
+	virtual bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len) = 0;
+	// Frames go on the air only as long as they were written, instead of
+	// padded out to 32 bytes. Both ends have to enable them, and ACK
+	// payloads turn them on too.
+	virtual void enableDynamicPayloads() = 0;
+	// How long the next frame in the RX FIFO is, with dynamic payloads on
+	virtual uint8_t getDynamicPayloadSize() = 0;
+	// Whether something on the channel was louder than -64dBm the last time
+	// the radio was listening, for finding a quiet one
+	virtual bool testRPD() = 0;
+	// Auto-retries the last frame written took
+	virtual uint8_t getARC() = 0;
+
+	// Sleeps until a frame may have arrived, or timeout_us has passed. Without
+	// anything better to go on this is just a short poll interval.
+	virtual void waitAvailable(uint32_t timeout_us)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(timeout_us < rx_poll_us ? timeout_us : rx_poll_us));
+	}
+
+	// A 3 deep RX FIFO fills in about 1.3ms at 2Mbps, so check well before then
+	enum { rx_poll_us = 200 };
+};
+
+#ifndef SIM_ONLY
+/*
+ * Thin pass-through to a real nRF24L01+. Give it the GPIO the radio's IRQ
+ * pin is wired to and waitAvailable() sleeps until the radio says a frame
+ * arrived, otherwise it polls.
+ */
+class RF24Transport : public Transport
+{
+public:
+	RF24Transport(uint16_t ce_pin, uint16_t cs_pin, uint32_t spi_speed, int irq_pin = -1) : radio(ce_pin, cs_pin, spi_speed)
+	{
+		if(irq_pin >= 0 && irq.open(irq_pin) == false)
+			fprintf(stderr, "Couldn't watch GPIO %d for the radio IRQ, polling instead\n", irq_pin);
+	}
+
+	bool begin()
+	{
+		bool ok = radio.begin();
+		// Only interrupt on received frames, TX results are polled by write()
+		if(irq.ready())
+			radio.maskIRQ(true, true, false);
+		return ok;
+	}
+	void powerDown() { radio.powerDown(); }
+	void printDetails() { radio.printDetails(); }
+
+	void setChannel(uint8_t channel) { radio.setChannel(channel); }
+	void setPALevel(uint8_t level) { radio.setPALevel(level); }
+	bool setDataRate(rf24_datarate_e speed) { return radio.setDataRate(speed); }
+	void setAutoAck(bool enable) { radio.setAutoAck(enable); }
+	void setRetries(uint8_t delay, uint8_t count) { radio.setRetries(delay, count); }
+	void setCRCLength(rf24_crclength_e length) { radio.setCRCLength(length); }
+
+	void openWritingPipe(uint64_t address) { radio.openWritingPipe(address); }
+	void openReadingPipe(uint8_t number, uint64_t address) { radio.openReadingPipe(number, address); }
+	void closeReadingPipe(uint8_t pipe) { radio.closeReadingPipe(pipe); }
+
+	void startListening() { radio.startListening(); }
+	void stopListening() { radio.stopListening(); }
+	uint8_t flush_tx() { return radio.flush_tx(); }
+	uint8_t flush_rx() { return radio.flush_rx(); }
+
+	bool write(const void *buf, uint8_t len) { return radio.write(buf, len); }
+	bool writeFast(const void *buf, uint8_t len) { return radio.writeFast(buf, len); }
+	void reUseTX() { radio.reUseTX(); }
+	bool txStandBy() { return radio.txStandBy(); }
+	bool available() { return radio.available(); }
+	void read(void *buf, uint8_t len) { radio.read(buf, len); }
+	void enableAckPayload() { radio.enableAckPayload(); }
+	bool writeAckPayload(uint8_t pipe, const void *buf, uint8_t len) { return radio.writeAckPayload(pipe, buf, len); }
+	void enableDynamicPayloads() { radio.enableDynamicPayloads(); }
+	bool testRPD() { return radio.testRPD(); }
+	uint8_t getARC() { return radio.getARC(); }
+	uint8_t getDynamicPayloadSize() { return radio.getDynamicPayloadSize(); }
+
+	void waitAvailable(uint32_t timeout_us)
+	{
+		if(irq.ready() == false)
+		{
+			Transport::waitAvailable(timeout_us);
+			return;
+		}
+		irq.wait((timeout_us + 999) / 1000);
+	}
+
+private:
+	RF24 radio;
+	GpioIrq irq;
+};
+#endif
+
+#endif